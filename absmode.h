@@ -22,4 +22,12 @@ int toabs(toabs_state_t *state, parser_block_t *block);
 int fromabs_init(fromabs_state_t *state);
 int fromabs(fromabs_state_t *state, parser_block_t *block);
 
+// All that toabs() and fromabs() do in g90 mode to a block without
+// g90/g91: follow the position
+static inline void abs_follow(toabs_state_t *state, const parser_block_t *block) {
+  for (int i = 0; i < 3; i++)
+    if (block->value_words & bit(WORD_X + i))
+      state->xyz[i] = block->values.xyz[i];
+}
+
 #endif
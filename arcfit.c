@@ -0,0 +1,207 @@
+#include <math.h>
+#include <string.h>
+#include "arcfit.h"
+
+// Fewest moves worth replacing with an arc
+#define ARCFIT_MIN_MOVES 3
+// The circle through three vertices close together is a poor guess, so
+// a longer run is tried up to this many moves past the last that fit
+#define ARCFIT_RETRY 8
+
+void arcfit_init(arcfit_state_t *state, float tol) {
+  memset(state, 0, sizeof(*state));
+  state->tol = tol;
+}
+
+// Pushes block, with its motion mode written out if an arc was pushed
+// since the block's motion mode was last given
+// motion: the motion mode in effect for block
+static int push(arcfit_state_t *state, parser_block_t *block, uint8_t motion, block_ring_t *out) {
+  const uint16_t axes = bit(WORD_X) | bit(WORD_Y) | bit(WORD_Z);
+  if (state->modal_arc && (block->value_words & axes) &&
+      !(block->command_words & bit(MODAL_GROUP_G1))) {
+    block->command_words |= bit(MODAL_GROUP_G1);
+    block->modal.motion = motion;
+  }
+  if (block->command_words & bit(MODAL_GROUP_G1))
+    state->modal_arc = 0;
+  if (block_ring_push_copy(out, block) < 0)
+    return -1;
+  state->blocks_out++;
+  return 1;
+}
+
+// Circle through a, b and c
+// return value: 0 if they are in a line
+static int circle(const float a[2], const float b[2], const float c[2], float center[2]) {
+  double bx = b[0] - a[0], by = b[1] - a[1];
+  double cx = c[0] - a[0], cy = c[1] - a[1];
+  double d = 2 * (bx * cy - by * cx);
+  if (fabs(d) < 1e-12)
+    return 0;
+  double b2 = bx * bx + by * by, c2 = cx * cx + cy * cy;
+  center[0] = a[0] + (cy * b2 - by * c2) / d;
+  center[1] = a[1] + (bx * c2 - cx * b2) / d;
+  return 1;
+}
+
+// Whether the moves from pts[i] to pts[j] fit an arc through pts[i] and
+// pts[j] within the tolerance
+// center, ccw: the arc
+static int fits(const arcfit_state_t *state, size_t i, size_t j, float center[2], int *ccw) {
+  const float (*p)[2] = state->pts;
+  float tol = state->tol;
+  if (!circle(p[i], p[(i + j) / 2], p[j], center))
+    return 0;
+  float r = hypotf(p[i][0] - center[0], p[i][1] - center[1]);
+
+  // A nearly straight run is left to the moves
+  float cx = p[j][0] - p[i][0], cy = p[j][1] - p[i][1];
+  float chord = hypotf(cx, cy);
+  float bulge = chord < tol ? INFINITY : 0;
+
+  float sweep = 0;
+  for (size_t k = i; k < j; k++) {
+    const float *a = p[k], *b = p[k + 1];
+    float mid[2] = { (a[0] + b[0]) / 2, (a[1] + b[1]) / 2 };
+    if (fabsf(hypotf(b[0] - center[0], b[1] - center[1]) - r) > tol ||
+	fabsf(hypotf(mid[0] - center[0], mid[1] - center[1]) - r) > tol)
+      return 0;
+
+    // Every move must turn the same way around the center
+    float ax = a[0] - center[0], ay = a[1] - center[1];
+    float bx = b[0] - center[0], by = b[1] - center[1];
+    float angle = atan2f(ax * by - ay * bx, ax * bx + ay * by);
+    if (k > i && (angle > 0) != (sweep > 0))
+      return 0;
+    sweep += angle;
+
+    if (chord >= tol)
+      bulge = fmaxf(bulge, fabsf(cx * (b[1] - p[i][1]) - cy * (b[0] - p[i][0])) / chord);
+  }
+  if (fabsf(sweep) >= 2 * M_PI - 1e-3f || bulge <= tol)
+    return 0;
+  *ccw = sweep > 0;
+  return 1;
+}
+
+// Pushes the run held back, with arcs where they fit
+// return value: Number of blocks pushed, -1 if out couldn't grow
+static int fit_run(arcfit_state_t *state, block_ring_t *out) {
+  int pushed = 0;
+  size_t i = 0;
+  while (i < state->n) {
+    // Longest arc from pts[i]
+    size_t end = 0;
+    float center[2] = { 0, 0 };
+    int ccw = 0;
+    for (size_t j = i + ARCFIT_MIN_MOVES; j <= state->n; j++) {
+      float c[2];
+      int dir;
+      if (!fits(state, i, j, c, &dir)) {
+	if (j >= (end ? end : i + ARCFIT_MIN_MOVES) + ARCFIT_RETRY)
+	  break;
+	continue;
+      }
+      end = j;
+      center[0] = c[0];
+      center[1] = c[1];
+      ccw = dir;
+    }
+
+    if (!end) {
+      if (push(state, &state->moves[i], MOTION_MODE_LINEAR, out) < 0)
+	return -1;
+      pushed++;
+      i++;
+      continue;
+    }
+
+    // The first move carries the feed and power words of the run
+    parser_block_t *arc = &state->moves[i];
+    arc->command_words |= bit(MODAL_GROUP_G1);
+    arc->modal.motion = ccw ? MOTION_MODE_CCW_ARC : MOTION_MODE_CW_ARC;
+    arc->value_words |= bit(WORD_X) | bit(WORD_Y) | bit(WORD_I) | bit(WORD_J);
+    arc->value_words &= ~bit(WORD_R);
+    arc->values.r = 0;
+    for (int k = 0; k < 2; k++) {
+      arc->values.xyz[k] = state->pts[end][k];
+      arc->values.ijk[k] = center[k] - state->pts[i][k];
+    }
+    if (push(state, arc, arc->modal.motion, out) < 0)
+      return -1;
+    state->modal_arc = 1;
+    state->arcs++;
+    pushed++;
+    i = end;
+  }
+
+  state->pts[0][0] = state->pts[state->n][0];
+  state->pts[0][1] = state->pts[state->n][1];
+  state->n = 0;
+  return pushed;
+}
+
+int arcfit_flush(arcfit_state_t *state, block_ring_t *out) {
+  return fit_run(state, out);
+}
+
+int arcfit(arcfit_state_t *state, parser_block_t *block, block_ring_t *out) {
+  if (block_is_text(block)) {
+    int pushed = fit_run(state, out);
+    if (pushed < 0 || block_ring_push_copy(out, block) < 0)
+      return -1;
+    return pushed + 1;
+  }
+
+  float from[3];
+  memcpy(from, state->values.xyz, sizeof(from));
+  parser_block_t b = *block; // update_state() drops words that are in effect already
+  update_state(&state->modal, &state->values, &b);
+  state->blocks_in++;
+
+  const float *to = state->values.xyz;
+  const uint16_t words = bit(WORD_X) | bit(WORD_Y) | bit(WORD_Z) | bit(WORD_F) | bit(WORD_S);
+  // Under G93, F is the time of each move, which merging would change
+  int vertex = state->modal.motion == MOTION_MODE_LINEAR &&
+    state->modal.feed_rate != FEED_RATE_MODE_INVERSE_TIME &&
+    state->modal.plane_select == PLANE_SELECT_XY &&
+    block->non_modal_command == NON_MODAL_NO_ACTION &&
+    !(block->command_words & ~bit(MODAL_GROUP_G1)) &&
+    (block->value_words & (bit(WORD_X) | bit(WORD_Y))) &&
+    !(block->value_words & ~words) &&
+    to[2] == from[2] && (to[0] != from[0] || to[1] != from[1]);
+
+  int pushed = 0;
+  if (state->n && (!vertex || state->values.f != state->f ||
+		   state->values.s != state->s || state->modal.spindle != state->spindle))
+    pushed = fit_run(state, out);
+  if (pushed < 0)
+    return -1;
+
+  if (!vertex) {
+    if (push(state, block, state->modal.motion, out) < 0)
+      return -1;
+    return pushed + 1;
+  }
+
+  if (!state->n) {
+    state->pts[0][0] = from[0];
+    state->pts[0][1] = from[1];
+    state->f = state->values.f;
+    state->s = state->values.s;
+    state->spindle = state->modal.spindle;
+  }
+  state->moves[state->n] = *block;
+  state->n++;
+  state->pts[state->n][0] = to[0];
+  state->pts[state->n][1] = to[1];
+
+  if (state->n == ARCFIT_MAX_MOVES) {
+    int n = fit_run(state, out);
+    if (n < 0)
+      return -1;
+    pushed += n;
+  }
+  return pushed;
+}
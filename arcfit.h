@@ -0,0 +1,45 @@
+#ifndef ARCFIT_H
+#define ARCFIT_H
+
+#include "gcode.h"
+#include "pipeline.h"
+
+// Replaces runs of short G1 moves along a circle with G2/G3 arcs, for
+// curves that CAM programs write out as polylines. A run is consecutive
+// G1 moves in the xy plane with the same feed, power and spindle state,
+// turning the same way. Each vertex, and the middle of each move, must
+// be within the tolerance of the arc. Arcs are written with I and J.
+// Blocks must be absolute and in mm.
+
+// Vertices held back at most. A longer run is fitted in pieces.
+#define ARCFIT_MAX_MOVES 256
+
+typedef struct {
+  float tol;      // Max distance of the moves from the arc (mm)
+  gc_modal_t modal;
+  gc_values_t values;
+
+  // Run of moves held back, from pts[0] through pts[1..n]
+  parser_block_t moves[ARCFIT_MAX_MOVES];
+  float pts[ARCFIT_MAX_MOVES + 1][2];
+  size_t n;
+  float f, s;     // Feed, power and spindle state of the run
+  uint8_t spindle;
+  int modal_arc;  // An arc was pushed since the last motion word
+
+  unsigned long blocks_in; // Blocks in and out, but for text
+  unsigned long blocks_out;
+  unsigned long arcs;
+} arcfit_state_t;
+
+// tol: max distance of the moves replaced from the arc (mm)
+void arcfit_init(arcfit_state_t *state, float tol);
+
+// return value: Number of blocks pushed, -1 if out couldn't grow
+int arcfit(arcfit_state_t *state, parser_block_t *block, block_ring_t *out);
+
+// Pushes the run held back
+// return value: Number of blocks pushed, -1 if out couldn't grow
+int arcfit_flush(arcfit_state_t *state, block_ring_t *out);
+
+#endif
@@ -0,0 +1,258 @@
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "batch.h"
+
+void batch_list_init(batch_list_t *list) {
+  list->paths = NULL;
+  list->n = list->size = 0;
+}
+
+// Appends a copy of path
+static int append(batch_list_t *list, const char *path) {
+  if (list->n == list->size) {
+    size_t size = list->size ? list->size * 2 : 64;
+    char **paths = realloc(list->paths, size * sizeof(char *));
+    if (!paths)
+      return -1;
+    list->paths = paths;
+    list->size = size;
+  }
+  char *p = strdup(path);
+  if (!p)
+    return -1;
+  list->paths[list->n++] = p;
+  return 0;
+}
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int batch_list_add(batch_list_t *list, const char *path) {
+  struct stat st;
+  if (stat(path, &st) < 0)
+    return -1;
+  if (!S_ISDIR(st.st_mode))
+    return append(list, path);
+
+  DIR *dir = opendir(path);
+  if (!dir)
+    return -1;
+
+  size_t first = list->n;
+  size_t path_len = strlen(path);
+  struct dirent *ent;
+  int ret = 0;
+  while (ret == 0 && (ent = readdir(dir))) {
+    if (ent->d_name[0] == '.')
+      continue;
+    char *name = malloc(path_len + strlen(ent->d_name) + 2);
+    if (!name) {
+      ret = -1;
+      break;
+    }
+    sprintf(name, "%s/%s", path, ent->d_name);
+    if (stat(name, &st) == 0 && S_ISREG(st.st_mode))
+      ret = append(list, name);
+    free(name);
+  }
+  closedir(dir);
+
+  qsort(list->paths + first, list->n - first, sizeof(char *), compare_names);
+  return ret;
+}
+
+int batch_list_read(batch_list_t *list, FILE *fp) {
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  int ret = 0;
+
+  errno = 0;
+  while (ret == 0 && (len = getline(&line, &size, fp)) >= 0) {
+    while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = 0;
+    if (len)
+      ret = append(list, line);
+  }
+  if (ret == 0 && ferror(fp))
+    ret = -1;
+  free(line);
+  return ret;
+}
+
+void batch_list_free(batch_list_t *list) {
+  for (size_t i = 0; i < list->n; i++)
+    free(list->paths[i]);
+  free(list->paths);
+  batch_list_init(list);
+}
+
+
+typedef struct {
+  const batch_list_t *list;
+  const char *out_dir;
+  const char **clash;     // Earlier input with the same name, per input
+  batch_job_t job;
+  void *arg;
+  atomic_size_t next;     // Index of the next file to pick up
+
+  pthread_mutex_t lock;   // Guards the rest
+  int status;             // Highest exit status so far
+  unsigned long bytes;
+  unsigned long lines;
+  size_t failed;
+} batch_t;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static const char *base_name(const char *path) {
+  const char *base = strrchr(path, '/');
+  return base ? base + 1 : path;
+}
+
+// An input's output name and its index in the list
+typedef struct {
+  const char *base;
+  size_t i;
+} output_name_t;
+
+static int compare_output_names(const void *a, const void *b) {
+  const output_name_t *na = a, *nb = b;
+  int c = strcmp(na->base, nb->base);
+  // Same names stay in list order
+  return c ? c : (na->i > nb->i) - (na->i < nb->i);
+}
+
+// Sets b->clash[i] to the first input with the same name as input i, if
+// there is one before it, as both would be written to the same output
+// return value: 0 on success, -1 if out of memory
+static int find_clashes(batch_t *b) {
+  size_t n = b->list->n;
+  b->clash = calloc(n ? n : 1, sizeof(char *));
+  output_name_t *names = malloc((n ? n : 1) * sizeof(output_name_t));
+  if (!b->clash || !names) {
+    free(names);
+    return -1;
+  }
+  for (size_t i = 0; i < n; i++) {
+    names[i].base = base_name(b->list->paths[i]);
+    names[i].i = i;
+  }
+  qsort(names, n, sizeof(output_name_t), compare_output_names);
+  size_t first = 0;
+  for (size_t k = 1; k < n; k++) {
+    if (strcmp(names[k].base, names[first].base))
+      first = k;
+    else
+      b->clash[names[k].i] = b->list->paths[names[first].i];
+  }
+  free(names);
+  return 0;
+}
+
+// Runs the job on one file and reports it
+static void run_one(batch_t *b, size_t i) {
+  const char *in_path = b->list->paths[i];
+  const char *base = base_name(in_path);
+
+  batch_stats_t stats = { 0, 0 };
+  double start = now();
+  int status = 3;
+  char *out_path = malloc(strlen(b->out_dir) + strlen(base) + 2);
+  if (out_path) {
+    sprintf(out_path, "%s/%s", b->out_dir, base);
+    struct stat in_st, out_st;
+    if (b->clash[i]) {
+      fprintf(stderr, "batch: %s has the same output name as %s\n", in_path, b->clash[i]);
+    } else if (stat(in_path, &in_st) == 0 && stat(out_path, &out_st) == 0 &&
+	       in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino) {
+      // Opening the output would truncate the input
+      fprintf(stderr, "batch: %s would be written over itself\n", in_path);
+    } else {
+      status = b->job(b->arg, in_path, out_path, &stats);
+    }
+    free(out_path);
+  }
+  double t = now() - start;
+
+  if (status)
+    fprintf(stderr, "batch: %s failed (%d)\n", in_path, status);
+  else
+    fprintf(stderr, "batch: %s: %lu lines, %.3f s, %.1f MB/s\n",
+	    in_path, stats.lines, t, t > 0 ? stats.bytes / t / 1e6 : 0);
+
+  pthread_mutex_lock(&b->lock);
+  b->bytes += stats.bytes;
+  b->lines += stats.lines;
+  if (status) {
+    b->failed++;
+    if (status > b->status)
+      b->status = status;
+  }
+  pthread_mutex_unlock(&b->lock);
+}
+
+static void *worker(void *arg) {
+  batch_t *b = arg;
+  size_t i;
+  while ((i = atomic_fetch_add(&b->next, 1)) < b->list->n)
+    run_one(b, i);
+  return NULL;
+}
+
+int batch_run(const batch_list_t *list, const char *out_dir, int workers,
+	      batch_job_t job, void *arg) {
+  batch_t b;
+  b.list = list;
+  b.out_dir = out_dir;
+  b.job = job;
+  b.arg = arg;
+  atomic_init(&b.next, 0);
+  pthread_mutex_init(&b.lock, NULL);
+  b.status = 0;
+  b.bytes = b.lines = 0;
+  b.failed = 0;
+  if (find_clashes(&b) < 0) {
+    fprintf(stderr, "batch: out of memory\n");
+    free(b.clash);
+    pthread_mutex_destroy(&b.lock);
+    return 3;
+  }
+
+  if ((size_t)workers > list->n)
+    workers = list->n;
+  pthread_t *threads = calloc(workers, sizeof(pthread_t));
+  int started = 0;
+
+  double start = now();
+  if (threads)
+    while (started < workers && pthread_create(&threads[started], NULL, worker, &b) == 0)
+      started++;
+  // Without threads, do it all on this thread
+  if (!started)
+    worker(&b);
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  double t = now() - start;
+  free(threads);
+
+  fprintf(stderr, "batch: %zu files, %zu failed, %lu lines, %.1f MB in %.3f s on %d threads: "
+	  "%.1f MB/s, %.0f lines/s\n",
+	  list->n, b.failed, b.lines, b.bytes / 1e6, t, started ? started : 1,
+	  t > 0 ? b.bytes / t / 1e6 : 0, t > 0 ? b.lines / t : 0);
+
+  free(b.clash);
+  pthread_mutex_destroy(&b.lock);
+  return b.status;
+}
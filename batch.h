@@ -0,0 +1,47 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+// Runs many input files through gfilter on a pool of worker threads,
+// a file at a time per worker, and reports the throughput of each file
+// and of the whole batch.
+
+// Amount of input a job got through
+typedef struct {
+  unsigned long bytes;
+  unsigned long lines;
+} batch_stats_t;
+
+// Filters in_path into out_path. Called on the worker threads, so it
+// must keep all its state to itself.
+// return value: exit status, 0 on success
+typedef int (*batch_job_t)(void *arg, const char *in_path, const char *out_path,
+			   batch_stats_t *stats);
+
+typedef struct {
+  char **paths;
+  size_t n;
+  size_t size;
+} batch_list_t;
+
+void batch_list_init(batch_list_t *list);
+
+// Adds a file, or the regular files in a directory, in name order
+// return value: 0 on success, -1 with errno set on failure
+int batch_list_add(batch_list_t *list, const char *path);
+
+// Adds the files named on each line of fp
+// return value: 0 on success, -1 with errno set on failure
+int batch_list_read(batch_list_t *list, FILE *fp);
+
+void batch_list_free(batch_list_t *list);
+
+// Runs job over every file in list on the given number of threads. Each
+// output goes to out_dir, under the name of its input.
+// return value: 0 if every job succeeded, the highest exit status otherwise
+int batch_run(const batch_list_t *list, const char *out_dir, int workers,
+	      batch_job_t job, void *arg);
+
+#endif
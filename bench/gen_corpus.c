@@ -0,0 +1,238 @@
+// Generates a synthetic G-code file for benchmarking. The output only
+// depends on the arguments, so results from different builds can be
+// compared.
+//
+// Usage: gen_corpus <kind> <lines>
+// kinds:
+//   raster    dense laser raster engraving, one short G1 per pixel run
+//   vector    laser cut contours of lines and arcs, R and IJ form
+//   drag      drag knife contours with sharp corners and Z lifts
+//   inch      G20 G91 incremental program
+//   comments  comment heavy, loosely formatted output of a hand editor
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+// xorshift64*, fixed seed
+static uint32_t rnd(void) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return (rng_state * 0x2545f4914f6cdd1dull) >> 32;
+}
+
+// uniform in [lo, hi)
+static double uniform(double lo, double hi) {
+  return lo + (hi - lo) * (rnd() / 4294967296.0);
+}
+
+// v rounded to the given number of decimals, so that positions stay
+// exactly where the printed program puts them
+static double rounded(double v, int decimals) {
+  double scale = pow(10, decimals);
+  return round(v * scale) / scale;
+}
+
+static long lines_left;
+
+// Prints one line of output
+static void emit(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+  putchar('\n');
+  lines_left--;
+}
+
+static void raster(void) {
+  double y = 0;
+  int dir = 1;
+
+  emit("G21G90");
+  emit("M4S0");
+  emit("G0X0Y0");
+  emit("G1F3000");
+  while (lines_left > 2) {
+    double x = dir > 0 ? 0 : 100;
+    emit("G0X%.3fY%.3f", x, y);
+    for (int i = 0; i < 200 && lines_left > 2; i++) {
+      x += dir * uniform(0.1, 1.0);
+      emit("G1X%.3fS%d", x, (int) uniform(0, 1001));
+    }
+    y += 0.1;
+    dir = -dir;
+  }
+  emit("M5");
+  emit("M30");
+}
+
+// Arc from the current position (*x, *y) in R form
+static void arc_r(double *x, double *y) {
+  double dx = uniform(1, 5), dy = uniform(-3, 3);
+  double d = hypot(dx, dy);
+  double r = d / 2 * uniform(1.1, 3);
+  *x = rounded(*x + dx, 4);
+  *y = rounded(*y + dy, 4);
+  emit("%s X%.4f Y%.4f R%.4f", rnd() & 1 ? "G2" : "G3", *x, *y, rnd() % 4 ? r : -r);
+}
+
+// Arc from the current position (*x, *y) in IJ form
+static void arc_ij(double *x, double *y) {
+  double r = uniform(0.5, 4), a = uniform(0, 2 * M_PI);
+  double i = rounded(r * cos(a), 6), j = rounded(r * sin(a), 6);
+  double cx = *x + i, cy = *y + j;
+  r = hypot(i, j);
+  a = atan2(-j, -i) + uniform(0.2, 2);
+  *x = rounded(cx + r * cos(a), 6);
+  *y = rounded(cy + r * sin(a), 6);
+  emit("%s X%.6f Y%.6f I%.6f J%.6f", rnd() & 1 ? "G2" : "G3", *x, *y, i, j);
+}
+
+static void vector(void) {
+  double x = 0, y = 0;
+
+  emit("G21 G90");
+  emit("G0 X0 Y0");
+  while (lines_left > 2) {
+    x = rounded(uniform(0, 300), 4);
+    y = rounded(uniform(0, 300), 4);
+    emit("G0 X%.4f Y%.4f", x, y);
+    emit("M3 S%d", (int) uniform(300, 1001));
+    int n = 10 + rnd() % 40;
+    for (int i = 0; i < n && lines_left > 3; i++) {
+      switch (rnd() % 4) {
+      case 0:
+	arc_r(&x, &y);
+	break;
+      case 1:
+	arc_ij(&x, &y);
+	break;
+      default:
+	x = rounded(x + uniform(-5, 5), 4);
+	y = rounded(y + uniform(-5, 5), 4);
+	emit("G1 X%.4f Y%.4f F%d", x, y, rnd() % 8 ? 1200 : 600);
+      }
+    }
+    emit("M5");
+  }
+  emit("M30");
+}
+
+static void drag(void) {
+  double x = 0, y = 0;
+
+  emit("G21 G90");
+  emit("G0 Z5");
+  while (lines_left > 2) {
+    double cx = uniform(20, 280), cy = uniform(20, 280);
+    int corners = 3 + rnd() % 6;
+    double r = uniform(5, 20), a0 = uniform(0, 2 * M_PI);
+    x = rounded(cx + r * cos(a0), 3);
+    y = rounded(cy + r * sin(a0), 3);
+    emit("G0 X%.3f Y%.3f", x, y);
+    emit("G1 Z-0.5 F300");
+    for (int i = 1; i <= corners && lines_left > 3; i++) {
+      double a = a0 + 2 * M_PI * i / corners;
+      if (rnd() % 5 == 0) {
+	arc_ij(&x, &y);
+      } else {
+	x = rounded(cx + r * cos(a), 3);
+	y = rounded(cy + r * sin(a), 3);
+	emit("G1 X%.3f Y%.3f F1500", x, y);
+      }
+    }
+    emit("G0 Z5");
+  }
+  emit("M30");
+}
+
+static void inch(void) {
+  emit("G20 G91");
+  emit("M3 S800");
+  while (lines_left > 2) {
+    double dx, dy;
+    switch (rnd() % 8) {
+    case 0:
+      dx = uniform(0.05, 0.2);
+      dy = uniform(-0.1, 0.1);
+      emit("G2 X%.5f Y%.5f R%.5f", dx, dy, hypot(dx, dy) * uniform(0.6, 1.5));
+      break;
+    case 1:
+      emit("G0 X%.5f Y%.5f", uniform(-1, 1), uniform(-1, 1));
+      break;
+    case 2:
+      // switch to absolute for a move and back
+      emit("G90 G1 X%.5f Y%.5f F40", uniform(0, 10), uniform(0, 10));
+      emit("G91");
+      break;
+    default:
+      emit("G1 X%.5f Y%.5f F%d", uniform(-0.2, 0.2), uniform(-0.2, 0.2), rnd() % 4 ? 40 : 20);
+    }
+  }
+  emit("M5");
+  emit("M30");
+}
+
+static void comments(void) {
+  double x = 0, y = 0;
+  long n = 10;
+
+  emit("%%");
+  emit("(Generated by hand, mostly)");
+  emit("g21 g90 ; metric, absolute");
+  while (lines_left > 2) {
+    switch (rnd() % 6) {
+    case 0:
+      emit("(---- contour %ld, pass %d of 3 ----)", n, (int) (rnd() % 3) + 1);
+      break;
+    case 1:
+      emit("; move to next position, check clamps before continuing");
+      break;
+    case 2:
+      emit("");
+      break;
+    default:
+      x += uniform(-5, 5);
+      y += uniform(-5, 5);
+      emit("N%ld g1 x%.3f  y%.3f (cut) f900 ; feed", n, x, y);
+    }
+    n += 10;
+  }
+  emit("m5");
+  emit("m30");
+}
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: gen_corpus <raster|vector|drag|inch|comments> <lines>\n");
+    return 1;
+  }
+  lines_left = atol(argv[2]);
+
+  if (!strcmp(argv[1], "raster"))
+    raster();
+  else if (!strcmp(argv[1], "vector"))
+    vector();
+  else if (!strcmp(argv[1], "drag"))
+    drag();
+  else if (!strcmp(argv[1], "inch"))
+    inch();
+  else if (!strcmp(argv[1], "comments"))
+    comments();
+  else {
+    fprintf(stderr, "Unknown corpus kind %s\n", argv[1]);
+    return 1;
+  }
+  return 0;
+}
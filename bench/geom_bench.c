@@ -0,0 +1,175 @@
+// Microbenchmark for the batch geometry kernels in geom.c. Checks every
+// kernel set the CPU can run against normarcs(), calcv(), hypot_f() and
+// to_mm() on random moves, bit for bit, and prints the time per move of
+// each kernel in each set.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "../geom.h"
+#include "../mm_mode.h"
+#include "../nuts_bolts.h"
+
+#define MOVES 4096
+#define ROUNDS 2000
+#define REPEATS 7
+
+static float x[MOVES], y[MOVES], r_in[MOVES], r[MOVES], i[MOVES], j[MOVES];
+static float dx[MOVES], dy[MOVES], radius[MOVES];
+static float v0x[MOVES], v0y[MOVES], v1x[MOVES], v1y[MOVES], c[MOVES], len[MOVES], v[MOVES];
+static uint8_t ccw[MOVES];
+
+// Reference results
+static float ref_r[MOVES], ref_i[MOVES], ref_j[MOVES];
+static float ref_v0x[MOVES], ref_v0y[MOVES], ref_v1x[MOVES], ref_v1y[MOVES];
+static float ref_c[MOVES], ref_len[MOVES], ref_mm[MOVES], ref_in[MOVES];
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static float urand(float lo, float hi) {
+  return lo + (hi - lo) * (rand() / (float) RAND_MAX);
+}
+
+static int differ(const float *a, const float *b) {
+  return memcmp(a, b, sizeof(float) * MOVES) != 0;
+}
+
+// Resets the inputs the kernels write to
+static void reset(void) {
+  memcpy(r, r_in, sizeof(r));
+  memset(v1x, 0, sizeof(v1x));
+  memset(v1y, 0, sizeof(v1y));
+  memcpy(v, x, sizeof(v));
+}
+
+// return value: number of kernels of set k that don't match the reference
+static int check(const geom_kernels_t *g) {
+  int bad = 0;
+  reset();
+  g->centers(MOVES, x, y, r, ccw, i, j);
+  bad += differ(r, ref_r) || differ(i, ref_i) || differ(j, ref_j);
+  g->tangents(MOVES, dx, dy, i, j, radius, ccw, v0x, v0y, v1x, v1y);
+  bad += differ(v0x, ref_v0x) || differ(v0y, ref_v0y) ||
+    differ(v1x, ref_v1x) || differ(v1y, ref_v1y);
+  g->lengths(MOVES, dx, dy, len);
+  bad += differ(len, ref_len);
+  g->junction_cos(MOVES - 1, ref_v1x, ref_v1y, ref_v0x + 1, ref_v0y + 1, c);
+  bad += memcmp(c, ref_c, sizeof(float) * (MOVES - 1)) != 0;
+  g->scale(MOVES, v, 25.4);
+  bad += differ(v, ref_mm);
+  g->unscale(MOVES, v, 25.4);
+  bad += differ(v, ref_in);
+  return bad;
+}
+
+// return value: best time per move over REPEATS runs, in ns, of kernel
+// number which of g
+static double run(const geom_kernels_t *g, int which) {
+  double best = 1e30;
+  for (int k = 0; k < REPEATS; k++) {
+    reset();
+    double t0 = now();
+    for (int n = 0; n < ROUNDS; n++) {
+      switch (which) {
+      case 0:
+	memcpy(r, r_in, sizeof(r));
+	g->centers(MOVES, x, y, r, ccw, i, j);
+	break;
+      case 1:
+	g->tangents(MOVES, dx, dy, i, j, radius, ccw, v0x, v0y, v1x, v1y);
+	break;
+      case 2:
+	g->lengths(MOVES, dx, dy, len);
+	break;
+      case 3:
+	g->junction_cos(MOVES - 1, v1x, v1y, v0x + 1, v0y + 1, c);
+	break;
+      case 4:
+	g->scale(MOVES, v, 25.4);
+	g->unscale(MOVES, v, 25.4);
+	break;
+      }
+    }
+    double t = (now() - t0) / ((double) ROUNDS * MOVES) * 1e9;
+    if (t < best)
+      best = t;
+  }
+  return best;
+}
+
+int main(void) {
+  srand(1);
+  for (int k = 0; k < MOVES; k++) {
+    // R arcs reaching up to 99% of the diameter, with either sign of R
+    float rr = urand(1, 100);
+    float a = urand(0, 2 * M_PI), d = 2 * rr * urand(0, 0.99);
+    x[k] = d * cosf(a);
+    y[k] = d * sinf(a);
+    r_in[k] = rand() % 4 ? rr : -rr;
+    ccw[k] = rand() % 2;
+
+    // Moves for the tangents: half arcs, some of zero length
+    dx[k] = x[k];
+    dy[k] = y[k];
+    if (rand() % 8 == 0)
+      dx[k] = dy[k] = 0;
+  }
+
+  // The reference results, block by block
+  for (int k = 0; k < MOVES; k++) {
+    parser_block_t b;
+    memset(&b, 0, sizeof(b));
+    b.value_words = bit(WORD_R);
+    b.values.r = r_in[k];
+    uint8_t motion = ccw[k] ? MOTION_MODE_CCW_ARC : MOTION_MODE_CW_ARC;
+    normarcs(&b, motion, x[k], y[k]);
+    ref_r[k] = b.values.r;
+    ref_i[k] = b.values.ijk[0];
+    ref_j[k] = b.values.ijk[1];
+
+    // Every other move a line
+    radius[k] = k % 2 ? 0 : ref_r[k];
+    b.values.r = radius[k];
+    float mv0[2], mv1[2] = { 0, 0 };
+    calcv(&b, motion, dx[k], dy[k], mv0, mv1);
+    ref_v0x[k] = mv0[0];
+    ref_v0y[k] = mv0[1];
+    ref_v1x[k] = mv1[0];
+    ref_v1y[k] = mv1[1];
+
+    ref_len[k] = hypot_f(dx[k], dy[k]);
+
+    to_mm_state_t units = { UNITS_MODE_INCHES };
+    memset(&b, 0, sizeof(b));
+    b.values.xyz[0] = x[k];
+    to_mm(&units, &b);
+    ref_mm[k] = b.values.xyz[0];
+    ref_in[k] = ref_mm[k];
+    ref_in[k] /= 25.4;
+  }
+  for (int k = 0; k + 1 < MOVES; k++)
+    ref_c[k] = -(ref_v1x[k] * ref_v0x[k + 1] + ref_v1y[k] * ref_v0y[k + 1]);
+
+  static const char *names[] = { "centers", "tangents", "lengths", "junction_cos", "scale" };
+  int mismatches = 0;
+  double base[5];
+  for (int s = 0; geom_kernels(s); s++) {
+    const geom_kernels_t *g = geom_kernels(s);
+    int bad = check(g);
+    mismatches += bad;
+    for (int w = 0; w < 5; w++) {
+      double t = run(g, w);
+      if (s == 0)
+	base[w] = t;
+      printf("%-7s %-13s %6.2f ns/move  (%.2fx scalar)\n", g->name, names[w], t, base[w] / t);
+    }
+    printf("%-7s mismatches: %d\n", g->name, bad);
+  }
+  return mismatches != 0;
+}
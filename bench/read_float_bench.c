@@ -0,0 +1,144 @@
+// Microbenchmark for read_float(). Parses a fixed set of typical CAM
+// coordinate words many times with the original grbl routine, the
+// digit-at-a-time fallback and the SWAR fast path, and prints the time
+// per number for each.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include "../nuts_bolts.h"
+#include "../scan.h"
+
+#define NUMBERS 4096
+#define ROUNDS 400
+#define REPEATS 7
+
+// read_float() as it was before the fast path, for comparison
+static uint8_t read_float_orig(char *line, uint16_t *char_counter, float *float_ptr)
+{
+  char *ptr = line + *char_counter;
+  unsigned char c;
+  c = *ptr++;
+  bool isnegative = false;
+  if (c == '-') {
+    isnegative = true;
+    c = *ptr++;
+  } else if (c == '+') {
+    c = *ptr++;
+  }
+  uint32_t intval = 0;
+  int8_t exp = 0;
+  uint8_t ndigit = 0;
+  bool isdecimal = false;
+  while(1) {
+    c -= '0';
+    if (c <= 9) {
+      ndigit++;
+      if (ndigit <= 8) {
+        if (isdecimal) { exp--; }
+        intval = (((intval << 2) + intval) << 1) + c;
+      } else {
+        if (!(isdecimal)) { exp++; }
+      }
+    } else if (c == (('.'-'0') & 0xff)  &&  !(isdecimal)) {
+      isdecimal = true;
+    } else {
+      break;
+    }
+    c = *ptr++;
+  }
+  if (!ndigit) { return(false); };
+  float fval;
+  fval = (float)intval;
+  if (fval != 0) {
+    while (exp <= -2) {
+      fval *= 0.01;
+      exp += 2;
+    }
+    if (exp < 0) {
+      fval *= 0.1;
+    } else if (exp > 0) {
+      do {
+        fval *= 10.0;
+      } while (--exp > 0);
+    }
+  }
+  if (isnegative) {
+    *float_ptr = -fval;
+  } else {
+    *float_ptr = fval;
+  }
+  *char_counter = ptr - line - 1;
+  return(true);
+}
+
+typedef uint8_t (*read_float_fn)(char *, uint16_t *, float *);
+
+static char lines[NUMBERS][32 + LINE_BUFFER_PADDING];
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// return value: best time per number over REPEATS runs, in ns
+static double run(read_float_fn fn, float *sum) {
+  double best = 1e30;
+  for (int k = 0; k < REPEATS; k++) {
+    double t0 = now();
+    float s = 0;
+    for (int r = 0; r < ROUNDS; r++)
+      for (int i = 0; i < NUMBERS; i++) {
+	uint16_t cc = 1; // skip the word letter
+	float v;
+	fn(lines[i], &cc, &v);
+	s += v;
+      }
+    *sum = s;
+    double t = (now() - t0) / ((double) ROUNDS * NUMBERS) * 1e9;
+    if (t < best)
+      best = t;
+  }
+  return best;
+}
+
+int main(void) {
+  srand(1);
+  for (int i = 0; i < NUMBERS; i++) {
+    // mostly X123.4567 style coordinates, some integers and short feeds
+    switch (rand() % 8) {
+    case 0:
+      snprintf(lines[i], 32, "F%d", 100 + rand() % 5000);
+      break;
+    case 1:
+      snprintf(lines[i], 32, "S%d", rand() % 1001);
+      break;
+    default:
+      snprintf(lines[i], 32, "X%s%d.%04d", rand() % 4 ? "" : "-", rand() % 1000, rand() % 10000);
+    }
+  }
+
+  int mismatches = 0;
+  for (int i = 0; i < NUMBERS; i++) {
+    uint16_t c1 = 1, c2 = 1;
+    float v1, v2;
+    read_float(lines[i], &c1, &v1);
+    read_float_scalar(lines[i], &c2, &v2);
+    if (c1 != c2 || memcmp(&v1, &v2, sizeof(v1)))
+      mismatches++;
+  }
+
+  float s0, s1, s2;
+  double t_orig = run(read_float_orig, &s0);
+  double t_scalar = run(read_float_scalar, &s1);
+  double t_fast = run(read_float, &s2);
+
+  printf("read_float_orig    %6.2f ns/number\n", t_orig);
+  printf("read_float_scalar  %6.2f ns/number\n", t_scalar);
+  printf("read_float         %6.2f ns/number  (%.2fx faster than orig)\n", t_fast, t_orig / t_fast);
+  printf("fast/scalar mismatches: %d\n", mismatches);
+  return mismatches != 0;
+}
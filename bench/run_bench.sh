@@ -0,0 +1,38 @@
+#!/bin/sh
+# Runs gfilter over each corpus file in laser and drag knife mode and
+# prints one JSON object per run: input size, time (best of REPEATS)
+# and throughput in MB/s and input blocks (lines) per second.
+#
+# Usage: run_bench.sh <gfilter [options]> <corpus files...>
+
+GFILTER=$1
+shift
+REPEATS=${REPEATS:-3}
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+
+for file in "$@"; do
+  corpus=$(basename "$file" .nc)
+  bytes=$(wc -c < "$file")
+  lines=$(wc -l < "$file")
+  for mode in "-l 1000" "-d 0.5"; do
+    best=
+    i=0
+    while [ $i -lt $REPEATS ]; do
+      start=$(date +%s%N)
+      if ! $GFILTER $mode "$file" > /dev/null 2>&1; then
+	echo "$GFILTER $mode $file failed" >&2
+	exit 1
+      fi
+      end=$(date +%s%N)
+      ns=$((end - start))
+      if [ -z "$best" ] || [ $ns -lt $best ]; then
+	best=$ns
+      fi
+      i=$((i + 1))
+    done
+    awk -v c="$corpus" -v m="$mode" -v b="$bytes" -v l="$lines" -v ns="$best" -v commit="$COMMIT" 'BEGIN {
+      s = ns / 1e9
+      printf "{\"commit\":\"%s\",\"corpus\":\"%s\",\"mode\":\"%s\",\"bytes\":%d,\"blocks\":%d,\"seconds\":%.4f,\"mb_per_s\":%.2f,\"blocks_per_s\":%.0f}\n", commit, c, m, b, l, s, b / s / 1e6, l / s
+    }'
+  done
+done
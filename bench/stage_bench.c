@@ -0,0 +1,147 @@
+// Microbenchmark for the mode stages. Parses a G-code file and runs its
+// blocks through to_mm and toabs once, then times lasermode() and
+// dragmode() alone over the blocks, and prints the time per input block.
+//
+// Usage: stage_bench <file.nc>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../gcode.h"
+#include "../scan.h"
+#include "../mm_mode.h"
+#include "../absmode.h"
+#include "../lasermode.h"
+#include "../dragmode.h"
+#include "../pipeline.h"
+
+#define REPEATS 7
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Reads the whole file, with room for the parser's padding after it
+static char *read_file(const char *path, size_t *len) {
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return NULL;
+  fseek(f, 0, SEEK_END);
+  long n = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char *buf = calloc(n + LINE_BUFFER_PADDING, 1);
+  if (buf && fread(buf, 1, n, f) != (size_t) n) {
+    free(buf);
+    buf = NULL;
+  }
+  fclose(f);
+  *len = n;
+  return buf;
+}
+
+// Parses all lines, keeping the blocks as the mode stages see them
+// return value: number of blocks
+static size_t load_blocks(const char *buf, size_t len, parser_block_t **blocks) {
+  size_t size = 1024, n = 0;
+  parser_block_t *b = malloc(size * sizeof(parser_block_t));
+  gc_line_info_t *info = malloc(size * sizeof(gc_line_info_t));
+  to_mm_state_t to_mm_state;
+  toabs_state_t toabs_state;
+  to_mm_init(&to_mm_state);
+  toabs_init(&toabs_state);
+
+  while (len) {
+    if (size - n < 1024) {
+      size *= 2;
+      b = realloc(b, size * sizeof(parser_block_t));
+      info = realloc(info, size * sizeof(gc_line_info_t));
+    }
+    size_t consumed, first = n;
+    size_t nlines = gc_parse_lines(buf, len, b + first, info, 1024, &consumed, NULL);
+    if (!consumed)
+      break;
+    for (size_t l = 0; l < nlines; l++)
+      if (info[l].kind == GC_LINE_BLOCK) {
+	b[n] = b[first + l];
+	to_mm(&to_mm_state, &b[n]);
+	toabs(&toabs_state, &b[n]);
+	n++;
+      }
+    buf += consumed;
+    len -= consumed;
+  }
+  free(info);
+  *blocks = b;
+  return n;
+}
+
+// return value: best time per block over REPEATS runs, in ns
+static double run(int laser, const parser_block_t *blocks, size_t n, size_t *out_blocks) {
+  double best = 1e30;
+  parser_block_t block;
+  block_ring_t ring;
+  block_ring_init(&ring);
+
+  for (int k = 0; k < REPEATS; k++) {
+    laser_state_t laser_state;
+    drag_state_t drag_state;
+    lasermode_init(&laser_state, 1000, 2);
+    dragmode_init(&drag_state, 0.5, 0, 2);
+    size_t total = 0;
+
+    double t0 = now();
+    for (size_t i = 0; i < n; i++) {
+      block = blocks[i];
+      if (laser)
+	lasermode(&laser_state, &block, &ring);
+      else
+	dragmode(&drag_state, &block, &ring);
+      total += ring.tail - ring.head;
+      ring.head = ring.tail;
+    }
+    if (laser) {
+      lasermode_flush(&laser_state, &ring);
+      lasermode_free(&laser_state);
+      total += ring.tail - ring.head;
+      ring.head = ring.tail;
+    }
+    double t = (now() - t0) / n * 1e9;
+    if (t < best)
+      best = t;
+    *out_blocks = total;
+  }
+  block_ring_free(&ring);
+  return best;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: stage_bench <file.nc>\n");
+    return 1;
+  }
+  size_t len;
+  char *buf = read_file(argv[1], &len);
+  if (!buf) {
+    perror(argv[1]);
+    return 1;
+  }
+  parser_block_t *blocks;
+  size_t n = load_blocks(buf, len, &blocks);
+  if (!n) {
+    fprintf(stderr, "%s: no blocks\n", argv[1]);
+    return 1;
+  }
+
+  size_t out;
+  double t = run(1, blocks, n, &out);
+  printf("%s: lasermode %6.2f ns/block (%zu -> %zu blocks)\n", argv[1], t, n, out);
+  t = run(0, blocks, n, &out);
+  printf("%s: dragmode  %6.2f ns/block (%zu -> %zu blocks)\n", argv[1], t, n, out);
+
+  free(blocks);
+  free(buf);
+  return 0;
+}
@@ -0,0 +1,210 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cache.h"
+
+#define CACHE_MAGIC "GFCACHE"
+
+// File layout: header, lines[nlines], blocks[nblocks], text[text_len]
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t block_size;  // sizeof(parser_block_t), catches layout changes
+  uint64_t hash;
+  uint64_t input_len;
+  uint64_t nlines;
+  uint64_t nblocks;
+  uint64_t text_len;
+} cache_header_t;
+
+uint64_t cache_hash(const char *data, size_t len) {
+  // FNV-1a
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char) data[i];
+    h *= 0x100000001b3ull;
+  }
+  return h;
+}
+
+int cache_open(cache_t *cache, const char *path, uint64_t hash, uint64_t input_len) {
+  memset(cache, 0, sizeof(*cache));
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(cache_header_t)) {
+    close(fd);
+    return -1;
+  }
+  void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return -1;
+  cache->map = p;
+  cache->map_len = st.st_size;
+
+  const cache_header_t *h = p;
+  if (memcmp(h->magic, CACHE_MAGIC, sizeof(h->magic)) ||
+      h->version != CACHE_VERSION ||
+      h->block_size != sizeof(parser_block_t) ||
+      h->hash != hash ||
+      h->input_len != input_len)
+    goto invalid;
+
+  // Make sure the counts agree with the file size before trusting them
+  size_t avail = cache->map_len - sizeof(*h);
+  if (h->nlines > avail / sizeof(cache_line_t))
+    goto invalid;
+  avail -= h->nlines * sizeof(cache_line_t);
+  if (h->nblocks > avail / sizeof(parser_block_t))
+    goto invalid;
+  avail -= h->nblocks * sizeof(parser_block_t);
+  if (h->text_len != avail || (h->text_len && ((char *) p)[cache->map_len - 1] != 0))
+    goto invalid;
+
+  cache->nlines = h->nlines;
+  cache->nblocks = h->nblocks;
+  cache->text_len = h->text_len;
+  cache->lines = (cache_line_t *) (h + 1);
+  cache->blocks = (parser_block_t *) (cache->lines + cache->nlines);
+  cache->text = (char *) (cache->blocks + cache->nblocks);
+
+  for (size_t i = 0; i < cache->nlines; i++) {
+    const cache_line_t *l = &cache->lines[i];
+    if ((l->kind == GC_LINE_BLOCK && l->arg >= cache->nblocks) ||
+	(l->kind == GC_LINE_SYSTEM && l->arg >= cache->text_len))
+      goto invalid;
+  }
+
+  madvise(p, cache->map_len, MADV_SEQUENTIAL);
+  return 0;
+
+ invalid:
+  cache_close(cache);
+  return -1;
+}
+
+void cache_init(cache_t *cache) {
+  memset(cache, 0, sizeof(*cache));
+}
+
+// Makes room for need more elements of size elem in *array
+// return value: 0 on success, -1 if out of memory
+static int grow(void **array, size_t *size, size_t used, size_t elem, size_t need) {
+  if (used + need <= *size)
+    return 0;
+  size_t n = *size ? *size : 4096;
+  while (used + need > n)
+    n *= 2;
+  void *p = realloc(*array, n * elem);
+  if (!p)
+    return -1;
+  *array = p;
+  *size = n;
+  return 0;
+}
+
+void cache_add(cache_t *cache, uint8_t kind, uint8_t status,
+	       const parser_block_t *block, const char *text) {
+  if (cache->failed)
+    return;
+
+  if (grow((void **) &cache->lines, &cache->lines_size, cache->nlines, sizeof(cache_line_t), 1)) {
+    cache->failed = 1;
+    return;
+  }
+  cache_line_t *l = &cache->lines[cache->nlines];
+  l->kind = kind;
+  l->status = status;
+  l->reserved = 0;
+  l->arg = 0;
+
+  if (kind == GC_LINE_BLOCK) {
+    if (cache->nblocks > UINT32_MAX ||
+	grow((void **) &cache->blocks, &cache->blocks_size, cache->nblocks, sizeof(parser_block_t), 1)) {
+      cache->failed = 1;
+      return;
+    }
+    l->arg = cache->nblocks;
+    cache->blocks[cache->nblocks++] = *block;
+  } else if (kind == GC_LINE_SYSTEM) {
+    size_t n = strlen(text) + 1;
+    if (cache->text_len > UINT32_MAX ||
+	grow((void **) &cache->text, &cache->text_size, cache->text_len, 1, n)) {
+      cache->failed = 1;
+      return;
+    }
+    l->arg = cache->text_len;
+    memcpy(cache->text + cache->text_len, text, n);
+    cache->text_len += n;
+  }
+
+  cache->nlines++;
+}
+
+int cache_write(cache_t *cache, const char *path, uint64_t hash, uint64_t input_len) {
+  if (cache->failed) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  cache_header_t h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+  h.version = CACHE_VERSION;
+  h.block_size = sizeof(parser_block_t);
+  h.hash = hash;
+  h.input_len = input_len;
+  h.nlines = cache->nlines;
+  h.nblocks = cache->nblocks;
+  h.text_len = cache->text_len;
+
+  // Write to a temporary file and rename, so that a concurrent or
+  // interrupted run never sees half a sidecar
+  size_t plen = strlen(path);
+  char *tmp = malloc(plen + 5);
+  if (!tmp)
+    return -1;
+  memcpy(tmp, path, plen);
+  memcpy(tmp + plen, ".tmp", 5);
+
+  FILE *fp = fopen(tmp, "wb");
+  if (!fp) {
+    free(tmp);
+    return -1;
+  }
+  int ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+    fwrite(cache->lines, sizeof(cache_line_t), cache->nlines, fp) == cache->nlines &&
+    fwrite(cache->blocks, sizeof(parser_block_t), cache->nblocks, fp) == cache->nblocks &&
+    fwrite(cache->text, 1, cache->text_len, fp) == cache->text_len;
+  if (fclose(fp) != 0)
+    ok = 0;
+  if (!ok || rename(tmp, path) < 0) {
+    int e = errno;
+    unlink(tmp);
+    free(tmp);
+    errno = e;
+    return -1;
+  }
+  free(tmp);
+  return 0;
+}
+
+void cache_close(cache_t *cache) {
+  if (cache->map) {
+    munmap(cache->map, cache->map_len);
+  } else {
+    free(cache->lines);
+    free(cache->blocks);
+    free(cache->text);
+  }
+  memset(cache, 0, sizeof(*cache));
+}
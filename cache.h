@@ -0,0 +1,67 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "gcode.h"
+
+// Sidecar file holding the parsed input: one record per input line,
+// with the blocks already converted to mm and absolute coordinates.
+// None of it depends on the -l/-d/-a settings, so later runs on the
+// same input can skip straight to lasermode/dragmode.
+
+// Bump when the parser or the to_mm/toabs stages change their output
+#define CACHE_VERSION 1
+
+// Default sidecar name is the input file name with this appended
+#define CACHE_SUFFIX ".gfc"
+
+typedef struct {
+  uint8_t kind;     // GC_LINE_*
+  uint8_t status;   // Parser status
+  uint16_t reserved;
+  uint32_t arg;     // GC_LINE_BLOCK: block index, GC_LINE_SYSTEM: text offset
+} cache_line_t;
+
+typedef struct {
+  cache_line_t *lines;
+  size_t nlines;
+  parser_block_t *blocks;
+  size_t nblocks;
+  char *text;       // NUL terminated '$' lines
+  size_t text_len;
+
+  // Allocated sizes while recording, all 0 when mapped
+  size_t lines_size;
+  size_t blocks_size;
+  size_t text_size;
+
+  void *map;        // Mapped sidecar, NULL when recording
+  size_t map_len;
+  int failed;       // Out of memory while recording
+} cache_t;
+
+// Hash of the input contents, stored in the sidecar as its key
+uint64_t cache_hash(const char *data, size_t len);
+
+// Maps the sidecar at path if it was written for an input with the
+// given hash and length by this version of gfilter.
+// return value: 0 on success, -1 if there is no usable sidecar
+int cache_open(cache_t *cache, const char *path, uint64_t hash, uint64_t input_len);
+
+// Starts an empty cache for recording
+void cache_init(cache_t *cache);
+
+// Records one line. block is the converted block for GC_LINE_BLOCK
+// lines and text the filtered line for GC_LINE_SYSTEM; both are ignored
+// otherwise.
+void cache_add(cache_t *cache, uint8_t kind, uint8_t status,
+	       const parser_block_t *block, const char *text);
+
+// Writes the recorded lines to path, replacing it atomically
+// return value: 0 on success, -1 with errno set on failure
+int cache_write(cache_t *cache, const char *path, uint64_t hash, uint64_t input_len);
+
+void cache_close(cache_t *cache);
+
+#endif
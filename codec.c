@@ -0,0 +1,425 @@
+#define _GNU_SOURCE // F_SETPIPE_SZ
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "codec.h"
+
+#define CODEC_BLOCK_SIZE (256 * 1024)
+#define CODEC_PIPE_SIZE (1024 * 1024)
+
+struct codec_s {
+  int type;
+  pthread_t thread;
+  int pipe_fd;          // Decoder: write end, encoder: read end. Closed by the thread
+  const char *prefix;   // Decoder input before in_fd
+  size_t prefix_len;
+  int in_fd;            // Decoder input, -1 if there is only the prefix
+  int out_fd;           // Encoder output, closed by the thread
+  unsigned char *inbuf;
+  unsigned char *outbuf;
+  int failed;
+};
+
+int codec_detect(const char *data, size_t len) {
+  const unsigned char *p = (const unsigned char *) data;
+  if (len >= 2 && p[0] == 0x1f && p[1] == 0x8b)
+    return CODEC_GZIP;
+  if (len >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd)
+    return CODEC_ZSTD;
+  return CODEC_NONE;
+}
+
+int codec_from_name(const char *path) {
+  size_t n = strlen(path);
+  if (n > 3 && !strcmp(path + n - 3, ".gz"))
+    return CODEC_GZIP;
+  if (n > 4 && !strcmp(path + n - 4, ".zst"))
+    return CODEC_ZSTD;
+  return CODEC_NONE;
+}
+
+const char *codec_name(int type) {
+  switch (type) {
+  case CODEC_GZIP:
+    return "gzip";
+  case CODEC_ZSTD:
+    return "zstd";
+  }
+  return "none";
+}
+
+int codec_supported(int type) {
+  switch (type) {
+#ifdef HAVE_ZLIB
+  case CODEC_GZIP:
+    return 1;
+#endif
+#ifdef HAVE_ZSTD
+  case CODEC_ZSTD:
+    return 1;
+#endif
+  }
+  return 0;
+}
+
+static int write_all(int fd, const unsigned char *p, size_t n) {
+  while (n) {
+    ssize_t w = write(fd, p, n);
+    if (w < 0) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    p += w;
+    n -= w;
+  }
+  return 0;
+}
+
+static ssize_t read_some(int fd, unsigned char *p, size_t n) {
+  ssize_t r;
+  do {
+    r = read(fd, p, n);
+  } while (r < 0 && errno == EINTR);
+  return r;
+}
+
+// Next piece of decoder input: the prefix first, then reads from in_fd
+// return value: number of bytes at *p, 0 at the end of the input
+static size_t source_next(codec_t *c, const unsigned char **p) {
+  if (c->prefix_len) {
+    // zlib counts in 32 bits, so hand out large prefixes in pieces
+    size_t n = c->prefix_len < (1u << 30) ? c->prefix_len : (1u << 30);
+    *p = (const unsigned char *) c->prefix;
+    c->prefix += n;
+    c->prefix_len -= n;
+    return n;
+  }
+  if (c->in_fd < 0)
+    return 0;
+  ssize_t n = read_some(c->in_fd, c->inbuf, CODEC_BLOCK_SIZE);
+  if (n < 0) {
+    c->failed = 1;
+    return 0;
+  }
+  *p = c->inbuf;
+  return n;
+}
+
+#ifdef HAVE_ZLIB
+static void gzip_decode(codec_t *c) {
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  if (inflateInit2(&z, 15 + 32) != Z_OK) { // 32: expect a gzip header
+    c->failed = 1;
+    return;
+  }
+
+  int ended = 0; // end of a gzip member, another one may follow
+  int full = 0;  // output buffer filled up, inflate may have more
+  for (;;) {
+    if (!z.avail_in && !full) {
+      const unsigned char *p;
+      size_t n = source_next(c, &p);
+      if (!n)
+	break;
+      z.next_in = (unsigned char *) p;
+      z.avail_in = n;
+    }
+    // Only start the next member once there is input for it: a pass
+    // that just drains a full buffer must not reset
+    if (ended && z.avail_in) {
+      inflateReset(&z);
+      ended = 0;
+    }
+
+    z.next_out = c->outbuf;
+    z.avail_out = CODEC_BLOCK_SIZE;
+    int ret = inflate(&z, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) {
+      ended = 1;
+    } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      c->failed = 1;
+      break;
+    }
+    full = !ended && z.avail_out == 0; // all out at the end of a member
+    if (write_all(c->pipe_fd, c->outbuf, CODEC_BLOCK_SIZE - z.avail_out) < 0) {
+      c->failed = 1;
+      break;
+    }
+  }
+  if (!ended)
+    c->failed = 1; // truncated
+
+  inflateEnd(&z);
+}
+
+static void gzip_encode(codec_t *c) {
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  // 16: write a gzip header
+  if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    c->failed = 1;
+    return;
+  }
+
+  for (;;) {
+    ssize_t n = read_some(c->pipe_fd, c->inbuf, CODEC_BLOCK_SIZE);
+    if (n < 0) {
+      c->failed = 1;
+      break;
+    }
+    int flush = n ? Z_NO_FLUSH : Z_FINISH;
+    z.next_in = c->inbuf;
+    z.avail_in = n;
+    do {
+      z.next_out = c->outbuf;
+      z.avail_out = CODEC_BLOCK_SIZE;
+      deflate(&z, flush);
+      if (write_all(c->out_fd, c->outbuf, CODEC_BLOCK_SIZE - z.avail_out) < 0) {
+	c->failed = 1;
+	break;
+      }
+    } while (z.avail_out == 0);
+    if (!n || c->failed)
+      break;
+  }
+
+  deflateEnd(&z);
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static void zstd_decode(codec_t *c) {
+  ZSTD_DCtx *dctx = ZSTD_createDCtx();
+  if (!dctx) {
+    c->failed = 1;
+    return;
+  }
+
+  ZSTD_inBuffer in = { NULL, 0, 0 };
+  size_t left = 0; // non-zero while a frame is incomplete
+  int full = 0;
+  for (;;) {
+    if (in.pos == in.size && !full) {
+      const unsigned char *p;
+      size_t n = source_next(c, &p);
+      if (!n)
+	break;
+      in.src = p;
+      in.size = n;
+      in.pos = 0;
+    }
+
+    ZSTD_outBuffer out = { c->outbuf, CODEC_BLOCK_SIZE, 0 };
+    left = ZSTD_decompressStream(dctx, &out, &in);
+    if (ZSTD_isError(left)) {
+      c->failed = 1;
+      break;
+    }
+    full = out.pos == out.size;
+    if (write_all(c->pipe_fd, c->outbuf, out.pos) < 0) {
+      c->failed = 1;
+      break;
+    }
+  }
+  if (left)
+    c->failed = 1; // truncated
+
+  ZSTD_freeDCtx(dctx);
+}
+
+static void zstd_encode(codec_t *c) {
+  ZSTD_CCtx *cctx = ZSTD_createCCtx();
+  if (!cctx) {
+    c->failed = 1;
+    return;
+  }
+
+  for (;;) {
+    ssize_t n = read_some(c->pipe_fd, c->inbuf, CODEC_BLOCK_SIZE);
+    if (n < 0) {
+      c->failed = 1;
+      break;
+    }
+    ZSTD_EndDirective mode = n ? ZSTD_e_continue : ZSTD_e_end;
+    ZSTD_inBuffer in = { c->inbuf, n, 0 };
+    int done;
+    do {
+      ZSTD_outBuffer out = { c->outbuf, CODEC_BLOCK_SIZE, 0 };
+      size_t left = ZSTD_compressStream2(cctx, &out, &in, mode);
+      if (ZSTD_isError(left) || write_all(c->out_fd, c->outbuf, out.pos) < 0) {
+	c->failed = 1;
+	break;
+      }
+      done = mode == ZSTD_e_end ? left == 0 : in.pos == in.size;
+    } while (!done);
+    if (!n || c->failed)
+      break;
+  }
+
+  ZSTD_freeCCtx(cctx);
+}
+#endif
+
+static void *decoder_thread(void *arg) {
+  codec_t *c = arg;
+
+  // A reader that stops early closes its end; get EPIPE instead of a signal
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  switch (c->type) {
+#ifdef HAVE_ZLIB
+  case CODEC_GZIP:
+    gzip_decode(c);
+    break;
+#endif
+#ifdef HAVE_ZSTD
+  case CODEC_ZSTD:
+    zstd_decode(c);
+    break;
+#endif
+  }
+
+  close(c->pipe_fd); // the reader sees the end of the data
+  return NULL;
+}
+
+static void *encoder_thread(void *arg) {
+  codec_t *c = arg;
+
+  switch (c->type) {
+#ifdef HAVE_ZLIB
+  case CODEC_GZIP:
+    gzip_encode(c);
+    break;
+#endif
+#ifdef HAVE_ZSTD
+  case CODEC_ZSTD:
+    zstd_encode(c);
+    break;
+#endif
+  }
+
+  // On failure, keep taking data so the writer doesn't block on a full pipe
+  if (c->failed)
+    while (read_some(c->pipe_fd, c->inbuf, CODEC_BLOCK_SIZE) > 0)
+      ;
+
+  close(c->pipe_fd);
+  if (close(c->out_fd) < 0)
+    c->failed = 1;
+  return NULL;
+}
+
+static codec_t *codec_new(int type) {
+  if (!codec_supported(type)) {
+    errno = ENOTSUP;
+    return NULL;
+  }
+  codec_t *c = calloc(1, sizeof(codec_t));
+  if (!c)
+    return NULL;
+  c->type = type;
+  c->in_fd = -1;
+  c->out_fd = -1;
+  c->inbuf = malloc(CODEC_BLOCK_SIZE);
+  c->outbuf = malloc(CODEC_BLOCK_SIZE);
+  if (!c->inbuf || !c->outbuf) {
+    free(c->inbuf);
+    free(c->outbuf);
+    free(c);
+    errno = ENOMEM;
+    return NULL;
+  }
+  return c;
+}
+
+static void codec_free(codec_t *c) {
+  free(c->inbuf);
+  free(c->outbuf);
+  free(c);
+}
+
+// Opens a pipe with a larger buffer than the default, so the two
+// threads don't have to take turns every 64 KB
+static int open_pipe(int fds[2]) {
+  if (pipe(fds) < 0)
+    return -1;
+#ifdef F_SETPIPE_SZ
+  fcntl(fds[0], F_SETPIPE_SZ, CODEC_PIPE_SIZE);
+#endif
+  return 0;
+}
+
+int codec_decoder(codec_t **codec, int type, const char *prefix, size_t len, int fd) {
+  codec_t *c = codec_new(type);
+  if (!c)
+    return -1;
+  c->prefix = prefix;
+  c->prefix_len = len;
+  c->in_fd = fd;
+
+  int fds[2];
+  if (open_pipe(fds) < 0) {
+    codec_free(c);
+    return -1;
+  }
+  c->pipe_fd = fds[1];
+
+  int err = pthread_create(&c->thread, NULL, decoder_thread, c);
+  if (err) {
+    close(fds[0]);
+    close(fds[1]);
+    codec_free(c);
+    errno = err;
+    return -1;
+  }
+  *codec = c;
+  return fds[0];
+}
+
+int codec_encoder(codec_t **codec, int type, int out_fd) {
+  codec_t *c = codec_new(type);
+  if (!c)
+    return -1;
+  c->out_fd = out_fd;
+
+  int fds[2];
+  if (open_pipe(fds) < 0) {
+    codec_free(c);
+    return -1;
+  }
+  c->pipe_fd = fds[0];
+
+  int err = pthread_create(&c->thread, NULL, encoder_thread, c);
+  if (err) {
+    close(fds[0]);
+    close(fds[1]);
+    codec_free(c);
+    errno = err;
+    return -1;
+  }
+  *codec = c;
+  return fds[1];
+}
+
+int codec_finish(codec_t *c) {
+  pthread_join(c->thread, NULL);
+  int failed = c->failed;
+  codec_free(c);
+  return failed ? -1 : 0;
+}
@@ -0,0 +1,49 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+
+// Streaming gzip/zstd (de)compression on a separate thread. The thread
+// is connected to the rest of gfilter through a pipe, so compressed
+// files can be read and written like plain ones, while the codec runs
+// in parallel with parsing and filtering.
+
+#define CODEC_NONE 0
+#define CODEC_GZIP 1 // needs HAVE_ZLIB
+#define CODEC_ZSTD 2 // needs HAVE_ZSTD
+
+typedef struct codec_s codec_t;
+
+// Recognizes compressed data by its first bytes
+// return value: CODEC_*
+int codec_detect(const char *data, size_t len);
+
+// Picks the codec for an output file from its name (.gz, .zst)
+// return value: CODEC_*
+int codec_from_name(const char *path);
+
+// return value: name of the codec, for messages
+const char *codec_name(int type);
+
+// return value: non-zero if support for the codec is compiled in
+int codec_supported(int type);
+
+// Starts a thread decompressing prefix[0..len) followed by whatever can
+// be read from fd, if fd >= 0. prefix must stay valid until
+// codec_finish(). fd is not closed.
+// return value: read end of a pipe delivering the decompressed data, or
+// -1 with errno set on failure
+int codec_decoder(codec_t **codec, int type, const char *prefix, size_t len, int fd);
+
+// Starts a thread compressing everything written to the returned fd
+// into out_fd, which is closed when the codec finishes.
+// return value: write end of a pipe taking the data to compress, or -1
+// with errno set on failure
+int codec_encoder(codec_t **codec, int type, int out_fd);
+
+// Waits for the thread to finish and frees the codec. For an encoder,
+// the write end of its pipe must have been closed first.
+// return value: 0 on success, -1 if the data was corrupt or I/O failed
+int codec_finish(codec_t *codec);
+
+#endif
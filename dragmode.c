@@ -20,41 +20,43 @@ void dragmode_init(drag_state_t *state, float d, float angle0, float minangle) {
   state->values.xyz[1] = -state->v[1] * d;
   // machine coordinates are 0,0
   state->cosminangle = cos(minangle / 180 * 3.141);
+  state->swivels = 0;
 }
 
 int dragmode(drag_state_t *state,
-	       parser_block_t *block) {
+	       parser_block_t *block, block_ring_t *out) {
   int retval = 1;
 
   block->command_words &= ~bit(MODAL_GROUP_M7); // no spindle action
   
-  drag_state_t oldstate = *state;
+  // Knife tip location and direction before block
+  float x0[3] = { state->values.xyz[0], state->values.xyz[1], state->values.xyz[2] };
+  float vprev[2] = { state->v[0], state->v[1] };
 
   update_state(&state->modal, &state->values, block);
   // state represents the desired knife tip location after block
-  // oldstate represents the knife tip location before block
   
   normarcs(block, state->modal.motion, 
-	   state->values.xyz[0]-oldstate.values.xyz[0], // Delta x between current position and target
-	   state->values.xyz[1]-oldstate.values.xyz[1]); // Delta y between current position and target
+	   state->values.xyz[0]-x0[0], // Delta x between current position and target
+	   state->values.xyz[1]-x0[1]); // Delta y between current position and target
   
   
-  // oldstate.v: direction at end of last block
+  // vprev: direction at end of last block
   // v0: direction at beginning of this block
   // state->v: direction at end of this block
   
   float v0[2]; 
 
-  float dx = state->values.xyz[0] - oldstate.values.xyz[0];
-  float dy = state->values.xyz[1] - oldstate.values.xyz[1];
+  float dx = state->values.xyz[0] - x0[0];
+  float dy = state->values.xyz[1] - x0[1];
 
   calcv(block, state->modal.motion, dx, dy, v0, state->v);
-  if (state->values.xyz[2] >= 0 || oldstate.values.xyz[2] >= 0) // not cutting, knife must continue pointing in old direction
-    memcpy(state->v, oldstate.v, sizeof(float) * 2);
+  if (state->values.xyz[2] >= 0 || x0[2] >= 0) // not cutting, knife must continue pointing in old direction
+    memcpy(state->v, vprev, sizeof(vprev));
 
   float xy0[2] = {
-		   oldstate.values.xyz[0] + oldstate.v[0] * oldstate.d,
-		   oldstate.values.xyz[1] + oldstate.v[1] * oldstate.d
+		   x0[0] + vprev[0] * state->d,
+		   x0[1] + vprev[1] * state->d
   }; // machine coordinates before block
 
   for (int i = 0; i < 2; i++)
@@ -69,34 +71,40 @@ int dragmode(drag_state_t *state,
       block->values.ijk[1] = 0;
     block->value_words |= bit(WORD_I) | bit(WORD_J);
     for (int i = 0; i < 2; i++)
-      block->values.ijk[i] -= oldstate.v[i] * oldstate.d;
+      block->values.ijk[i] -= vprev[i] * state->d;
   }
 
   block->value_words |= bit(WORD_X) | bit(WORD_Y);
   // machine coordinates after block
 
-  float dp = v0[0] * oldstate.v[0] + v0[1] * oldstate.v[1];
+  float dp = v0[0] * vprev[0] + v0[1] * vprev[1];
 
-  if (dp < state->cosminangle && state->values.xyz[2] < 0 && oldstate.values.xyz[2] < 0) { // there is a discontinuity of direction at start of this move
+  if (dp < state->cosminangle && state->values.xyz[2] < 0 && x0[2] < 0) { // there is a discontinuity of direction at start of this move
     // and the knife is in the material
-    // must create arc
-    // move original move to make space for curve
-    memcpy(block + 1, block, sizeof(*block));
-    float dir = v0[0] * oldstate.v[1] - v0[1] * oldstate.v[0];
+    // must create arc, which goes before the original move
+    parser_block_t *arc = block_ring_push(out);
+    if (!arc)
+      return -1;
+    *arc = *block;
+    float dir = v0[0] * vprev[1] - v0[1] * vprev[0];
     if (dir > 0)
-      block[0].modal.motion = MOTION_MODE_CW_ARC;
+      arc->modal.motion = MOTION_MODE_CW_ARC;
     else
-      block[0].modal.motion = MOTION_MODE_CCW_ARC;
-    block[0].command_words = bit(MODAL_GROUP_G1);
+      arc->modal.motion = MOTION_MODE_CCW_ARC;
+    arc->command_words = bit(MODAL_GROUP_G1);
     // machine coordinates at beginning of this move
-    block[0].values.xyz[0] = oldstate.values.xyz[0] + v0[0] * state->d;
-    block[0].values.xyz[1] = oldstate.values.xyz[1] + v0[1] * state->d;
-    block[0].values.r = state->d;
-    block[0].value_words = bit(WORD_R) | bit(WORD_X) | bit(WORD_Y);
-    block[1].modal.motion = state->modal.motion;
-    block[1].command_words |= bit(MODAL_GROUP_G1);
+    arc->values.xyz[0] = x0[0] + v0[0] * state->d;
+    arc->values.xyz[1] = x0[1] + v0[1] * state->d;
+    arc->values.r = state->d;
+    arc->value_words = bit(WORD_R) | bit(WORD_X) | bit(WORD_Y);
+    block->modal.motion = state->modal.motion;
+    block->command_words |= bit(MODAL_GROUP_G1);
     retval++;
+    state->swivels++;
   }
+
+  if (block_ring_push_copy(out, block) < 0)
+    return -1;
   
   return retval;
 }
@@ -2,6 +2,7 @@
 #define DRAGMODE_H
 
 #include "gcode.h"
+#include "pipeline.h"
 
 typedef struct {
   gc_modal_t modal;
@@ -10,6 +11,7 @@ typedef struct {
   float d;
   float angle0;
   float cosminangle;
+  unsigned long swivels; // Swivel arcs inserted
 } drag_state_t;
 
 // d is blade offset
@@ -18,8 +20,12 @@ typedef struct {
 // minangle: Minimum angle between two line segments that leads to a
 // swivel action (degrees)
 void dragmode_init(drag_state_t *state, float d, float angle0, float minangle);
+
+// Pushes block to out, moved to where the swivel center must go, and
+// preceded by a swivel arc at sharp corners. block is modified.
+// return value: Number of blocks pushed, -1 if out couldn't grow
 int dragmode(drag_state_t *state,
-	     parser_block_t *block);
+	     parser_block_t *block, block_ring_t *out);
 
 
 #endif
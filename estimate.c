@@ -0,0 +1,169 @@
+#include <math.h>
+#include <string.h>
+#include "estimate.h"
+#include "geom.h"
+
+void estimate_init(estimate_t *e, int laser, double a, double junction_deviation) {
+  memset(e, 0, sizeof(*e));
+  e->laser = laser;
+  e->a = a;
+  e->junction_deviation = junction_deviation;
+}
+
+// Square of the highest speed grbl takes a corner with, from the
+// directions before and after it (mm/s), as in the laser mode planner
+static float junction_speed2(const estimate_t *e, const float vprev[3], const float v0[3]) {
+  if (vprev[0] == 0 && vprev[1] == 0 && vprev[2] == 0)
+    return 0; // from rest
+  float cos_theta = -(vprev[0] * v0[0] + vprev[1] * v0[1] + vprev[2] * v0[2]);
+  if (cos_theta > 0.999999f)
+    return 0; // reversal
+  if (cos_theta < -0.999999f)
+    return INFINITY; // straight on
+  float sin_theta_d2 = sqrtf(0.5f * (1.f - cos_theta));
+  return e->a * e->junction_deviation * sin_theta_d2 / (1.f - sin_theta_d2);
+}
+
+// Time along a move of length len, starting at speed sqrt(start2) and
+// ending at sqrt(end2), no faster than sqrt(nominal2) (s)
+static double move_time(double a, double len, double start2, double end2, double nominal2) {
+  double v0 = sqrt(start2), v1 = sqrt(end2);
+  double peak2 = (2 * a * len + start2 + end2) / 2;
+  if (peak2 <= nominal2) {
+    // Triangle: accelerates, then decelerates right away
+    double peak = sqrt(peak2);
+    return (2 * peak - v0 - v1) / a;
+  }
+  // Trapezoid: cruises at the feed rate in between
+  double nominal = sqrt(nominal2);
+  double ramps = (2 * nominal2 - start2 - end2) / (2 * a);
+  return (2 * nominal - v0 - v1) / a + (len - ramps) / nominal;
+}
+
+// Times the oldest move in the window
+static void time_oldest(estimate_t *e) {
+  float a2 = 2 * e->a;
+
+  // Backward pass: the machine must be able to stop at the end of the
+  // last move in the window, and to take each corner before it
+  float v2 = 0; // square of the highest speed at the start of move i
+  for (size_t i = e->tail; i-- > e->head + 1; ) {
+    const estimate_move_t *m = &e->moves[i % ESTIMATE_WINDOW];
+    v2 = fminf(fminf(m->junction2, m->nominal2), v2 + a2 * m->len);
+  }
+
+  // Forward pass: from the speed the last move ended at
+  const estimate_move_t *m = &e->moves[e->head % ESTIMATE_WINDOW];
+  float start2 = fminf(fminf(m->junction2, m->nominal2), e->end2);
+  float end2 = fminf(fminf(v2, m->nominal2), start2 + a2 * m->len);
+
+  double t = move_time(e->a, m->len, start2, end2, m->nominal2);
+  e->time += t;
+  e->distance += m->len;
+  if (m->cut) {
+    e->cut_time += t;
+    e->cut_distance += m->len;
+  } else {
+    e->travel_time += t;
+  }
+  e->end2 = end2;
+  e->head++;
+}
+
+void estimate_finish(estimate_t *e) {
+  while (e->head != e->tail)
+    time_oldest(e);
+  e->end2 = 0;
+  memset(e->v, 0, sizeof(e->v));
+}
+
+// normarcs() without its checks: the stages may leave an arc's end a
+// little off its circle, or R a little short of the chord, and the
+// estimate goes on regardless
+static void arc_center(parser_block_t *block, uint8_t motion, float x, float y) {
+  if (block->value_words & bit(WORD_R)) {
+    float h_x2_div_d = 4.0 * block->values.r * block->values.r - x * x - y * y;
+    h_x2_div_d = -sqrtf(fmaxf(h_x2_div_d, 0)) / hypotf(x, y);
+    if (motion == MOTION_MODE_CCW_ARC)
+      h_x2_div_d = -h_x2_div_d;
+    if (block->values.r < 0) {
+      h_x2_div_d = -h_x2_div_d;
+      block->values.r = -block->values.r;
+    }
+    block->values.ijk[0] = 0.5 * (x - y * h_x2_div_d);
+    block->values.ijk[1] = 0.5 * (y + x * h_x2_div_d);
+  } else {
+    block->values.r = hypotf(block->values.ijk[0], block->values.ijk[1]);
+  }
+}
+
+void estimate_block(estimate_t *e, const parser_block_t *block) {
+  float from[3];
+  memcpy(from, e->values.xyz, sizeof(from));
+  parser_block_t b = *block; // update_state() drops words that are in effect already
+  update_state(&e->modal, &e->values, &b);
+
+  if (block->non_modal_command == NON_MODAL_DWELL) {
+    // grbl finishes the moves before a dwell
+    estimate_finish(e);
+    e->time += block->values.p;
+    e->dwell_time += block->values.p;
+    return;
+  }
+  uint8_t motion = e->modal.motion;
+  if ((block->non_modal_command != NON_MODAL_NO_ACTION &&
+       block->non_modal_command != NON_MODAL_ABSOLUTE_OVERRIDE) ||
+      !(block->value_words & (bit(WORD_X) | bit(WORD_Y) | bit(WORD_Z))) ||
+      motion > MOTION_MODE_CCW_ARC)
+    return;
+
+  const float *to = e->values.xyz;
+  float dx = to[0] - from[0], dy = to[1] - from[1], dz = to[2] - from[2];
+  if (motion == MOTION_MODE_CW_ARC || motion == MOTION_MODE_CCW_ARC)
+    arc_center(&b, motion, dx, dy);
+  else
+    b.values.r = 0;
+
+  estimate_move_t m;
+  float v0[3] = { 0, 0, 0 }, v1[3] = { 0, 0, 0 };
+  if (b.values.r != 0) {
+    calcv(&b, motion, dx, dy, v0, v1);
+    if (motion == MOTION_MODE_CCW_ARC) { // calcv() only turns v0 around
+      v1[0] = -v1[0];
+      v1[1] = -v1[1];
+    }
+
+    // Along the arc, and up the helix if z moves too
+    float sx = -b.values.ijk[0], sy = -b.values.ijk[1]; // center to start
+    float ex = dx + sx, ey = dy + sy;                   // center to end
+    float sweep = atan2f(sx * ey - sy * ex, sx * ex + sy * ey);
+    if (motion == MOTION_MODE_CW_ARC)
+      sweep = -sweep;
+    if (sweep <= 0)
+      sweep += 2 * M_PI;
+    m.len = hypotf(b.values.r * sweep, dz);
+  } else {
+    m.len = sqrtf(dx * dx + dy * dy + dz * dz);
+    if (m.len > 0) {
+      v0[0] = v1[0] = dx / m.len;
+      v0[1] = v1[1] = dy / m.len;
+      v0[2] = v1[2] = dz / m.len;
+    }
+  }
+  if (m.len == 0)
+    return;
+
+  m.cut = e->laser ?
+    motion != MOTION_MODE_SEEK && e->values.s != 0 && e->modal.spindle != SPINDLE_DISABLE :
+    from[2] < 0 && to[2] < 0;
+
+  // grbl won't take a feed move without a feed rate; count it as a rapid
+  float f = motion == MOTION_MODE_SEEK || e->values.f <= 0 ? ESTIMATE_RAPID : e->values.f;
+  m.nominal2 = (f / 60.f) * (f / 60.f);
+  m.junction2 = junction_speed2(e, e->v, v0);
+  memcpy(e->v, v1, sizeof(e->v));
+
+  if (e->tail - e->head == ESTIMATE_WINDOW)
+    time_oldest(e);
+  e->moves[e->tail++ % ESTIMATE_WINDOW] = m;
+}
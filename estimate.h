@@ -0,0 +1,59 @@
+#ifndef ESTIMATE_H
+#define ESTIMATE_H
+
+#include "gcode.h"
+
+// Estimates how long a machine running grbl takes over a program: each
+// move accelerates and decelerates at a constant rate up to its feed
+// rate, and corners are taken at grbl's junction deviation speed. Like
+// grbl, the speed is planned over a window of the next moves only, and
+// the machine must be able to stop at the end of the window.
+// Blocks must be absolute and in mm.
+
+// Moves planned ahead, grbl's planner buffer
+#define ESTIMATE_WINDOW 16
+
+// Rapids go at the machine's top speed, which isn't in the G-code
+#define ESTIMATE_RAPID 5000.f // mm/min
+
+typedef struct {
+  float len;        // Path length (mm)
+  float nominal2;   // Square of the highest speed along the move (mm/s)
+  float junction2;  // Square of the highest speed at the corner at its start
+  int cut;
+} estimate_move_t;
+
+typedef struct {
+  int laser;        // Cutting is laser on, otherwise knife down (z < 0)
+  float a;          // Acceleration (mm/s2)
+  float junction_deviation; // grbl's $11 (mm)
+  gc_modal_t modal;
+  gc_values_t values;
+  float v[3];       // Direction at the end of the last move, 0 at rest
+
+  estimate_move_t moves[ESTIMATE_WINDOW]; // Moves not timed yet
+  size_t head;      // Index of the oldest move, counts up forever
+  size_t tail;      // Index of the next move to add, counts up forever
+  float end2;       // Square of the speed at the end of the last move timed
+
+  double time;      // Totals (s and mm)
+  double cut_time;
+  double travel_time;
+  double dwell_time;
+  double distance;
+  double cut_distance;
+} estimate_t;
+
+// laser: count cuts the way laser mode does, otherwise the way the drag
+// knife does
+// a: acceleration (mm/s2)
+// junction_deviation: grbl's $11 (mm)
+void estimate_init(estimate_t *e, int laser, double a, double junction_deviation);
+
+// Adds block to the program. block isn't modified.
+void estimate_block(estimate_t *e, const parser_block_t *block);
+
+// Times the moves still in the window, down to a stop
+void estimate_finish(estimate_t *e);
+
+#endif
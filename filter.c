@@ -0,0 +1,365 @@
+#include <string.h>
+#include "filter.h"
+#include "geom.h"
+#include "scan.h"
+#include "stats.h"
+
+void filter_init(filter_t *f, const filter_settings_t *opt, output_t *output,
+		 cache_t *cache) {
+  f->mode = opt->mode;
+  f->output = output;
+  f->cache = cache;
+  f->error = NULL;
+  f->error_arg = NULL;
+  f->lines = f->bytes = 0;
+  f->stats = NULL;
+  f->failed = 0;
+
+  to_mm_init(&f->to_mm_state);
+  toabs_init(&f->toabs_state);
+
+  if (opt->mode == MODE_LASER) {
+    lasermode_init(&f->laser_state, opt->acc, opt->angle);
+    if (opt->lookahead > 0)
+      lasermode_plan(&f->laser_state, opt->lookahead, opt->junction_deviation);
+  }
+
+  if (opt->mode == MODE_DRAG)
+    dragmode_init(&f->drag_state, opt->offset, 0, opt->angle);
+
+  f->arcfit = opt->arc_tolerance > 0;
+  if (f->arcfit)
+    arcfit_init(&f->arcfit_state, opt->arc_tolerance);
+
+  f->simplify = opt->simplify;
+  if (f->simplify)
+    simplify_init(&f->simplify_state, opt->simplify_tolerance);
+
+  f->reorder = opt->reorder;
+  if (f->reorder)
+    reorder_init(&f->reorder_state, opt->mode == MODE_LASER);
+
+  f->estimate = opt->estimate_acc > 0;
+  if (f->estimate) {
+    estimate_init(&f->estimate_in, opt->mode == MODE_LASER, opt->estimate_acc,
+		  opt->junction_deviation);
+    estimate_init(&f->estimate_out, opt->mode == MODE_LASER, opt->estimate_acc,
+		  opt->junction_deviation);
+  }
+
+  fromabs_init(&f->fromabs_state);
+  from_mm_init(&f->from_mm_state);
+  cleanup_init(&f->cleanup_state);
+  f->metric_abs_in = 1;
+  f->metric_abs_out = 0; // from_mm and fromabs write g21 g90 first
+}
+
+// Blocks with these need the unit and distance conversions
+#define UNITS_DISTANCE_GROUPS (bit(MODAL_GROUP_G3) | bit(MODAL_GROUP_G6))
+
+// Converts block to absolute mm. Nearly all input is metric and
+// absolute already, and then to_mm and toabs leave blocks without
+// g20/g21/g90/g91 alone, apart from following the position.
+// scaled: block was converted to mm by scale_lines() already
+static inline void to_abs_mm(filter_t *f, parser_block_t *block, int scaled) {
+  uint64_t t = stats_start(f->stats);
+  if (f->metric_abs_in && !(block->command_words & UNITS_DISTANCE_GROUPS)) {
+    abs_follow(&f->toabs_state, block);
+    if (STATS_ON(f->stats))
+      stats_lap(f->stats, STATS_TOABS, t, 1, 1, 0, 0);
+    return;
+  }
+  if (scaled)
+    to_mm_units(&f->to_mm_state, block);
+  else
+    to_mm(&f->to_mm_state, block);
+  if (STATS_ON(f->stats))
+    t = stats_lap(f->stats, STATS_TO_MM, t, 1, 1, 0, 0);
+  toabs(&f->toabs_state, block);
+  if (STATS_ON(f->stats))
+    stats_lap(f->stats, STATS_TOABS, t, 1, 1, 0, 0);
+  f->metric_abs_in = f->to_mm_state.units == UNITS_MODE_MM &&
+    f->toabs_state.distance == DISTANCE_MODE_ABSOLUTE;
+}
+
+// Converts block back to the units and distance mode of the input, the
+// reverse of to_abs_mm()
+static inline void from_abs_mm(filter_t *f, parser_block_t *block) {
+  uint64_t t = stats_start(f->stats);
+  if (f->metric_abs_out && !(block->command_words & UNITS_DISTANCE_GROUPS)) {
+    abs_follow(&f->fromabs_state, block);
+    if (STATS_ON(f->stats))
+      stats_lap(f->stats, STATS_FROMABS, t, 1, 1, 0, 0);
+    return;
+  }
+  fromabs(&f->fromabs_state, block);
+  if (STATS_ON(f->stats))
+    t = stats_lap(f->stats, STATS_FROMABS, t, 1, 1, 0, 0);
+  from_mm(&f->from_mm_state, block);
+  if (STATS_ON(f->stats))
+    stats_lap(f->stats, STATS_FROM_MM, t, 1, 1, 0, 0);
+  f->metric_abs_out = f->from_mm_state.units == UNITS_MODE_MM &&
+    f->fromabs_state.distance == DISTANCE_MODE_ABSOLUTE;
+}
+
+// Adds a call of a stage that started at t0, took blocks_in blocks and
+// returned pushed, to the stats
+// return value: pushed
+static inline int stage_stats(filter_t *f, int stage, uint64_t t0, int blocks_in, int pushed) {
+  if (STATS_ON(f->stats))
+    stats_lap(f->stats, stage, t0, blocks_in, pushed > 0 ? pushed : 0, 0, 0);
+  return pushed;
+}
+
+// The stages below are added with the filter_t as their state, so they
+// can count into f->stats
+static int laser_stage(void *state, parser_block_t *block, block_ring_t *out) {
+  filter_t *f = state;
+  uint64_t t = stats_start(f->stats);
+  return stage_stats(f, STATS_MODE, t, 1, lasermode(&f->laser_state, block, out));
+}
+
+static int laser_flush(void *state, block_ring_t *out) {
+  filter_t *f = state;
+  uint64_t t = stats_start(f->stats);
+  return stage_stats(f, STATS_MODE, t, 0, lasermode_flush(&f->laser_state, out));
+}
+
+static int estimate_stage(void *state, parser_block_t *block, block_ring_t *out) {
+  filter_t *f = state;
+  estimate_block(&f->estimate_in, block);
+  return block_ring_push_copy(out, block) < 0 ? -1 : 1;
+}
+
+static int arcfit_stage(void *state, parser_block_t *block, block_ring_t *out) {
+  filter_t *f = state;
+  uint64_t t = stats_start(f->stats);
+  return stage_stats(f, STATS_ARCFIT, t, 1, arcfit(&f->arcfit_state, block, out));
+}
+
+static int arcfit_flush_stage(void *state, block_ring_t *out) {
+  filter_t *f = state;
+  uint64_t t = stats_start(f->stats);
+  return stage_stats(f, STATS_ARCFIT, t, 0, arcfit_flush(&f->arcfit_state, out));
+}
+
+static int simplify_stage(void *state, parser_block_t *block, block_ring_t *out) {
+  filter_t *f = state;
+  uint64_t t = stats_start(f->stats);
+  return stage_stats(f, STATS_SIMPLIFY, t, 1, simplify(&f->simplify_state, block, out));
+}
+
+static int simplify_flush_stage(void *state, block_ring_t *out) {
+  filter_t *f = state;
+  uint64_t t = stats_start(f->stats);
+  return stage_stats(f, STATS_SIMPLIFY, t, 0, simplify_flush(&f->simplify_state, out));
+}
+
+static int reorder_stage(void *state, parser_block_t *block, block_ring_t *out) {
+  filter_t *f = state;
+  uint64_t t = stats_start(f->stats);
+  return stage_stats(f, STATS_REORDER, t, 1, reorder(&f->reorder_state, block, out));
+}
+
+static int reorder_flush_stage(void *state, block_ring_t *out) {
+  filter_t *f = state;
+  uint64_t t = stats_start(f->stats);
+  return stage_stats(f, STATS_REORDER, t, 0, reorder_flush(&f->reorder_state, out));
+}
+
+static int drag_stage(void *state, parser_block_t *block, block_ring_t *out) {
+  filter_t *f = state;
+  uint64_t t = stats_start(f->stats);
+  return stage_stats(f, STATS_MODE, t, 1, dragmode(&f->drag_state, block, out));
+}
+
+// End of the back end: converts the blocks that come out of the stages
+// back to the units and distance mode of the input, and prints them.
+// These conversions always come last, so they are done here with direct
+// calls rather than as stages of their own.
+void print_blocks(void *state, parser_block_t *blocks, size_t n, const char *text) {
+  filter_t *f = state;
+  for (size_t i = 0; i < n; i++) {
+    parser_block_t *block = &blocks[i];
+    if (!block_is_text(block)) {
+      from_abs_mm(f, block);
+      uint64_t t = stats_start(f->stats);
+      cleanup(&f->cleanup_state, block);
+      if (STATS_ON(f->stats))
+	stats_lap(f->stats, STATS_CLEANUP, t, 1, 1, 0, 0);
+    }
+
+    uint64_t t = stats_start(f->stats);
+    uint64_t written = STATS_ON(f->stats) ? output_total(f->output) : 0;
+    if (block_is_text(block))
+      output_str(f->output, text + block->values.n);
+    else
+      gc_print_line(block, f->output);
+    output_char(f->output, '\n');
+    if (STATS_ON(f->stats)) {
+      uint64_t total = output_total(f->output);
+      stats_lap(f->stats, STATS_PRINT, t, 1, 1, 0, total > written ? total - written : 0);
+    }
+  }
+}
+
+void estimate_blocks(void *state, parser_block_t *blocks, size_t n, const char *text) {
+  filter_t *f = state;
+  for (size_t i = 0; i < n; i++)
+    if (!block_is_text(&blocks[i]))
+      estimate_block(&f->estimate_out, &blocks[i]);
+}
+
+int back_end_init(filter_t *f, pipeline_sink_t sink, void *sink_state) {
+  pipeline_t *p = &f->back_end;
+  pipeline_init(p, sink, sink_state);
+
+  // Sees the blocks as they come in, before any stage changes them
+  if (f->estimate && pipeline_add(p, estimate_stage, NULL, f) < 0)
+    return -1;
+
+  // Before the stages that extend the cuts, which depend on the order
+  // and number of the moves
+  if (f->arcfit && pipeline_add(p, arcfit_stage, arcfit_flush_stage, f) < 0)
+    return -1;
+  if (f->simplify && pipeline_add(p, simplify_stage, simplify_flush_stage, f) < 0)
+    return -1;
+  if (f->reorder && pipeline_add(p, reorder_stage, reorder_flush_stage, f) < 0)
+    return -1;
+
+  switch (f->mode) {
+  case MODE_LASER:
+    return pipeline_add(p, laser_stage, laser_flush, f);
+  case MODE_DRAG:
+    return pipeline_add(p, drag_stage, NULL, f);
+  }
+  return 0;
+}
+
+void filter_free(filter_t *f) {
+  pipeline_free(&f->back_end);
+  if (f->mode == MODE_LASER)
+    lasermode_free(&f->laser_state);
+  if (f->reorder)
+    reorder_free(&f->reorder_state);
+}
+
+void back_end(filter_t *f, const parser_block_t *block) {
+  parser_block_t b = *block;
+  if (pipeline_push(&f->back_end, &b) < 0)
+    f->failed = 1;
+}
+
+void back_end_text(filter_t *f, const char *text) {
+  if (pipeline_push_text(&f->back_end, text) < 0)
+    f->failed = 1;
+}
+
+void back_end_flush(filter_t *f) {
+  if (pipeline_flush(&f->back_end) < 0)
+    f->failed = 1;
+  if (STATS_ON(f->stats)) {
+    if (f->mode == MODE_LASER)
+      stats_count(&f->stats->extensions, f->laser_state.extensions);
+    if (f->mode == MODE_DRAG)
+      stats_count(&f->stats->swivels, f->drag_state.swivels);
+  }
+}
+
+void filter_block(filter_t *f, parser_block_t *block) {
+  to_abs_mm(f, block, 0);
+  back_end(f, block);
+}
+
+// Blocks converted to mm per geom_scale() call
+#define SCALE_BATCH 64
+// Values converted per block: xyz, ijk, f and r
+#define SCALE_VALUES 8
+
+static void scale_batch(parser_block_t **held, size_t m, float *v) {
+  geom_scale(m * SCALE_VALUES, v, 25.4);
+  for (size_t k = 0; k < m; k++) {
+    gc_values_t *values = &held[k]->values;
+    const float *w = v + k * SCALE_VALUES;
+    memcpy(values->xyz, w, sizeof(values->xyz));
+    memcpy(values->ijk, w + 3, sizeof(values->ijk));
+    values->f = w[6];
+    values->r = w[7];
+  }
+}
+
+// Converts the blocks of n lines from gc_parse_lines() that are in
+// inches to mm, a batch at a time with the vector kernel, ahead of
+// to_abs_mm(). Follows the units the way to_mm() does, without changing
+// its state.
+static void scale_lines(filter_t *f, parser_block_t *blocks, const gc_line_info_t *info,
+			size_t n) {
+  uint8_t units = f->to_mm_state.units;
+  parser_block_t *held[SCALE_BATCH];
+  float v[SCALE_BATCH * SCALE_VALUES];
+  size_t m = 0;
+
+  for (size_t l = 0; l < n; l++) {
+    if (info[l].kind != GC_LINE_BLOCK)
+      continue;
+    parser_block_t *block = &blocks[l];
+    if (block->command_words & bit(MODAL_GROUP_G6))
+      units = block->modal.units;
+    if (units != UNITS_MODE_INCHES)
+      continue;
+
+    float *w = v + m * SCALE_VALUES;
+    memcpy(w, block->values.xyz, sizeof(block->values.xyz));
+    memcpy(w + 3, block->values.ijk, sizeof(block->values.ijk));
+    w[6] = block->values.f;
+    w[7] = block->values.r;
+    held[m++] = block;
+    if (m == SCALE_BATCH) {
+      scale_batch(held, m, v);
+      m = 0;
+    }
+  }
+  if (m)
+    scale_batch(held, m, v);
+}
+
+void process_lines(filter_t *f, const char *text, parser_block_t *blocks,
+		   const gc_line_info_t *info, size_t n) {
+  char line[LINE_BUFFER_SIZE + LINE_BUFFER_PADDING];
+
+  uint64_t t = stats_start(f->stats);
+  scale_lines(f, blocks, info, n);
+  if (STATS_ON(f->stats))
+    stats_lap(f->stats, STATS_TO_MM, t, 0, 0, 0, 0);
+
+  for (size_t l = 0; l < n; l++) {
+    f->lines++;
+    f->bytes += info[l].length + 1;
+
+    // Direct and execute one line of formatted input, and report status of execution.
+    switch (info[l].kind) {
+    case GC_LINE_OVERFLOW:
+      // Report line overflow error.
+      filter_report(f, f->lines, STATUS_OVERFLOW);
+      break;
+    case GC_LINE_EMPTY:
+      // Empty or comment line.
+      back_end_text(f, "");
+      break;
+    case GC_LINE_SYSTEM:
+      // Grbl '$' system command
+      scan_line(text + info[l].offset, info[l].length, line);
+      back_end_text(f, line);
+      break;
+    default:
+      // Execute g-code block.
+      filter_report(f, f->lines, info[l].status);
+
+      to_abs_mm(f, &blocks[l], 1);
+      back_end(f, &blocks[l]);
+    }
+
+    if (f->cache)
+      cache_add(f->cache, info[l].kind, info[l].status, &blocks[l], line);
+  }
+}
@@ -0,0 +1,136 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "gcode.h"
+#include "report.h"
+#include "mm_mode.h"
+#include "absmode.h"
+#include "lasermode.h"
+#include "dragmode.h"
+#include "reorder.h"
+#include "arcfit.h"
+#include "simplify.h"
+#include "estimate.h"
+#include "cleanup.h"
+#include "cache.h"
+#include "output.h"
+#include "pipeline.h"
+#include "stats.h"
+
+// The filter proper: all stages from the parsed blocks to the printed
+// output, for one input stream. Everything is kept in filter_t, so any
+// number of filters can run at the same time on different threads.
+
+#define MODE_LASER 1
+#define MODE_DRAG 2
+
+// Settings of the stages
+typedef struct {
+  int mode;      // MODE_LASER or MODE_DRAG
+  float acc;     // Laser mode acceleration (mm/s2)
+  float offset;  // Drag knife offset (mm)
+  float angle;   // Max deflection angle treated as a continuous curve (degrees)
+  int lookahead; // Laser mode: blocks planned ahead, 0 for the angle test alone
+  float junction_deviation; // Laser mode planner: grbl's $11 (mm)
+  int reorder;   // Reorder the contours to shorten the travel between them
+  float arc_tolerance; // Replace G1 runs with arcs this close to them (mm), 0 not to
+  int simplify;  // Merge collinear G1 moves
+  float simplify_tolerance; // and drop vertices this close to the path (mm)
+  float estimate_acc; // Estimate the machine time at this acceleration (mm/s2)
+                      // instead of printing, 0 not to
+} filter_settings_t;
+
+// Receives the status of each input line the parser rejected. line
+// counts from 1.
+typedef void (*filter_error_t)(void *arg, unsigned long line, uint8_t status);
+
+// State of all stages for one input stream
+typedef struct {
+  int mode;
+  to_mm_state_t to_mm_state;
+  toabs_state_t toabs_state;
+  laser_state_t laser_state;
+  drag_state_t drag_state;
+  int reorder;
+  reorder_state_t reorder_state;
+  int arcfit;
+  arcfit_state_t arcfit_state;
+  int simplify;
+  simplify_state_t simplify_state;
+  int estimate;
+  estimate_t estimate_in;  // Machine time of the blocks entering the back end
+  estimate_t estimate_out; // and of those leaving it, with estimate_blocks()
+  fromabs_state_t fromabs_state;
+  from_mm_state_t from_mm_state;
+  cleanup_state_t cleanup_state;
+  int metric_abs_in;  // to_mm and toabs are in g21 and g90
+  int metric_abs_out; // fromabs and from_mm are in g21 and g90
+  output_t *output;
+  cache_t *cache;   // Records the parsed lines when not NULL
+  pipeline_t back_end; // Stages after toabs, ending in output
+  filter_error_t error;
+  void *error_arg;
+  unsigned long lines; // Input lines and bytes processed
+  unsigned long bytes;
+  stats_t *stats;   // Counts for --stats when not NULL
+  int failed;       // Out of memory in the back end
+} filter_t;
+
+// Sets up all stages for a new input stream, apart from the back end.
+// Errors are dropped until f->error is set, and nothing is counted
+// until f->stats is.
+// cache: records the parsed lines when not NULL
+void filter_init(filter_t *f, const filter_settings_t *settings, output_t *output,
+		 cache_t *cache);
+
+// Sets up the stages after toabs. Blocks entering them are absolute
+// and in mm, so this is also where blocks from a cache sidecar enter.
+// What comes out goes to sink, normally print_blocks().
+// return value: 0 on success, -1 if out of memory
+int back_end_init(filter_t *f, pipeline_sink_t sink, void *sink_state);
+
+// Pipeline sink that converts the blocks back to the units and distance
+// mode of the input, and prints them to f->output. state is the filter_t.
+void print_blocks(void *state, parser_block_t *blocks, size_t n, const char *text);
+
+// Pipeline sink that adds the blocks to f->estimate_out, and prints
+// nothing. state is the filter_t.
+void estimate_blocks(void *state, parser_block_t *blocks, size_t n, const char *text);
+
+// Frees the back end and what the stages hold
+void filter_free(filter_t *f);
+
+// Runs a copy of block, which must be absolute and in mm, through the
+// back end. Sets f->failed if out of memory.
+void back_end(filter_t *f, const parser_block_t *block);
+
+// Sends a line to be printed as is through the back end, to keep its
+// place among the blocks. Sets f->failed if out of memory.
+void back_end_text(filter_t *f, const char *text);
+
+// Pushes out the blocks held back by the stages, at the end of the
+// input. Sets f->failed if out of memory.
+void back_end_flush(filter_t *f);
+
+// Reports the status of input line number line, if it is an error
+static inline void filter_report(filter_t *f, unsigned long line, uint8_t status) {
+  if (status == STATUS_OK)
+    return;
+  // Counted here rather than in the parser, so a --cache replay counts too
+  if (STATS_ON(f->stats))
+    stats_count(&f->stats->errors[status], 1);
+  if (f->error)
+    f->error(f->error_arg, line, status);
+}
+
+// Converts block to absolute mm, and runs it through the back end
+void filter_block(filter_t *f, parser_block_t *block);
+
+// Runs n lines from gc_parse_lines() through the stages, in order.
+// text is the buffer the lines were parsed from.
+void process_lines(filter_t *f, const char *text, parser_block_t *blocks,
+		   const gc_line_info_t *info, size_t n);
+
+#endif
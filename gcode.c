@@ -21,6 +21,8 @@
 
 #include "gcode.h"
 #include "report.h"
+#include "scan.h"
+#include "stats.h"
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
@@ -41,6 +43,8 @@
 #define FAIL(status) return(status);
 
 
+static uint8_t gc_parse_words(char *line, parser_block_t *gc_block);
+
 uint8_t gc_parse_line(char *line, parser_block_t *gc_block)
 {
   /* -------------------------------------------------------------------------------------
@@ -52,6 +56,79 @@ uint8_t gc_parse_line(char *line, parser_block_t *gc_block)
 
   memset(gc_block, 0, sizeof(parser_block_t)); // Initialize the parser block struct.
 
+  return gc_parse_words(line, gc_block);
+}
+
+
+size_t gc_parse_lines(const char *buf, size_t len, parser_block_t *blocks,
+		      gc_line_info_t *info, size_t max, size_t *consumed,
+		      stats_t *stats)
+{
+  char line[LINE_BUFFER_SIZE + LINE_BUFFER_PADDING];
+  const char *p = buf;
+  const char *end = buf + len;
+  size_t n = 0;
+
+  // One memset for the whole batch instead of one per block
+  memset(blocks, 0, max * sizeof(parser_block_t));
+
+  // Counted for the batch, and added to the stats at the end
+  stats_stage_t scan = { 0 }, parse = { 0 };
+  uint64_t t = stats_start(stats);
+
+  while (n < max) {
+    const char *eol = scan_eol(p, end);
+    if (eol == end)
+      break; // no terminator, leave the rest for the next call
+
+    info[n].offset = p - buf;
+    info[n].length = eol - p;
+    info[n].status = STATUS_OK;
+
+    uint8_t flags = scan_line(p, eol - p, line);
+    size_t len = 0;
+    if (STATS_ON(stats)) {
+      stats_time(&scan, &t);
+      len = strlen(line);
+      scan.blocks_in++;
+      scan.blocks_out++;
+      scan.bytes_in += eol - p + 1;
+      scan.bytes_out += len;
+    }
+
+    if (flags & LINE_FLAG_OVERFLOW) {
+      info[n].kind = GC_LINE_OVERFLOW;
+      info[n].status = STATUS_OVERFLOW;
+    } else if (line[0] == 0) {
+      info[n].kind = GC_LINE_EMPTY;
+    } else if (line[0] == '$') {
+      info[n].kind = GC_LINE_SYSTEM;
+    } else {
+      info[n].kind = GC_LINE_BLOCK;
+      info[n].status = gc_parse_words(line, &blocks[n]);
+      if (STATS_ON(stats)) {
+	stats_time(&parse, &t);
+	parse.blocks_in++;
+	parse.blocks_out++;
+	parse.bytes_in += len;
+      }
+    }
+    n++;
+    p = eol + 1;
+  }
+
+  if (STATS_ON(stats)) {
+    stats_add(stats, STATS_SCAN, &scan);
+    stats_add(stats, STATS_PARSE, &parse);
+  }
+  *consumed = p - buf;
+  return n;
+}
+
+
+// Parses one filtered line into gc_block, which must be zeroed.
+static uint8_t gc_parse_words(char *line, parser_block_t *gc_block)
+{
   uint8_t axis_command = AXIS_COMMAND_NONE;
   uint8_t axis_0, axis_1, axis_linear;
   uint8_t coord_select = 0; // Tracks G10 P coordinate selection for execution
@@ -83,7 +160,7 @@ uint8_t gc_parse_line(char *line, parser_block_t *gc_block)
      words, and for negative values set for the value words F, N, P, T, and S. */
 
   uint8_t word_bit; // Bit-value for assigning tracking variables
-  uint8_t char_counter;
+  uint16_t char_counter; // Must hold LINE_BUFFER_SIZE
   char letter;
   float value;
   uint8_t int_value = 0;
@@ -345,121 +422,127 @@ void update_state(gc_modal_t *modal, gc_values_t *values,
 		  parser_block_t *block) {
   // updates state and removes commands from block that are redundant
   
-  if ((block->value_words & bit(WORD_F))) {
-    if (block->values.f == values->f)
-      block->value_words &= ~bit(WORD_F);
-    else
-      values->f = block->values.f;
-  }
-  
-  if ((block->value_words & bit(WORD_I)) &&
-      block->values.ijk[0] == 0)
-    block->value_words &= ~bit(WORD_I);
-  if ((block->value_words & bit(WORD_J)) &&
-      block->values.ijk[1] == 0)
-    block->value_words &= ~bit(WORD_J);
-  if ((block->value_words & bit(WORD_K)) &&
-      block->values.ijk[2] == 0)
-    block->value_words &= ~bit(WORD_K);
-
-  if ((block->value_words & bit(WORD_L))) {
-    if (block->values.l == values->l)
-      block->value_words &= ~bit(WORD_L);
-    else
-      values->l = block->values.l;
-  }
-  
-  if ((block->value_words & bit(WORD_N))) {
-    if (block->values.n == values->n)
-      block->value_words &= ~bit(WORD_N);
-    else
-      values->n = block->values.n;
-  }
-  
-  if ((block->value_words & bit(WORD_P))) {
-    if (block->values.p == values->p)
-      block->value_words &= ~bit(WORD_P);
-    else
-      values->p = block->values.p;
-  }
-  
-  if ((block->value_words & bit(WORD_R)) &&
-      block->values.r == 0)
-    block->value_words &= ~bit(WORD_R);
-    
-  if ((block->value_words & bit(WORD_S))) {
-    if (block->values.s == values->s)
-      block->value_words &= ~bit(WORD_S);
-    else
-      values->s = block->values.s;
-  }
+  // Most blocks are bare moves, or change a word or two. Skip the checks
+  // for the words and groups that aren't there.
+  if (block->value_words & ~(bit(WORD_X) | bit(WORD_Y) | bit(WORD_Z))) {
+    if ((block->value_words & bit(WORD_F))) {
+      if (block->values.f == values->f)
+	block->value_words &= ~bit(WORD_F);
+      else
+	values->f = block->values.f;
+    }
 
-  if ((block->value_words & bit(WORD_T))) {
-    if (block->values.t == values->t)
-      block->value_words &= ~bit(WORD_T);
-    else
-      values->t = block->values.t;
-  }
+    if ((block->value_words & bit(WORD_I)) &&
+	block->values.ijk[0] == 0)
+      block->value_words &= ~bit(WORD_I);
+    if ((block->value_words & bit(WORD_J)) &&
+	block->values.ijk[1] == 0)
+      block->value_words &= ~bit(WORD_J);
+    if ((block->value_words & bit(WORD_K)) &&
+	block->values.ijk[2] == 0)
+      block->value_words &= ~bit(WORD_K);
+
+    if ((block->value_words & bit(WORD_L))) {
+      if (block->values.l == values->l)
+	block->value_words &= ~bit(WORD_L);
+      else
+	values->l = block->values.l;
+    }
 
-  if (block->command_words & bit(MODAL_GROUP_G1)) {
-    if (modal->motion == block->modal.motion)
-      block->command_words &= ~bit(MODAL_GROUP_G1);
-    else
-      modal->motion = block->modal.motion;
-  }
-  if (block->command_words & bit(MODAL_GROUP_G2)) {
-    if (modal->plane_select == block->modal.plane_select)
-      block->command_words &= ~bit(MODAL_GROUP_G2);
-    else
-      modal->plane_select = block->modal.plane_select;
-  }
-  if (block->command_words & bit(MODAL_GROUP_G3)) {
-    if (modal->distance == block->modal.distance)
-      block->command_words &= ~bit(MODAL_GROUP_G3);
-    else
-      modal->distance = block->modal.distance;
-  }
-  if (block->command_words & bit(MODAL_GROUP_G5)) {
-    if (modal->feed_rate == block->modal.feed_rate)
-      block->command_words &= ~bit(MODAL_GROUP_G5);
-    else
-      modal->feed_rate = block->modal.feed_rate;
-  }
-  if (block->command_words & bit(MODAL_GROUP_G6)) {
-    if (modal->units == block->modal.units)
-      block->command_words &= ~bit(MODAL_GROUP_G6);
-    else
-      modal->units = block->modal.units;
-  }
-  if (block->command_words & bit(MODAL_GROUP_G8)) {
-    if (modal->tool_length == block->modal.tool_length)
-      block->command_words &= ~bit(MODAL_GROUP_G8);
-    else
-      modal->tool_length = block->modal.tool_length;
-  }
-  if (block->command_words & bit(MODAL_GROUP_G12)) {
-    if (modal->coord_select == block->modal.coord_select)
-      block->command_words &= ~bit(MODAL_GROUP_G12);
-    else
-      modal->coord_select = block->modal.coord_select;
-  }
-  if (block->command_words & bit(MODAL_GROUP_M4)) {
-    if (modal->program_flow == block->modal.program_flow)
-      block->command_words &= ~bit(MODAL_GROUP_M4);
-    else
-      modal->program_flow = block->modal.program_flow;
-  }
-  if (block->command_words & bit(MODAL_GROUP_M7)) {
-    if (modal->spindle == block->modal.spindle)
-      block->command_words &= ~bit(MODAL_GROUP_M7);
-    else
-      modal->spindle = block->modal.spindle;
+    if ((block->value_words & bit(WORD_N))) {
+      if (block->values.n == values->n)
+	block->value_words &= ~bit(WORD_N);
+      else
+	values->n = block->values.n;
+    }
+
+    if ((block->value_words & bit(WORD_P))) {
+      if (block->values.p == values->p)
+	block->value_words &= ~bit(WORD_P);
+      else
+	values->p = block->values.p;
+    }
+
+    if ((block->value_words & bit(WORD_R)) &&
+	block->values.r == 0)
+      block->value_words &= ~bit(WORD_R);
+
+    if ((block->value_words & bit(WORD_S))) {
+      if (block->values.s == values->s)
+	block->value_words &= ~bit(WORD_S);
+      else
+	values->s = block->values.s;
+    }
+
+    if ((block->value_words & bit(WORD_T))) {
+      if (block->values.t == values->t)
+	block->value_words &= ~bit(WORD_T);
+      else
+	values->t = block->values.t;
+    }
   }
-  if (block->command_words & bit(MODAL_GROUP_M8)) {
-    if (modal->coolant == block->modal.coolant)
-      block->command_words &= ~bit(MODAL_GROUP_M8);
-    else
-      modal->coolant = block->modal.coolant;
+
+  if (block->command_words) {
+    if (block->command_words & bit(MODAL_GROUP_G1)) {
+      if (modal->motion == block->modal.motion)
+	block->command_words &= ~bit(MODAL_GROUP_G1);
+      else
+	modal->motion = block->modal.motion;
+    }
+    if (block->command_words & bit(MODAL_GROUP_G2)) {
+      if (modal->plane_select == block->modal.plane_select)
+	block->command_words &= ~bit(MODAL_GROUP_G2);
+      else
+	modal->plane_select = block->modal.plane_select;
+    }
+    if (block->command_words & bit(MODAL_GROUP_G3)) {
+      if (modal->distance == block->modal.distance)
+	block->command_words &= ~bit(MODAL_GROUP_G3);
+      else
+	modal->distance = block->modal.distance;
+    }
+    if (block->command_words & bit(MODAL_GROUP_G5)) {
+      if (modal->feed_rate == block->modal.feed_rate)
+	block->command_words &= ~bit(MODAL_GROUP_G5);
+      else
+	modal->feed_rate = block->modal.feed_rate;
+    }
+    if (block->command_words & bit(MODAL_GROUP_G6)) {
+      if (modal->units == block->modal.units)
+	block->command_words &= ~bit(MODAL_GROUP_G6);
+      else
+	modal->units = block->modal.units;
+    }
+    if (block->command_words & bit(MODAL_GROUP_G8)) {
+      if (modal->tool_length == block->modal.tool_length)
+	block->command_words &= ~bit(MODAL_GROUP_G8);
+      else
+	modal->tool_length = block->modal.tool_length;
+    }
+    if (block->command_words & bit(MODAL_GROUP_G12)) {
+      if (modal->coord_select == block->modal.coord_select)
+	block->command_words &= ~bit(MODAL_GROUP_G12);
+      else
+	modal->coord_select = block->modal.coord_select;
+    }
+    if (block->command_words & bit(MODAL_GROUP_M4)) {
+      if (modal->program_flow == block->modal.program_flow)
+	block->command_words &= ~bit(MODAL_GROUP_M4);
+      else
+	modal->program_flow = block->modal.program_flow;
+    }
+    if (block->command_words & bit(MODAL_GROUP_M7)) {
+      if (modal->spindle == block->modal.spindle)
+	block->command_words &= ~bit(MODAL_GROUP_M7);
+      else
+	modal->spindle = block->modal.spindle;
+    }
+    if (block->command_words & bit(MODAL_GROUP_M8)) {
+      if (modal->coolant == block->modal.coolant)
+	block->command_words &= ~bit(MODAL_GROUP_M8);
+      else
+	modal->coolant = block->modal.coolant;
+    }
   }
 
   if (modal->distance == DISTANCE_MODE_ABSOLUTE) {
@@ -495,43 +578,54 @@ void update_state(gc_modal_t *modal, gc_values_t *values,
   
 }
 
-void gc_print_line(parser_block_t *block, FILE *output) {
+static void print_float_word(output_t *output, char letter, float value) {
+  output_char(output, letter);
+  output_float(output, value);
+}
+
+static void print_int_word(output_t *output, char letter, int32_t value) {
+  output_char(output, letter);
+  output_int(output, value);
+}
+
+void gc_print_line(parser_block_t *block, output_t *output) {
   if (block->value_words & bit(WORD_F))
-    fprintf(output, "F%g", block->values.f);
+    print_float_word(output, 'F', block->values.f);
   if (block->value_words & bit(WORD_I))
-    fprintf(output, "I%g", block->values.ijk[0]);
+    print_float_word(output, 'I', block->values.ijk[0]);
   if (block->value_words & bit(WORD_J))
-    fprintf(output, "J%g", block->values.ijk[1]);
+    print_float_word(output, 'J', block->values.ijk[1]);
   if (block->value_words & bit(WORD_K))
-    fprintf(output, "K%g", block->values.ijk[2]);
+    print_float_word(output, 'K', block->values.ijk[2]);
   if (block->value_words & bit(WORD_L))
-    fprintf(output, "L%d", block->values.l);
+    print_int_word(output, 'L', block->values.l);
   if (block->value_words & bit(WORD_N))
-    fprintf(output, "N%d", block->values.n);
+    print_int_word(output, 'N', block->values.n);
   if (block->value_words & bit(WORD_P))
-    fprintf(output, "P%g", block->values.p);
+    print_float_word(output, 'P', block->values.p);
   if (block->value_words & bit(WORD_R))
-    fprintf(output, "R%g", block->values.r);
+    print_float_word(output, 'R', block->values.r);
   if (block->value_words & bit(WORD_S))
-    fprintf(output, "S%g", block->values.s);
+    print_float_word(output, 'S', block->values.s);
   if (block->value_words & bit(WORD_T))
-    fprintf(output, "T%d", block->values.t);
+    print_int_word(output, 'T', block->values.t);
   if (block->value_words & bit(WORD_X))
-    fprintf(output, "X%g", block->values.xyz[0]);
+    print_float_word(output, 'X', block->values.xyz[0]);
   if (block->value_words & bit(WORD_Y))
-    fprintf(output, "Y%g", block->values.xyz[1]);
+    print_float_word(output, 'Y', block->values.xyz[1]);
   if (block->value_words & bit(WORD_Z))
-    fprintf(output, "Z%g", block->values.xyz[2]);
+    print_float_word(output, 'Z', block->values.xyz[2]);
 
   if (block->command_words & bit(MODAL_GROUP_G0)) {
     switch(block->non_modal_command) {
     case 38:
     case 40:
     case 102:
-      fprintf(output, "G%d.1", block->non_modal_command - 10);
+      print_int_word(output, 'G', block->non_modal_command - 10);
+      output_str(output, ".1");
       break;
     default:
-      fprintf(output, "G%d", block->non_modal_command);
+      print_int_word(output, 'G', block->non_modal_command);
       break;
     }
   }
@@ -540,71 +634,71 @@ void gc_print_line(parser_block_t *block, FILE *output) {
     if (val > 100) {
       val = (val - 138) / 10. + 38;
     }
-    fprintf(output, "G%g", val);
+    print_float_word(output, 'G', val);
   }
   if (block->command_words & bit(MODAL_GROUP_G2)) {
-    fprintf(output, "G%d", 17 + block->modal.plane_select);
+    print_int_word(output, 'G', 17 + block->modal.plane_select);
   }
   if (block->command_words & bit(MODAL_GROUP_G3)) {
-    fprintf(output, "G%d", 90 + block->modal.distance);
+    print_int_word(output, 'G', 90 + block->modal.distance);
   }
   if (block->command_words & bit(MODAL_GROUP_G4)) {
-    fprintf(output, "G91.1");
+    output_str(output, "G91.1");
   }
   if (block->command_words & bit(MODAL_GROUP_G5)) {
-    fprintf(output, "G%d", 94 - block->modal.feed_rate);
+    print_int_word(output, 'G', 94 - block->modal.feed_rate);
   }
   if (block->command_words & bit(MODAL_GROUP_G6)) {
-    fprintf(output, "G%d", 21 - block->modal.units);
+    print_int_word(output, 'G', 21 - block->modal.units);
   }
   if (block->command_words & bit(MODAL_GROUP_G7)) {
-    fprintf(output, "G40");
+    output_str(output, "G40");
   }
   if (block->command_words & bit(MODAL_GROUP_G8)) {
     switch(block->modal.tool_length) {
     case TOOL_LENGTH_OFFSET_CANCEL:
-      fprintf(output, "G49");
+      output_str(output, "G49");
       break;
     case TOOL_LENGTH_OFFSET_ENABLE_DYNAMIC:
-      fprintf(output, "G43.1");
+      output_str(output, "G43.1");
       break;
     }
   }
   if (block->command_words & bit(MODAL_GROUP_G12)) {
-    fprintf(output, "G%d", block->modal.coord_select + 54);
+    print_int_word(output, 'G', block->modal.coord_select + 54);
     
   }
   if (block->command_words & bit(MODAL_GROUP_G13)) {
-    fprintf(output, "G61");
+    output_str(output, "G61");
   }
   if (block->command_words & bit(MODAL_GROUP_M4)) {
     if (block->modal.program_flow == PROGRAM_FLOW_PAUSED)
-      fprintf(output, "M0");
+      output_str(output, "M0");
     else
-      fprintf(output, "M%d", block->modal.program_flow);
+      print_int_word(output, 'M', block->modal.program_flow);
   }
   if (block->command_words & bit(MODAL_GROUP_M7)) {
     switch(block->modal.spindle) {
     case SPINDLE_ENABLE_CW:
-      fprintf(output, "M3");
+      output_str(output, "M3");
       break;
     case SPINDLE_ENABLE_CCW:
-      fprintf(output, "M4");
+      output_str(output, "M4");
       break;
     case SPINDLE_DISABLE:
-      fprintf(output, "M5");
+      output_str(output, "M5");
       break;
     }
   }
   if (block->command_words & bit(MODAL_GROUP_M8)) {
     if (block->modal.coolant & COOLANT_MIST_ENABLE)
-      fprintf(output, "M7");
+      output_str(output, "M7");
     if (block->modal.coolant & COOLANT_FLOOD_ENABLE)
-      fprintf(output, "M8");
+      output_str(output, "M8");
     if (block->modal.coolant == COOLANT_DISABLE)
-      fprintf(output, "M9");
+      output_str(output, "M9");
   }
   if (block->command_words & bit(MODAL_GROUP_M9)) {
-    fprintf(output, "M56");
+    output_str(output, "M56");
   }
 }
@@ -23,8 +23,11 @@
 #define gcode_h
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 #include "nuts_bolts.h"
+#include "output.h"
+#include "stats.h"
 
 #define N_AXIS 3
 
@@ -231,7 +234,6 @@ typedef struct {
                                  // machine zero in mm. Non-persistent. Cleared upon reset and boot.
   float tool_length_offset;      // Tracks tool length offset value when enabled.
 } parser_state_t;
-extern parser_state_t gc_state;
 
 
 typedef struct {
@@ -243,11 +245,40 @@ typedef struct {
 } parser_block_t;
 
 
+// Kinds of line reported by gc_parse_lines()
+#define GC_LINE_BLOCK 0    // G-code block, parsed into the block array
+#define GC_LINE_EMPTY 1    // Empty or comment line
+#define GC_LINE_SYSTEM 2   // Grbl '$' system command, not parsed
+#define GC_LINE_OVERFLOW 3 // Line too long after filtering
+
+typedef struct {
+  size_t offset;   // Start of the line in the buffer
+  size_t length;   // Length of the line, without terminator
+  uint8_t kind;    // GC_LINE_*
+  uint8_t status;  // STATUS_* code from the parser, STATUS_OVERFLOW for overflows
+} gc_line_info_t;
+
+
+// Parses one line filtered by scan_line() into block. The parser reads
+// numbers 8 bytes at a time, so the line must be followed by
+// LINE_BUFFER_PADDING readable bytes after its NUL, as scan_line()'s
+// buffer is. Library callers should use gfilter_parse_line() instead.
+// return value: STATUS_* code
 uint8_t gc_parse_line(char *line, parser_block_t *block);
 
+// Parses up to max raw lines from buf, filtering each like the main loop does, into
+// blocks[i] and info[i]. Only lines with a terminator are parsed. Blocks for lines
+// that aren't GC_LINE_BLOCK are left zeroed. *consumed receives the number of bytes
+// used, up to and including the last terminator. The scanning and
+// parsing are counted into stats unless it is NULL.
+// return value: number of lines parsed
+size_t gc_parse_lines(const char *buf, size_t len, parser_block_t *blocks,
+		      gc_line_info_t *info, size_t max, size_t *consumed,
+		      stats_t *stats);
+
 void update_state(gc_modal_t *modal, gc_values_t *values,
 		  parser_block_t *block);
 
-void gc_print_line(parser_block_t *block, FILE *output);
+void gc_print_line(parser_block_t *block, output_t *output);
 
 #endif
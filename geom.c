@@ -71,3 +71,369 @@ void calcv(parser_block_t *block, uint8_t motion, float dx, float dy, float v0[2
       }
     }
 }
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GEOM_X86 1
+#endif
+
+// The scalar versions are written the way normarcs(), calcv() and
+// to_mm() have them, so the float and double steps are the same
+
+static void centers_scalar(size_t n, const float *x, const float *y, float *r,
+			   const uint8_t *ccw, float *i, float *j) {
+  for (size_t k = 0; k < n; k++) {
+    float h_x2_div_d = 4.0 * r[k]*r[k] - x[k]*x[k] - y[k]*y[k];
+    h_x2_div_d = -sqrt(h_x2_div_d)/hypot_f(x[k], y[k]);
+    if (ccw[k])
+      h_x2_div_d = -h_x2_div_d;
+    if (r[k] < 0) {
+      h_x2_div_d = -h_x2_div_d;
+      r[k] = -r[k];
+    }
+    i[k] = 0.5*(x[k]-(y[k]*h_x2_div_d));
+    j[k] = 0.5*(y[k]+(x[k]*h_x2_div_d));
+  }
+}
+
+static void tangents_scalar(size_t n, const float *dx, const float *dy, const float *i,
+			    const float *j, const float *r, const uint8_t *ccw,
+			    float *v0x, float *v0y, float *v1x, float *v1y) {
+  for (size_t k = 0; k < n; k++) {
+    if (r[k] != 0) {
+      v0x[k] = -j[k] / r[k];
+      v0y[k] = i[k] / r[k];
+      if (ccw[k]) {
+	v0x[k] = -v0x[k];
+	v0y[k] = -v0y[k];
+      }
+      v1x[k] = (dy[k] - j[k]) / r[k];
+      v1y[k] = (-dx[k] + i[k]) / r[k];
+    } else {
+      float d2 = dx[k] * dx[k] + dy[k] * dy[k];
+      if (d2 != 0) {
+	float d = sqrt(d2);
+	v0x[k] = v1x[k] = dx[k] / d;
+	v0y[k] = v1y[k] = dy[k] / d;
+      } else {
+	v0x[k] = dx[k];
+	v0y[k] = dy[k];
+      }
+    }
+  }
+}
+
+static void lengths_scalar(size_t n, const float *dx, const float *dy, float *len) {
+  for (size_t k = 0; k < n; k++)
+    len[k] = hypot_f(dx[k], dy[k]);
+}
+
+static void junction_cos_scalar(size_t n, const float *v1x, const float *v1y,
+				const float *v0x, const float *v0y, float *cosj) {
+  for (size_t k = 0; k < n; k++)
+    cosj[k] = -(v1x[k] * v0x[k] + v1y[k] * v0y[k]);
+}
+
+static void scale_scalar(size_t n, float *v, double s) {
+  for (size_t k = 0; k < n; k++)
+    v[k] *= s;
+}
+
+static void unscale_scalar(size_t n, float *v, double s) {
+  for (size_t k = 0; k < n; k++)
+    v[k] /= s;
+}
+
+static const geom_kernels_t kernels_scalar = {
+  "scalar", centers_scalar, tangents_scalar, lengths_scalar, junction_cos_scalar,
+  scale_scalar, unscale_scalar
+};
+
+#ifdef GEOM_X86
+
+// The vector versions do 4 (SSE2) or 8 (AVX) moves per step, and leave
+// the rest to the scalar ones. Where the scalar code goes through double
+// the floats are widened, 2 or 4 to a register. Both sides of a branch
+// are computed and the lanes picked with a mask; negation flips the sign
+// bit, the way the compiler does it.
+
+// All ones in the lanes of the 4 flags at b that are nonzero
+static inline __m128 flags_sse2(const uint8_t *b) {
+  uint32_t w;
+  memcpy(&w, b, sizeof(w));
+  __m128i zero = _mm_setzero_si128();
+  __m128i v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(w), zero), zero);
+  return _mm_castsi128_ps(_mm_cmpgt_epi32(v, zero));
+}
+
+static inline __m128 select_sse2(__m128 mask, __m128 a, __m128 b) {
+  return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static void centers_sse2(size_t n, const float *x, const float *y, float *r,
+			 const uint8_t *ccw, float *i, float *j) {
+  const __m128 sign = _mm_set1_ps(-0.f), zero = _mm_setzero_ps(), half = _mm_set1_ps(0.5f);
+  const __m128d four = _mm_set1_pd(4.0);
+  size_t k = 0;
+  for (; k + 4 <= n; k += 4) {
+    __m128 X = _mm_loadu_ps(x + k), Y = _mm_loadu_ps(y + k), R = _mm_loadu_ps(r + k);
+    __m128 xx = _mm_mul_ps(X, X), yy = _mm_mul_ps(Y, Y);
+    __m128 hyp = _mm_sqrt_ps(_mm_add_ps(xx, yy));
+
+    __m128 h2[2];
+    for (int p = 0; p < 2; p++) {
+      __m128d rd = _mm_cvtps_pd(R), xxd = _mm_cvtps_pd(xx), yyd = _mm_cvtps_pd(yy);
+      __m128d hypd = _mm_cvtps_pd(hyp);
+      __m128d h = _mm_sub_pd(_mm_sub_pd(_mm_mul_pd(_mm_mul_pd(four, rd), rd), xxd), yyd);
+      h = _mm_cvtps_pd(_mm_cvtpd_ps(h)); // h_x2_div_d is a float
+      h2[p] = _mm_cvtpd_ps(_mm_div_pd(_mm_sqrt_pd(h), hypd));
+      R = _mm_movehl_ps(R, R);
+      xx = _mm_movehl_ps(xx, xx);
+      yy = _mm_movehl_ps(yy, yy);
+      hyp = _mm_movehl_ps(hyp, hyp);
+    }
+    __m128 h = _mm_xor_ps(_mm_movelh_ps(h2[0], h2[1]), sign);
+
+    R = _mm_loadu_ps(r + k);
+    __m128 neg = _mm_cmplt_ps(R, zero);
+    h = _mm_xor_ps(h, _mm_and_ps(_mm_xor_ps(flags_sse2(ccw + k), neg), sign));
+    _mm_storeu_ps(r + k, _mm_xor_ps(R, _mm_and_ps(neg, sign)));
+    _mm_storeu_ps(i + k, _mm_mul_ps(half, _mm_sub_ps(X, _mm_mul_ps(Y, h))));
+    _mm_storeu_ps(j + k, _mm_mul_ps(half, _mm_add_ps(Y, _mm_mul_ps(X, h))));
+  }
+  centers_scalar(n - k, x + k, y + k, r + k, ccw + k, i + k, j + k);
+}
+
+static void tangents_sse2(size_t n, const float *dx, const float *dy, const float *i,
+			  const float *j, const float *r, const uint8_t *ccw,
+			  float *v0x, float *v0y, float *v1x, float *v1y) {
+  const __m128 sign = _mm_set1_ps(-0.f), zero = _mm_setzero_ps();
+  size_t k = 0;
+  for (; k + 4 <= n; k += 4) {
+    __m128 DX = _mm_loadu_ps(dx + k), DY = _mm_loadu_ps(dy + k);
+    __m128 I = _mm_loadu_ps(i + k), J = _mm_loadu_ps(j + k), R = _mm_loadu_ps(r + k);
+
+    __m128 flip = _mm_and_ps(flags_sse2(ccw + k), sign);
+    __m128 a0x = _mm_xor_ps(_mm_div_ps(_mm_xor_ps(J, sign), R), flip);
+    __m128 a0y = _mm_xor_ps(_mm_div_ps(I, R), flip);
+    __m128 a1x = _mm_div_ps(_mm_sub_ps(DY, J), R);
+    __m128 a1y = _mm_div_ps(_mm_add_ps(_mm_xor_ps(DX, sign), I), R);
+
+    __m128 d2 = _mm_add_ps(_mm_mul_ps(DX, DX), _mm_mul_ps(DY, DY));
+    __m128 moves = _mm_cmpneq_ps(d2, zero);
+    __m128 d = _mm_sqrt_ps(d2);
+    __m128 ux = _mm_div_ps(DX, d), uy = _mm_div_ps(DY, d);
+    __m128 l0x = select_sse2(moves, ux, DX), l0y = select_sse2(moves, uy, DY);
+    __m128 l1x = select_sse2(moves, ux, _mm_loadu_ps(v1x + k));
+    __m128 l1y = select_sse2(moves, uy, _mm_loadu_ps(v1y + k));
+
+    __m128 arc = _mm_cmpneq_ps(R, zero);
+    _mm_storeu_ps(v0x + k, select_sse2(arc, a0x, l0x));
+    _mm_storeu_ps(v0y + k, select_sse2(arc, a0y, l0y));
+    _mm_storeu_ps(v1x + k, select_sse2(arc, a1x, l1x));
+    _mm_storeu_ps(v1y + k, select_sse2(arc, a1y, l1y));
+  }
+  tangents_scalar(n - k, dx + k, dy + k, i + k, j + k, r + k, ccw + k,
+		  v0x + k, v0y + k, v1x + k, v1y + k);
+}
+
+static void lengths_sse2(size_t n, const float *dx, const float *dy, float *len) {
+  size_t k = 0;
+  for (; k + 4 <= n; k += 4) {
+    __m128 DX = _mm_loadu_ps(dx + k), DY = _mm_loadu_ps(dy + k);
+    _mm_storeu_ps(len + k, _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(DX, DX), _mm_mul_ps(DY, DY))));
+  }
+  lengths_scalar(n - k, dx + k, dy + k, len + k);
+}
+
+static void junction_cos_sse2(size_t n, const float *v1x, const float *v1y,
+			      const float *v0x, const float *v0y, float *cosj) {
+  const __m128 sign = _mm_set1_ps(-0.f);
+  size_t k = 0;
+  for (; k + 4 <= n; k += 4) {
+    __m128 dot = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(v1x + k), _mm_loadu_ps(v0x + k)),
+			    _mm_mul_ps(_mm_loadu_ps(v1y + k), _mm_loadu_ps(v0y + k)));
+    _mm_storeu_ps(cosj + k, _mm_xor_ps(dot, sign));
+  }
+  junction_cos_scalar(n - k, v1x + k, v1y + k, v0x + k, v0y + k, cosj + k);
+}
+
+static void scale_sse2(size_t n, float *v, double s) {
+  const __m128d S = _mm_set1_pd(s);
+  size_t k = 0;
+  for (; k + 4 <= n; k += 4) {
+    __m128 V = _mm_loadu_ps(v + k);
+    __m128 lo = _mm_cvtpd_ps(_mm_mul_pd(_mm_cvtps_pd(V), S));
+    __m128 hi = _mm_cvtpd_ps(_mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(V, V)), S));
+    _mm_storeu_ps(v + k, _mm_movelh_ps(lo, hi));
+  }
+  scale_scalar(n - k, v + k, s);
+}
+
+static void unscale_sse2(size_t n, float *v, double s) {
+  const __m128d S = _mm_set1_pd(s);
+  size_t k = 0;
+  for (; k + 4 <= n; k += 4) {
+    __m128 V = _mm_loadu_ps(v + k);
+    __m128 lo = _mm_cvtpd_ps(_mm_div_pd(_mm_cvtps_pd(V), S));
+    __m128 hi = _mm_cvtpd_ps(_mm_div_pd(_mm_cvtps_pd(_mm_movehl_ps(V, V)), S));
+    _mm_storeu_ps(v + k, _mm_movelh_ps(lo, hi));
+  }
+  unscale_scalar(n - k, v + k, s);
+}
+
+static const geom_kernels_t kernels_sse2 = {
+  "sse2", centers_sse2, tangents_sse2, lengths_sse2, junction_cos_sse2,
+  scale_sse2, unscale_sse2
+};
+
+// Not "avx2,fma": the compiler would be free to fuse a multiply and add
+// and round once where the scalar code rounds twice
+#define AVX_TARGET __attribute__((target("avx")))
+
+AVX_TARGET
+static inline __m256 flags_avx(const uint8_t *b) {
+  return _mm256_insertf128_ps(_mm256_castps128_ps256(flags_sse2(b)), flags_sse2(b + 4), 1);
+}
+
+// The low and high 4 lanes of a, widened to double
+#define LO_PD(a) _mm256_cvtps_pd(_mm256_castps256_ps128(a))
+#define HI_PD(a) _mm256_cvtps_pd(_mm256_extractf128_ps(a, 1))
+#define JOIN_PS(lo, hi) _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1)
+
+AVX_TARGET
+static void centers_avx(size_t n, const float *x, const float *y, float *r,
+			const uint8_t *ccw, float *i, float *j) {
+  const __m256 sign = _mm256_set1_ps(-0.f), zero = _mm256_setzero_ps();
+  const __m256 half = _mm256_set1_ps(0.5f);
+  const __m256d four = _mm256_set1_pd(4.0);
+  size_t k = 0;
+  for (; k + 8 <= n; k += 8) {
+    __m256 X = _mm256_loadu_ps(x + k), Y = _mm256_loadu_ps(y + k), R = _mm256_loadu_ps(r + k);
+    __m256 xx = _mm256_mul_ps(X, X), yy = _mm256_mul_ps(Y, Y);
+    __m256 hyp = _mm256_sqrt_ps(_mm256_add_ps(xx, yy));
+
+    __m256d hlo = _mm256_sub_pd(_mm256_sub_pd(_mm256_mul_pd(_mm256_mul_pd(four, LO_PD(R)), LO_PD(R)),
+					      LO_PD(xx)), LO_PD(yy));
+    __m256d hhi = _mm256_sub_pd(_mm256_sub_pd(_mm256_mul_pd(_mm256_mul_pd(four, HI_PD(R)), HI_PD(R)),
+					      HI_PD(xx)), HI_PD(yy));
+    hlo = _mm256_cvtps_pd(_mm256_cvtpd_ps(hlo)); // h_x2_div_d is a float
+    hhi = _mm256_cvtps_pd(_mm256_cvtpd_ps(hhi));
+    __m256 h = JOIN_PS(_mm256_cvtpd_ps(_mm256_div_pd(_mm256_sqrt_pd(hlo), LO_PD(hyp))),
+		       _mm256_cvtpd_ps(_mm256_div_pd(_mm256_sqrt_pd(hhi), HI_PD(hyp))));
+    h = _mm256_xor_ps(h, sign);
+
+    __m256 neg = _mm256_cmp_ps(R, zero, _CMP_LT_OQ);
+    h = _mm256_xor_ps(h, _mm256_and_ps(_mm256_xor_ps(flags_avx(ccw + k), neg), sign));
+    _mm256_storeu_ps(r + k, _mm256_xor_ps(R, _mm256_and_ps(neg, sign)));
+    _mm256_storeu_ps(i + k, _mm256_mul_ps(half, _mm256_sub_ps(X, _mm256_mul_ps(Y, h))));
+    _mm256_storeu_ps(j + k, _mm256_mul_ps(half, _mm256_add_ps(Y, _mm256_mul_ps(X, h))));
+  }
+  centers_scalar(n - k, x + k, y + k, r + k, ccw + k, i + k, j + k);
+}
+
+AVX_TARGET
+static void lengths_avx(size_t n, const float *dx, const float *dy, float *len) {
+  size_t k = 0;
+  for (; k + 8 <= n; k += 8) {
+    __m256 DX = _mm256_loadu_ps(dx + k), DY = _mm256_loadu_ps(dy + k);
+    _mm256_storeu_ps(len + k, _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(DX, DX),
+							    _mm256_mul_ps(DY, DY))));
+  }
+  lengths_scalar(n - k, dx + k, dy + k, len + k);
+}
+
+AVX_TARGET
+static void junction_cos_avx(size_t n, const float *v1x, const float *v1y,
+			     const float *v0x, const float *v0y, float *cosj) {
+  const __m256 sign = _mm256_set1_ps(-0.f);
+  size_t k = 0;
+  for (; k + 8 <= n; k += 8) {
+    __m256 dot = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(v1x + k), _mm256_loadu_ps(v0x + k)),
+			       _mm256_mul_ps(_mm256_loadu_ps(v1y + k), _mm256_loadu_ps(v0y + k)));
+    _mm256_storeu_ps(cosj + k, _mm256_xor_ps(dot, sign));
+  }
+  junction_cos_scalar(n - k, v1x + k, v1y + k, v0x + k, v0y + k, cosj + k);
+}
+
+AVX_TARGET
+static void scale_avx(size_t n, float *v, double s) {
+  const __m256d S = _mm256_set1_pd(s);
+  size_t k = 0;
+  for (; k + 8 <= n; k += 8) {
+    __m256 V = _mm256_loadu_ps(v + k);
+    _mm256_storeu_ps(v + k, JOIN_PS(_mm256_cvtpd_ps(_mm256_mul_pd(LO_PD(V), S)),
+				    _mm256_cvtpd_ps(_mm256_mul_pd(HI_PD(V), S))));
+  }
+  scale_scalar(n - k, v + k, s);
+}
+
+AVX_TARGET
+static void unscale_avx(size_t n, float *v, double s) {
+  const __m256d S = _mm256_set1_pd(s);
+  size_t k = 0;
+  for (; k + 8 <= n; k += 8) {
+    __m256 V = _mm256_loadu_ps(v + k);
+    _mm256_storeu_ps(v + k, JOIN_PS(_mm256_cvtpd_ps(_mm256_div_pd(LO_PD(V), S)),
+				    _mm256_cvtpd_ps(_mm256_div_pd(HI_PD(V), S))));
+  }
+  unscale_scalar(n - k, v + k, s);
+}
+
+// tangents is division bound, and 8 wide division is no faster per move
+// than 4 wide on most CPUs with AVX, so the SSE2 version is kept
+static const geom_kernels_t kernels_avx = {
+  "avx", centers_avx, tangents_sse2, lengths_avx, junction_cos_avx,
+  scale_avx, unscale_avx
+};
+
+static const geom_kernels_t *kernel_sets[4] = { &kernels_scalar, &kernels_sse2 };
+static const geom_kernels_t *impl = &kernels_sse2;
+
+__attribute__((constructor))
+static void geom_init(void) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx")) {
+    kernel_sets[2] = &kernels_avx;
+    impl = &kernels_avx;
+  }
+}
+
+#else
+
+static const geom_kernels_t *kernel_sets[2] = { &kernels_scalar };
+static const geom_kernels_t *impl = &kernels_scalar;
+
+#endif
+
+const geom_kernels_t *geom_kernels(int k) {
+  return k >= 0 && k < (int)(sizeof(kernel_sets) / sizeof(kernel_sets[0])) ? kernel_sets[k] : NULL;
+}
+
+void geom_centers(size_t n, const float *x, const float *y, float *r, const uint8_t *ccw,
+		  float *i, float *j) {
+  impl->centers(n, x, y, r, ccw, i, j);
+}
+
+void geom_tangents(size_t n, const float *dx, const float *dy, const float *i, const float *j,
+		   const float *r, const uint8_t *ccw,
+		   float *v0x, float *v0y, float *v1x, float *v1y) {
+  impl->tangents(n, dx, dy, i, j, r, ccw, v0x, v0y, v1x, v1y);
+}
+
+void geom_lengths(size_t n, const float *dx, const float *dy, float *len) {
+  impl->lengths(n, dx, dy, len);
+}
+
+void geom_junction_cos(size_t n, const float *v1x, const float *v1y,
+		       const float *v0x, const float *v0y, float *cosj) {
+  impl->junction_cos(n, v1x, v1y, v0x, v0y, cosj);
+}
+
+void geom_scale(size_t n, float *v, double s) {
+  impl->scale(n, v, s);
+}
+
+void geom_unscale(size_t n, float *v, double s) {
+  impl->unscale(n, v, s);
+}
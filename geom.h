@@ -6,5 +6,52 @@
 void normarcs(parser_block_t *block, uint8_t motion, float x, float y);
 void calcv(parser_block_t *block, uint8_t motion, float dx, float dy, float v0[2], float v1[2]);
 
+// Batch versions of the above, and of the other per block geometry, over
+// arrays with one element per move. They use SSE2 or AVX, whichever the
+// CPU supports, and give the same bits as the scalar code: the vector
+// versions do the same IEEE operations in the same order and precision,
+// and never contract them into fused multiply-adds.
+
+// normarcs() for arcs given with R: the center (i, j) from the target
+// (x, y) relative to the start and the radius r, which is made positive.
+// ccw: nonzero for G3. |r| must reach the target.
+void geom_centers(size_t n, const float *x, const float *y, float *r, const uint8_t *ccw,
+		  float *i, float *j);
+
+// calcv(): the direction (v0x, v0y) at the start of each move and
+// (v1x, v1y) at its end. A move is an arc if r is nonzero. v1 is left as
+// it is for moves of zero length.
+void geom_tangents(size_t n, const float *dx, const float *dy, const float *i, const float *j,
+		   const float *r, const uint8_t *ccw,
+		   float *v0x, float *v0y, float *v1x, float *v1y);
+
+// hypot_f(): len = sqrt(dx^2 + dy^2)
+void geom_lengths(size_t n, const float *dx, const float *dy, float *len);
+
+// Cosine of the junction angle the way the laser mode planner has it:
+// cosj = -(end direction of the move before . start direction of the next)
+void geom_junction_cos(size_t n, const float *v1x, const float *v1y,
+		       const float *v0x, const float *v0y, float *cosj);
+
+// v *= k and v /= k in double, as to_mm() and from_mm() convert units
+void geom_scale(size_t n, float *v, double k);
+void geom_unscale(size_t n, float *v, double k);
+
+// One set of the batch versions
+typedef struct {
+  const char *name;
+  void (*centers)(size_t, const float *, const float *, float *, const uint8_t *, float *, float *);
+  void (*tangents)(size_t, const float *, const float *, const float *, const float *,
+		   const float *, const uint8_t *, float *, float *, float *, float *);
+  void (*lengths)(size_t, const float *, const float *, float *);
+  void (*junction_cos)(size_t, const float *, const float *, const float *, const float *, float *);
+  void (*scale)(size_t, float *, double);
+  void (*unscale)(size_t, float *, double);
+} geom_kernels_t;
+
+// The sets this CPU can run, the scalar reference first
+// return value: set number k, NULL past the last
+const geom_kernels_t *geom_kernels(int k);
+
 #endif
 
@@ -1,210 +1,765 @@
-#define LINE_BUFFER_SIZE 1024
-#define LINE_FLAG_OVERFLOW 1
-#define LINE_FLAG_COMMENT_PARENTHESES 2
-#define LINE_FLAG_COMMENT_SEMICOLON 4
-
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <stdlib.h>
+#include <time.h>
+#include <sys/stat.h>
 #include "report.h"
 #include "gcode.h"
-#include "lasermode.h"
-#include "dragmode.h"
-#include "mm_mode.h"
-#include "cleanup.h"
-#include "absmode.h"
+#include "input.h"
+#include "output.h"
+#include "scan.h"
+#include "cache.h"
+#include "parse_pool.h"
+#include "codec.h"
+#include "pipeline.h"
+#include "filter.h"
+#include "stage_threads.h"
+#include "batch.h"
+#include "server.h"
+#include "stats.h"
+
+#define PARSE_BATCH 256 // Lines parsed per gc_parse_lines() call
+
+// Prints parser errors to stderr, the way grbl reports them. With --batch
+// and --serve, arg names the input and the line number is added, in one
+// fprintf() per error, so the errors of inputs filtered at the same time
+// can be told apart and don't mix.
+static void report_error(void *arg, unsigned long line, uint8_t status) {
+  if (arg)
+    fprintf(stderr, "%s:%lu: error:%d\n", (const char *)arg, line, status);
+  else
+    report_status_message(status);
+}
+
+// Transform stage of --pipeline mode, on a thread of its own
+static void transform_chunk(void *state, parse_chunk_t *c) {
+  filter_t *f = state;
+  if (c->failed) {
+    // Reported as out of memory when done
+    f->failed = 1;
+    return;
+  }
+  process_lines(f, c->data, c->blocks, c->info, c->nlines);
+}
+
+static void transform_finish(void *state) {
+  back_end_flush(state);
+}
+
+// Per line latency in --stream mode, from the time the line was read
+// (taken up, for a mapped file) to the time its output was written
+typedef struct {
+  unsigned long lines;
+  double total;
+  double max;
+} latency_t;
 
-#define MODE_LASER 1
-#define MODE_DRAG 2
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void latency_add(latency_t *lat, unsigned long lines, double t) {
+  lat->lines += lines;
+  lat->total += t * lines;
+  if (t > lat->max)
+    lat->max = t;
+}
 
 void usage() {
-  fprintf(stderr, "Usage: gfilter <-l acc | -d offs> [-a deg] [infile [outfile]]\n");
+  fprintf(stderr, "Usage: gfilter <-l acc | -d offs> [-a deg] [options] [infile [outfile]]\n");
+  fprintf(stderr, "       gfilter <-l acc | -d offs> [-a deg] [options] --batch outdir [files or dirs]\n");
+  fprintf(stderr, "       gfilter [-l acc | -d offs] [-a deg] [options] --serve socket\n");
   fprintf(stderr, "options:\n");
   fprintf(stderr, "  -l <acc>  Laser mode / accelleration (mm/s2)\n");
   fprintf(stderr, "  -d <offs> Drag knife mode / offset (mm)\n");
   fprintf(stderr, "  -a <deg>  Max deflection angle which should be treated as continuous curve\n");
   fprintf(stderr, "            Default = 2\n");
+  fprintf(stderr, "  --lookahead <n>  Laser mode: plan n blocks ahead the way grbl does, and\n");
+  fprintf(stderr, "            only extend cuts where the machine would slow down. Default = 0,\n");
+  fprintf(stderr, "            extend at every corner sharper than -a\n");
+  fprintf(stderr, "  --junction-deviation <mm>  grbl's $11, for --lookahead. Default = 0.01\n");
+  fprintf(stderr, "  --arc-fit <mm>  Replace runs of G1 moves with G2/G3 arcs where they are\n");
+  fprintf(stderr, "            within this distance of an arc. Reports the blocks saved\n");
+  fprintf(stderr, "  --simplify <mm>  Merge G1 moves in the same direction, and drop the\n");
+  fprintf(stderr, "            vertices within this distance of the path. Reports the blocks saved\n");
+  fprintf(stderr, "  --reorder  Reorder and reverse the contours to shorten the travel between\n");
+  fprintf(stderr, "            them. Reports the travel saved\n");
+  fprintf(stderr, "  --estimate[=acc]  Print the machine time of the input and of the\n");
+  fprintf(stderr, "            output at acc (mm/s2, default -l), and the time the filter adds,\n");
+  fprintf(stderr, "            instead of the G-code\n");
+  fprintf(stderr, "  --stats[=json]  Print the time spent in each stage and the blocks and\n");
+  fprintf(stderr, "            bytes through it on exit, as a table or as JSON\n");
+  fprintf(stderr, "  --shortest  Print numbers with the fewest digits that read back exactly,\n");
+  fprintf(stderr, "            instead of 6 significant digits\n");
+  fprintf(stderr, "  -j, --jobs <n>  Parse on n threads, 0 = one per CPU. Default = 1\n");
+  fprintf(stderr, "  --pipeline  Read, parse, filter and write on a thread each. Replaces -j\n");
+  fprintf(stderr, "  --stream  Write out each line as soon as it is processed, for use in a\n");
+  fprintf(stderr, "            pipe to a live sender. Reports the latency on exit\n");
+  fprintf(stderr, "  --cache[=file]  Keep the parsed input in a sidecar file (default\n");
+  fprintf(stderr, "            infile" CACHE_SUFFIX ") and reuse it while infile is unchanged\n");
+  fprintf(stderr, "  --batch <outdir>  Filter each input file into outdir, -j files at a time\n");
+  fprintf(stderr, "            (default one per CPU). Inputs are files, directories of\n");
+  fprintf(stderr, "            files, or names read from stdin. Reports the throughput.\n");
+  fprintf(stderr, "            Parser errors print as file:line: error:N\n");
+  fprintf(stderr, "  --serve <socket>  Serve filter requests on a Unix domain socket, -j at\n");
+  fprintf(stderr, "            a time (default one per CPU). A request is a line of options\n");
+  fprintf(stderr, "            (-l, -d, -a, --lookahead, --junction-deviation, --arc-fit,\n");
+  fprintf(stderr, "            --simplify, --reorder, --shortest) followed by the G-code; the\n");
+  fprintf(stderr, "            filtered G-code is sent back. Parser errors print on\n");
+  fprintf(stderr, "            stderr as request:line: error:N\n");
+  fprintf(stderr, "gzip and zstd compressed input is decompressed on the fly. Output is\n");
+  fprintf(stderr, "compressed if outfile ends in .gz or .zst\n");
   exit(1);
 }
 
-int main(int argc, char **argv) {
-  int mode = 0;
-  float angle = 2;
-  FILE *infile = NULL;
-  FILE *outfile = NULL;
-  float acc = 0;
-  float offset = 0;
-  
-  int opt;
-  while ((opt = getopt(argc, argv, "l:d:a:")) != -1) {
-    switch (opt) {
-    case 'l':
-      mode = MODE_LASER;
-      acc = atof(optarg);
-      break;
-    case 'd':
-      mode = MODE_DRAG;
-      offset = atof(optarg);
-      break;
-    case 'a':
-      angle = atof(optarg);
-      break;
-    default:
-      usage();
+// Settings from the command line, the same for every file
+typedef struct {
+  filter_settings_t settings;
+  int shortest;
+  int use_cache;
+  const char *cache_path; // NULL for infile CACHE_SUFFIX
+  int jobs;
+  int stream;
+  int pipelined;
+  int name_errors; // Prefix parser errors with the input name and line
+  int stats;       // Count for --stats
+} options_t;
+
+// --stats totals over all files, each counted on its own first
+static stats_t stats_total;
+
+// Prints the totals of e, labelled
+static void print_estimate(const char *label, const estimate_t *e) {
+  printf("%-8s %10.1f s, cut %.1f s, travel %.1f s", label, e->time, e->cut_time, e->travel_time);
+  if (e->dwell_time)
+    printf(", dwell %.1f s", e->dwell_time);
+  printf(", %.1f mm, %.1f mm cut\n", e->distance, e->cut_distance);
+}
+
+// Reads, parses and filters the rest of in on this thread
+static void filter_input(filter_t *f, input_t *in, int stream, latency_t *latency) {
+  parser_block_t batch[PARSE_BATCH];
+  gc_line_info_t info[PARSE_BATCH];
+  const char *chunk;
+  size_t chunk_len;
+
+  // Process incoming data a batch of lines at a time. The parser performs an initial
+  // filtering by removing spaces and comments and capitalizing all letters.
+  // In stream mode each line is parsed, processed and written before
+  // the next one is looked at.
+  while (input_getlines(in, &chunk, &chunk_len)) {
+    double arrival = stream ? now() : 0;
+    while (chunk_len) {
+      // A mapped file comes in whole, and the lines behind this one
+      // aren't waiting on a sender. Time each line from when it is
+      // looked at instead.
+      if (stream && in->mapped)
+	arrival = now();
+      size_t consumed;
+      size_t nlines = gc_parse_lines(chunk, chunk_len, batch, info,
+				     stream ? 1 : PARSE_BATCH, &consumed, f->stats);
+      process_lines(f, chunk, batch, info, nlines);
+      if (stream) {
+	output_flush(f->output);
+	latency_add(latency, nlines, now() - arrival);
+      }
+      chunk += consumed;
+      chunk_len -= consumed;
     }
   }
+}
 
-  if (mode == 0)
-    usage();
-  
-  if (optind < argc) {
-    infile = fopen(argv[optind], "rt");
-    if (!infile) {
+// Filters one file. in_path and out_path may be NULL for stdin and
+// stdout. Only touches state of its own, so several can run at once.
+// return value: exit status, 0 on success
+static int run_file(const options_t *opt, const char *in_path, const char *out_path,
+		    batch_stats_t *stats) {
+  input_t infile;
+  FILE *outfile = NULL;
+  codec_t *encoder = NULL;
+  output_t output;
+  int use_cache = opt->use_cache;
+  const char *cache_path = opt->cache_path;
+  int stream = opt->stream;
+  int pipelined = opt->pipelined;
+  int jobs = opt->jobs;
+  int ret = 0;
+
+  if (input_open(&infile, in_path) < 0) {
+    if (errno == ENOTSUP)
+      fprintf(stderr, "Could not open input file: compression not supported by this build\n");
+    else
       perror("Could not open input file");
-      exit(2);
-    }
-  } else {
-    infile = stdin;
+    return 2;
   }
   
-  if (optind < argc - 1) {
-    outfile = fopen(argv[optind + 1], "wt");
+  if (opt->settings.estimate_acc > 0) {
+    outfile = NULL; // the estimate is printed instead
+  } else if (out_path) {
+    int type = codec_from_name(out_path);
+    if (type == CODEC_NONE) {
+      outfile = fopen(out_path, "wt");
+    } else {
+      // compress on a separate thread, fed through a pipe
+      if (!codec_supported(type)) {
+	fprintf(stderr, "No %s support compiled in\n", codec_name(type));
+	input_close(&infile);
+	return 3;
+      }
+      int fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      int pipe_fd = fd < 0 ? -1 : codec_encoder(&encoder, type, fd);
+      outfile = pipe_fd < 0 ? NULL : fdopen(pipe_fd, "w");
+    }
     if (!outfile) {
       perror("Could not open output");
-      exit(3);
+      input_close(&infile);
+      return 3;
     }
   } else {
     outfile = stdout;
   }
-  
-  char line[LINE_BUFFER_SIZE];
-  
-  uint8_t line_flags = 0;
-  uint8_t char_counter = 0;
-  int c;
-  parser_block_t blocks[6];
-
-  laser_state_t laser_state;
-  if (mode == MODE_LASER)
-    lasermode_init(&laser_state, acc, angle);
 
-  cleanup_state_t cleanup_state;
-  cleanup_init(&cleanup_state);
+  // Output is written in one piece per line, no need for stdio to hold on to it
+  if (stream && outfile)
+    setvbuf(outfile, NULL, _IONBF, 0);
 
-  drag_state_t drag_state;
-  if (mode == MODE_DRAG)
-    dragmode_init(&drag_state, offset, 0, angle);
-
-  toabs_state_t toabs_state;
-  toabs_init(&toabs_state);
+  if (output_init(&output, outfile) < 0) {
+    perror("Could not allocate output buffer");
+    ret = 3;
+    goto close;
+  }
+  output.shortest = opt->shortest;
+  
+  cache_t cache;
+  uint64_t input_hash = 0;
+  char *default_cache_path = NULL;
+  int cache_hit = 0;
 
-  fromabs_state_t fromabs_state;
-  fromabs_init(&fromabs_state);
+  if (use_cache) {
+    if (!infile.mapped) {
+      fprintf(stderr, "--cache needs a regular input file, ignored\n");
+      use_cache = 0;
+    } else {
+      if (!cache_path) {
+	const char *name = in_path;
+	default_cache_path = malloc(strlen(name) + sizeof(CACHE_SUFFIX));
+	if (!default_cache_path) {
+	  perror("Could not allocate cache path");
+	  ret = 3;
+	  goto close;
+	}
+	strcpy(default_cache_path, name);
+	strcat(default_cache_path, CACHE_SUFFIX);
+	cache_path = default_cache_path;
+      }
+      input_hash = cache_hash(infile.data, infile.len);
+      if (cache_open(&cache, cache_path, input_hash, infile.len) == 0)
+	cache_hit = 1;
+      else
+	cache_init(&cache);
+    }
+  }
 
-  to_mm_state_t to_mm_state;
-  to_mm_init(&to_mm_state);
+  filter_t filter;
+  filter_init(&filter, &opt->settings, &output, use_cache && !cache_hit ? &cache : NULL);
+  filter.error = report_error;
+  filter.error_arg = opt->name_errors ? (void *)in_path : NULL;
+  stats_t file_stats;
+  if (opt->stats) {
+    memset(&file_stats, 0, sizeof(file_stats));
+    filter.stats = &file_stats;
+  }
 
-  from_mm_state_t from_mm_state;
-  from_mm_init(&from_mm_state);
+  // --stream keeps everything on one thread for the lowest latency, and
+  // the cache replay has no reading and parsing to overlap
+  pipelined = pipelined && !stream && !cache_hit;
 
-  
-  // Process one line of incoming serial data, as the data becomes available. Performs an
-  // initial filtering by removing spaces and comments and capitalizing all letters.
-  while(!feof(infile) && (c = fgetc(infile)) != EOF) {
-    if ((c == '\n') || (c == '\r')) { // End of line reached
-
-      line[char_counter] = 0; // Set string termination character.
-
-      // Direct and execute one line of formatted input, and report status of execution.
-      if (line_flags & LINE_FLAG_OVERFLOW) {
-	// Report line overflow error.
-	report_status_message(STATUS_OVERFLOW);
-      } else if (line[0] == 0) {
-	// Empty or comment line.
-	fprintf(outfile, "\n");
-      } else if (line[0] == '$') {
-	// Grbl '$' system command
-	fprintf(outfile, "%s\n", line);
-      } else {
-	// Parse and execute g-code block.
-	report_status_message(gc_parse_line(line, &blocks[0]));
+  latency_t latency = { 0, 0, 0 };
+  stage_threads_t threads;
+  pipeline_sink_t sink = filter.estimate ? estimate_blocks : print_blocks;
+  if (back_end_init(&filter, pipelined ? stage_threads_sink : sink,
+		    pipelined ? (void *)&threads : &filter) < 0) {
+    fprintf(stderr, "Could not set up the filter stages\n");
+    ret = 3;
+    goto done;
+  }
 
-	to_mm(&to_mm_state, &blocks[0]);
-	toabs(&toabs_state, &blocks[0]);
+  if (pipelined && stage_threads_init(&threads, transform_chunk, transform_finish,
+				      sink, &filter, filter.stats) < 0) {
+    perror("Could not allocate pipeline queues");
+    ret = 3;
+    goto done;
+  }
 
-	int nblocks = 1;
+  if (cache_hit) {
+    // Replay the sidecar: parsing, to_mm and toabs are already done
+    for (size_t l = 0; l < cache.nlines; l++) {
+      const cache_line_t *rec = &cache.lines[l];
+      switch (rec->kind) {
+      case GC_LINE_OVERFLOW:
+	filter_report(&filter, l + 1, STATUS_OVERFLOW);
+	break;
+      case GC_LINE_EMPTY:
+	back_end_text(&filter, "");
+	break;
+      case GC_LINE_SYSTEM:
+	back_end_text(&filter, cache.text + rec->arg);
+	break;
+      default:
+	filter_report(&filter, l + 1, rec->status);
+	back_end(&filter, &cache.blocks[rec->arg]);
+      }
+    }
+  } else if (pipelined) {
+    // Reading on this thread, parsing, the stages and printing on three
+    // more, each working on its own chunk of the input
+    if (stage_threads_run(&threads, &infile) < 0) {
+      perror("Could not start pipeline threads");
+      ret = 3;
+    }
+    stage_threads_destroy(&threads);
+  } else if (jobs > 1 && !stream) {
+    // Parse chunks of lines on a thread pool, and run the stages over
+    // them in input order on this thread
+    parse_pool_t pool;
+    if (parse_pool_init(&pool, jobs, filter.stats) < 0) {
+      perror("Could not start parser threads");
+      ret = 3;
+      goto done;
+    }
 
-	switch (mode) {
-	case MODE_LASER:
-	  nblocks = lasermode(&laser_state, blocks);
-	  break;
-	case MODE_DRAG:
-	  nblocks = dragmode(&drag_state, blocks);
+    const char *chunk;
+    size_t chunk_len = 0;
+    int eof = 0;
+    for (;;) {
+      // Keep the pool supplied with chunks, split at line terminators
+      while (!parse_pool_full(&pool)) {
+	if (!chunk_len && (eof || !input_getlines(&infile, &chunk, &chunk_len))) {
+	  eof = 1;
 	  break;
 	}
-	
-	for (int i = 0; i < nblocks; i++) {
-	  fromabs(&fromabs_state, &blocks[i]);
-	  from_mm(&from_mm_state, &blocks[i]);
-	  cleanup(&cleanup_state, &blocks[i]);
-	  gc_print_line(&blocks[i], outfile);
-	  fprintf(outfile, "\n");
+	size_t n = chunk_len;
+	if (n > PARSE_CHUNK_SIZE)
+	  n = scan_eol(chunk + PARSE_CHUNK_SIZE, chunk + chunk_len) + 1 - chunk;
+	// read buffers are reused by the next input_getlines(), mappings stay put
+	if (parse_pool_submit(&pool, chunk, n, !infile.mapped) < 0) {
+	  perror("Could not queue input for parsing");
+	  ret = 3;
+	  break;
 	}
+	chunk += n;
+	chunk_len -= n;
+      }
+
+      parse_chunk_t *c = ret ? NULL : parse_pool_next(&pool);
+      if (!c)
+	break;
+      if (c->failed) {
+	fprintf(stderr, "Could not allocate parser output\n");
+	ret = 3;
+	break;
       }
+      process_lines(&filter, c->data, c->blocks, c->info, c->nlines);
+      parse_pool_release(&pool);
+    }
+
+    parse_pool_destroy(&pool);
+  } else {
+    filter_input(&filter, &infile, stream, &latency);
+  }
+
+  if (ret)
+    goto done;
+
+  // Blocks held back by the stages, if any. The transform thread has
+  // already done this in --pipeline mode.
+  if (!pipelined)
+    back_end_flush(&filter);
+  if (filter.arcfit && filter.arcfit_state.blocks_in) {
+    const arcfit_state_t *a = &filter.arcfit_state;
+    fprintf(stderr, "arc fit: %lu arcs, %lu blocks -> %lu, %.1f%% fewer\n",
+	    a->arcs, a->blocks_in, a->blocks_out,
+	    100 * (1 - (double)a->blocks_out / a->blocks_in));
+  }
+  if (filter.simplify && filter.simplify_state.blocks_in) {
+    const simplify_state_t *s = &filter.simplify_state;
+    fprintf(stderr, "simplify: %lu blocks -> %lu, %.1f%% fewer\n",
+	    s->blocks_in, s->blocks_out,
+	    100 * (1 - (double)s->blocks_out / s->blocks_in));
+  }
+  if (filter.reorder && filter.reorder_state.contours) {
+    const reorder_state_t *r = &filter.reorder_state;
+    fprintf(stderr, "reorder: %lu contours, travel %.1f mm -> %.1f mm, %.1f%% saved\n",
+	    r->contours, r->travel_in, r->travel_out,
+	    r->travel_in > 0 ? 100 * (1 - r->travel_out / r->travel_in) : 0.);
+  }
+  if (filter.estimate) {
+    estimate_t *in = &filter.estimate_in, *out = &filter.estimate_out;
+    estimate_finish(in);
+    estimate_finish(out);
+    print_estimate("input:", in);
+    print_estimate("output:", out);
+    printf("%s: %+.1f mm, %+.1f s, %.1f%% overhead\n",
+	   filter.mode == MODE_LASER ? "laser mode" : "drag knife mode",
+	   out->distance - in->distance, out->time - in->time,
+	   in->time > 0 ? 100 * (out->time / in->time - 1) : 0.);
+  }
+ done:
+  filter_free(&filter);
+  if (filter.stats)
+    stats_merge(&stats_total, filter.stats);
+
+  if (stream && latency.lines)
+    fprintf(stderr, "stream: %lu lines, latency mean %.1f us, max %.1f us\n",
+	    latency.lines, latency.total / latency.lines * 1e6, latency.max * 1e6);
+
+  if (!ret && filter.cache && cache_write(&cache, cache_path, input_hash, infile.len) < 0)
+    perror("Could not write cache");
+
+  if (cache_hit) {
+    filter.lines = cache.nlines;
+    filter.bytes = infile.len;
+  }
+  stats->lines = filter.lines;
+  stats->bytes = filter.bytes;
 
-      // Reset tracking data for next line.
-      line_flags = 0;
-      char_counter = 0;
+  if (use_cache)
+    cache_close(&cache);
+  free(default_cache_path);
 
+  if (filter.failed) {
+    fprintf(stderr, "Could not allocate pipeline blocks\n");
+    ret = 3;
+  }
+ close:
+  if (input_close(&infile) < 0) {
+    fprintf(stderr, "Compressed input is corrupt or truncated\n");
+    ret = 2;
+  }
+  output_close(&output);
+  if (outfile && (fclose(outfile) != 0 || (encoder && codec_finish(encoder) < 0))) {
+    perror("Could not write output");
+    ret = 3;
+  }
+  
+  return ret;
+}
+
+// Longest request header accepted by --serve
+#define REQUEST_HEADER_MAX 256
+
+// Buffers and state of a --serve worker, kept from one request to the next
+typedef struct {
+  input_t in;
+  output_t out;
+  filter_t filter;
+} connection_t;
+
+// Reads the options of a --serve request from its header line: -l, -d,
+// -a, --lookahead, --junction-deviation, --arc-fit, --simplify,
+// --reorder and --shortest, separated by spaces. Others are taken from opt.
+// return value: 0 on success, -1 if the header is malformed
+static int parse_request(options_t *opt, const char *header, size_t len) {
+  char line[REQUEST_HEADER_MAX];
+  if (len >= sizeof(line))
+    return -1;
+  memcpy(line, header, len);
+  line[len] = 0;
+
+  char *save;
+  for (char *word = strtok_r(line, " \t", &save); word; word = strtok_r(NULL, " \t", &save)) {
+    if (!strcmp(word, "--shortest")) {
+      opt->shortest = 1;
+      continue;
+    }
+    if (!strcmp(word, "--reorder")) {
+      opt->settings.reorder = 1;
+      continue;
+    }
+    char *value = strtok_r(NULL, " \t", &save);
+    if (!value)
+      return -1;
+    if (!strcmp(word, "-l")) {
+      opt->settings.mode = MODE_LASER;
+      opt->settings.acc = atof(value);
+    } else if (!strcmp(word, "-d")) {
+      opt->settings.mode = MODE_DRAG;
+      opt->settings.offset = atof(value);
+    } else if (!strcmp(word, "-a")) {
+      opt->settings.angle = atof(value);
+    } else if (!strcmp(word, "--lookahead")) {
+      opt->settings.lookahead = atoi(value);
+    } else if (!strcmp(word, "--junction-deviation")) {
+      opt->settings.junction_deviation = atof(value);
+    } else if (!strcmp(word, "--arc-fit")) {
+      opt->settings.arc_tolerance = atof(value);
+    } else if (!strcmp(word, "--simplify")) {
+      opt->settings.simplify = 1;
+      opt->settings.simplify_tolerance = atof(value);
     } else {
+      return -1;
+    }
+  }
+  return opt->settings.mode ? 0 : -1;
+}
 
-      if (line_flags) {
-	// Throw away all (except EOL) comment characters and overflow characters.
-	//	fputc(c, outfile);
-	if (c == ')') {
-	  // End of '()' comment. Resume line allowed.
-	  if (line_flags & LINE_FLAG_COMMENT_PARENTHESES) { line_flags &= ~(LINE_FLAG_COMMENT_PARENTHESES); }
-	}
+// Serves one --serve request: a header line with the options, followed
+// by G-code up to the end of the client's side of the connection. The
+// filtered G-code is sent back as it is produced.
+static void serve_request(void *arg, void **slot, int fd) {
+  connection_t *c = *slot;
+  if (!c) {
+    c = calloc(1, sizeof(*c));
+    if (!c || output_init(&c->out, NULL) < 0) {
+      perror("Could not allocate request buffers");
+      free(c);
+      return;
+    }
+    *slot = c;
+  }
+
+  int out_fd = dup(fd);
+  FILE *fp = out_fd < 0 ? NULL : fdopen(out_fd, "w");
+  if (!fp) {
+    perror("Could not open response");
+    if (out_fd >= 0)
+      close(out_fd);
+    return;
+  }
+  setvbuf(fp, NULL, _IONBF, 0); // c->out does the buffering
+  c->out.fp = fp;
+
+  options_t opt = *(const options_t *)arg;
+  const char *header;
+  size_t len;
+  if (input_open_fd(&c->in, fd) < 0) {
+    perror("Could not read request");
+  } else {
+    if (!input_getline(&c->in, &header, &len) || parse_request(&opt, header, len) < 0) {
+      output_str(&c->out, "error: bad request header\n");
+    } else {
+      c->out.shortest = opt.shortest;
+      filter_init(&c->filter, &opt.settings, &c->out, NULL);
+      c->filter.error = report_error;
+      c->filter.error_arg = "request";
+      if (back_end_init(&c->filter, print_blocks, &c->filter) < 0) {
+	fprintf(stderr, "Could not set up the filter stages\n");
       } else {
-	if (c <= ' ') {
-	  // Throw away whitepace and control characters
-	} else if (c == '/') {
-	  // Block delete NOT SUPPORTED. Ignore character.
-	  // NOTE: If supported, would simply need to check the system if block delete is enabled.
-	} else if (c == '(') {
-	  // Enable comments flag and ignore all characters until ')' or EOL.
-	  // NOTE: This doesn't follow the NIST definition exactly, but is good enough for now.
-	  // In the future, we could simply remove the items within the comments, but retain the
-	  // comment control characters, so that the g-code parser can error-check it.
-	  line_flags |= LINE_FLAG_COMMENT_PARENTHESES;
-	  //	  fputc(c, outfile);
-	} else if (c == ';') {
-	  // NOTE: ';' comment to EOL is a LinuxCNC definition. Not NIST.
-	  line_flags |= LINE_FLAG_COMMENT_SEMICOLON;
-	  // TODO: Install '%' feature
-	  // } else if (c == '%') {
-	  // Program start-end percent sign NOT SUPPORTED.
-	  // NOTE: This maybe installed to tell Grbl when a program is running vs manual input,
-	  // where, during a program, the system auto-cycle start will continue to execute
-	  // everything until the next '%' sign. This will help fix resuming issues with certain
-	  // functions that empty the planner buffer to execute its task on-time.
-	  //	  fputc(c, outfile);
-	} else if (char_counter >= (LINE_BUFFER_SIZE-1)) {
-	  // Detect line buffer overflow and set flag.
-	  line_flags |= LINE_FLAG_OVERFLOW;
-	} else if (c >= 'a' && c <= 'z') { // Upcase lowercase
-	  line[char_counter++] = c-'a'+'A';
-	} else {
-	  line[char_counter++] = c;
-	}
+	filter_input(&c->filter, &c->in, 0, NULL);
+	back_end_flush(&c->filter);
+	if (c->filter.failed)
+	  fprintf(stderr, "Could not allocate pipeline blocks\n");
       }
+      filter_free(&c->filter);
+    }
+    input_finish(&c->in);
+  }
+
+  output_flush(&c->out);
+  fclose(fp);
+}
+
+static int batch_job(void *arg, const char *in_path, const char *out_path,
+		     batch_stats_t *stats) {
+  return run_file(arg, in_path, out_path, stats);
+}
+
+int main(int argc, char **argv) {
+  options_t opt;
+  const char *batch_dir = NULL;
+  const char *socket_path = NULL;
+  int estimate = 0;
+  float estimate_acc = 0;
+  int print_stats = 0; // 1 for a table, 2 for JSON
+
+  memset(&opt, 0, sizeof(opt));
+  opt.settings.angle = 2;
+  opt.settings.junction_deviation = 0.01;
+
+  static const struct option long_options[] = {
+    { "shortest", no_argument, NULL, 'S' },
+    { "cache", optional_argument, NULL, 'C' },
+    { "jobs", required_argument, NULL, 'j' },
+    { "stream", no_argument, NULL, 's' },
+    { "pipeline", no_argument, NULL, 'P' },
+    { "batch", required_argument, NULL, 'B' },
+    { "serve", required_argument, NULL, 'L' },
+    { "lookahead", required_argument, NULL, 'k' },
+    { "junction-deviation", required_argument, NULL, 'J' },
+    { "reorder", no_argument, NULL, 'O' },
+    { "arc-fit", required_argument, NULL, 'A' },
+    { "simplify", required_argument, NULL, 'Y' },
+    { "estimate", optional_argument, NULL, 'E' },
+    { "stats", optional_argument, NULL, 'T' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  int c;
+  while ((c = getopt_long(argc, argv, "l:d:a:j:", long_options, NULL)) != -1) {
+    switch (c) {
+    case 'l':
+      opt.settings.mode = MODE_LASER;
+      opt.settings.acc = atof(optarg);
+      break;
+    case 'd':
+      opt.settings.mode = MODE_DRAG;
+      opt.settings.offset = atof(optarg);
+      break;
+    case 'a':
+      opt.settings.angle = atof(optarg);
+      break;
+    case 'S':
+      opt.shortest = 1;
+      break;
+    case 'C':
+      opt.use_cache = 1;
+      opt.cache_path = optarg;
+      break;
+    case 's':
+      opt.stream = 1;
+      break;
+    case 'P':
+      opt.pipelined = 1;
+      break;
+    case 'B':
+      batch_dir = optarg;
+      break;
+    case 'L':
+      socket_path = optarg;
+      break;
+    case 'k':
+      opt.settings.lookahead = atoi(optarg);
+      break;
+    case 'J':
+      opt.settings.junction_deviation = atof(optarg);
+      break;
+    case 'O':
+      opt.settings.reorder = 1;
+      break;
+    case 'A':
+      opt.settings.arc_tolerance = atof(optarg);
+      break;
+    case 'E':
+      estimate = 1;
+      estimate_acc = optarg ? atof(optarg) : 0;
+      break;
+    case 'T':
+      if (!optarg || !strcmp(optarg, "table"))
+	print_stats = 1;
+      else if (!strcmp(optarg, "json"))
+	print_stats = 2;
+      else
+	usage();
+      break;
+    case 'Y':
+      opt.settings.simplify = 1;
+      opt.settings.simplify_tolerance = atof(optarg);
+      break;
+    case 'j':
+      opt.jobs = atoi(optarg);
+      if (opt.jobs <= 0)
+	opt.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if (estimate) {
+    if (batch_dir || socket_path) {
+      fprintf(stderr, "--estimate doesn't go with --batch or --serve\n");
+      exit(1);
+    }
+    if (optind < argc - 1) {
+      fprintf(stderr, "--estimate writes no G-code, leave out outfile\n");
+      exit(1);
+    }
+    // The acceleration of laser mode unless given
+    opt.settings.estimate_acc = estimate_acc ? estimate_acc :
+      opt.settings.mode == MODE_LASER ? opt.settings.acc : 0;
+    if (opt.settings.estimate_acc <= 0) {
+      fprintf(stderr, "--estimate needs an acceleration, as --estimate=<acc>\n");
+      exit(1);
+    }
+  }
 
+  if (print_stats) {
+#ifndef GFILTER_STATS
+    fprintf(stderr, "No --stats support compiled in\n");
+    exit(1);
+#endif
+    if (socket_path) {
+      fprintf(stderr, "--stats doesn't go with --serve\n");
+      exit(1);
     }
+    opt.stats = 1;
   }
 
-  fclose(infile);
-  fclose(outfile);
-  
-  return 0;
+  if (socket_path) {
+    // Requests are filtered a whole one per worker thread, and the mode
+    // given here is only the default for requests without one
+    int workers = opt.jobs ? opt.jobs : sysconf(_SC_NPROCESSORS_ONLN);
+    opt.jobs = 1;
+    opt.use_cache = 0;
+    serve(socket_path, workers, serve_request, &opt);
+    perror("Could not serve on socket");
+    exit(3);
+  }
+
+  if (opt.settings.mode == 0)
+    usage();
+
+  if (!batch_dir) {
+    batch_stats_t stats;
+    if (!opt.jobs)
+      opt.jobs = 1;
+    int ret = run_file(&opt, optind < argc ? argv[optind] : NULL,
+		       optind < argc - 1 ? argv[optind + 1] : NULL, &stats);
+    if (print_stats)
+      stats_print(stderr, &stats_total, print_stats == 2);
+    return ret;
+  }
+
+  // Batch mode: -j picks the number of files filtered at once, and each
+  // is read, parsed and written on its worker's thread
+  int workers = opt.jobs ? opt.jobs : sysconf(_SC_NPROCESSORS_ONLN);
+  opt.jobs = 1;
+  opt.stream = 0;
+  opt.pipelined = 0;
+  opt.name_errors = 1;
+  if (opt.cache_path) {
+    fprintf(stderr, "--cache=file doesn't go with --batch, using the default names\n");
+    opt.cache_path = NULL;
+  }
+
+  batch_list_t list;
+  batch_list_init(&list);
+  for (int i = optind; i < argc; i++) {
+    if (batch_list_add(&list, argv[i]) < 0) {
+      perror(argv[i]);
+      exit(2);
+    }
+  }
+  if (optind == argc && batch_list_read(&list, stdin) < 0) {
+    perror("Could not read input names");
+    exit(2);
+  }
+
+  struct stat st;
+  if (stat(batch_dir, &st) < 0 || !S_ISDIR(st.st_mode)) {
+    fprintf(stderr, "%s is not a directory\n", batch_dir);
+    exit(3);
+  }
+
+  int ret = batch_run(&list, batch_dir, workers, batch_job, &opt);
+  batch_list_free(&list);
+  if (print_stats)
+    stats_print(stderr, &stats_total, print_stats == 2);
+  return ret;
 }
@@ -0,0 +1,246 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "input.h"
+#include "scan.h"
+
+static size_t input_fill(input_t *in);
+
+// Switches to reading the output of a codec thread that decompresses
+// prefix[0..len) and then the rest of fd
+static int input_decompress(input_t *in, int type, const char *prefix, size_t len, int fd) {
+  if (!in->buf) {
+    in->size = INPUT_BLOCK_SIZE;
+    in->buf = malloc(in->size);
+    if (!in->buf) {
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+
+  int pipe_fd = codec_decoder(&in->codec, type, prefix, len, fd);
+  if (pipe_fd < 0)
+    return -1;
+  in->raw_fd = in->fd;
+  in->fd = pipe_fd;
+  in->data = in->buf;
+  in->len = 0;
+  in->pos = 0;
+  in->mapped = 0;
+  in->eof = 0;
+  return 0;
+}
+
+// Starts block reads of in->fd into in->buf, allocating it if there is
+// none yet
+static int input_start_reads(input_t *in) {
+  if (!in->buf) {
+    in->size = INPUT_BLOCK_SIZE;
+    in->buf = malloc(in->size);
+    if (!in->buf) {
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+  in->data = in->buf;
+
+  // look at the first bytes to see if the input is compressed
+  while (in->len < 4 && input_fill(in))
+    ;
+  int type = codec_detect(in->data, in->len);
+  if (type != CODEC_NONE) {
+    // the bytes read so far go to the codec ahead of the rest of fd
+    in->raw_buf = in->buf;
+    in->buf = NULL;
+    if (input_decompress(in, type, in->raw_buf, in->len, in->fd) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+int input_open(input_t *in, const char *path) {
+  memset(in, 0, sizeof(*in));
+  in->raw_fd = -1;
+
+  if (path) {
+    in->fd = open(path, O_RDONLY);
+    if (in->fd < 0)
+      return -1;
+  } else {
+    in->fd = STDIN_FILENO;
+  }
+
+  struct stat st;
+  if (fstat(in->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+    if (p != MAP_FAILED) {
+      madvise(p, st.st_size, MADV_SEQUENTIAL);
+      int type = codec_detect(p, st.st_size);
+      if (type != CODEC_NONE) {
+	in->raw_map = p;
+	in->raw_len = st.st_size;
+	if (input_decompress(in, type, p, st.st_size, -1) < 0)
+	  goto fail;
+	return 0;
+      }
+      in->data = p;
+      in->len = st.st_size;
+      in->mapped = 1;
+      in->eof = 1;
+      return 0;
+    }
+  }
+
+  // not mappable: fall back to block reads
+  if (input_start_reads(in) < 0)
+    goto fail;
+  return 0;
+
+ fail: {
+    int e = errno;
+    if (in->raw_map)
+      munmap(in->raw_map, in->raw_len);
+    free(in->raw_buf);
+    free(in->buf);
+    if (path)
+      close(in->fd);
+    errno = e;
+    return -1;
+  }
+}
+
+// Moves the unconsumed tail to the start of the buffer and reads more
+// data after it. Only one read() is issued, so whatever is available
+// on a pipe is handed on without waiting for the buffer to fill up.
+// return value: number of bytes read, 0 at end of input
+
+static size_t input_fill(input_t *in) {
+  if (in->eof)
+    return 0;
+
+  size_t tail = in->len - in->pos;
+  memmove(in->buf, in->buf + in->pos, tail);
+  in->pos = 0;
+  in->len = tail;
+
+  if (in->len == in->size) { // a single line fills the whole buffer
+    char *buf = realloc(in->buf, in->size * 2);
+    if (!buf) {
+      in->eof = 1;
+      return 0;
+    }
+    in->buf = buf;
+    in->data = buf;
+    in->size *= 2;
+  }
+
+  ssize_t n;
+  do {
+    n = read(in->fd, in->buf + in->len, in->size - in->len);
+  } while (n < 0 && errno == EINTR);
+
+  if (n <= 0) {
+    in->eof = 1;
+    return 0;
+  }
+  in->len += n;
+  return n;
+}
+
+int input_getline(input_t *in, const char **line, size_t *len) {
+  size_t scanned = 0; // bytes after pos known to contain no terminator
+
+  for (;;) {
+    const char *start = in->data + in->pos;
+    const char *end = in->data + in->len;
+    const char *p = start + scanned;
+
+    const char *eol = scan_eol(p, end);
+
+    if (eol < end) {
+      *line = start;
+      *len = eol - start;
+      in->pos = eol + 1 - in->data;
+      return 1;
+    }
+
+    scanned = end - start;
+    if (!input_fill(in))
+      return 0;
+  }
+}
+
+int input_getlines(input_t *in, const char **buf, size_t *len) {
+  for (;;) {
+    const char *start = in->data + in->pos;
+    const char *p = in->data + in->len;
+
+    while (p > start && p[-1] != '\n' && p[-1] != '\r')
+      p--;
+
+    if (p > start) {
+      *buf = start;
+      *len = p - start;
+      in->pos = p - in->data;
+      return 1;
+    }
+
+    if (!input_fill(in))
+      return 0;
+  }
+}
+
+int input_open_fd(input_t *in, int fd) {
+  char *buf = in->buf;
+  size_t size = in->size;
+
+  memset(in, 0, sizeof(*in));
+  in->fd = fd;
+  in->raw_fd = -1;
+  in->borrowed = 1;
+  in->buf = buf;
+  in->size = size;
+  return input_start_reads(in);
+}
+
+// Closes in, and frees the read buffer unless keep_buf is set
+static int input_end(input_t *in, int keep_buf) {
+  int ret = 0;
+  char *buf = keep_buf ? in->buf : NULL;
+  size_t size = keep_buf ? in->size : 0;
+
+  if (in->mapped)
+    munmap((void *) in->data, in->len);
+  if (!keep_buf)
+    free(in->buf);
+
+  if (in->codec) {
+    close(in->fd);
+    ret = codec_finish(in->codec);
+    if (in->raw_map)
+      munmap(in->raw_map, in->raw_len);
+    free(in->raw_buf);
+    in->fd = in->raw_fd;
+  }
+
+  if (in->fd != STDIN_FILENO && !in->borrowed)
+    close(in->fd);
+  memset(in, 0, sizeof(*in));
+  in->fd = -1;
+  in->raw_fd = -1;
+  in->buf = buf;
+  in->size = size;
+  return ret;
+}
+
+int input_close(input_t *in) {
+  return input_end(in, 0);
+}
+
+int input_finish(input_t *in) {
+  return input_end(in, 1);
+}
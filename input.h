@@ -0,0 +1,66 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stddef.h>
+#include "codec.h"
+
+// Initial size of the read buffer used when the input can't be memory
+// mapped (pipes, terminals). Grows if a single line doesn't fit.
+#define INPUT_BLOCK_SIZE (1 << 20)
+
+typedef struct {
+  int fd;
+  const char *data; // mapped file or read buffer
+  size_t len;       // number of valid bytes in data
+  size_t pos;       // offset of the first unconsumed byte in data
+  char *buf;        // read buffer, NULL when the file is mapped
+  size_t size;      // allocated size of buf
+  int mapped;
+  int eof;
+  int borrowed;     // fd belongs to the caller, and isn't closed
+
+  // Compressed input is decompressed by a codec thread and read from
+  // its pipe through fd
+  codec_t *codec;
+  int raw_fd;       // compressed file, -1 if not compressed
+  void *raw_map;    // compressed file mapping
+  size_t raw_len;
+  char *raw_buf;    // compressed bytes read before the codec was started
+} input_t;
+
+// path: file to read, or NULL for stdin
+// regular files are memory mapped, anything else is read in large blocks
+// gzip and zstd compressed input is recognized and decompressed on a
+// separate thread; such input is never mapped
+// return value: 0 on success, -1 with errno set on failure
+int input_open(input_t *in, const char *path);
+
+// Starts reading fd, which stays open after input_close() or
+// input_finish(). Reuses the read buffer kept by an earlier
+// input_finish() on in; in must have been zeroed or finished before.
+// return value: 0 on success, -1 with errno set on failure
+int input_open_fd(input_t *in, int fd);
+
+// Returns the next line as a span into the mapping or the read buffer,
+// without the line terminator. Both '\n' and '\r' end a line. The span
+// stays valid until the next call. Trailing data without a terminator
+// is not returned.
+// return value: 1 if a line was returned, 0 at end of input
+int input_getline(input_t *in, const char **line, size_t *len);
+
+// Returns all complete lines available, terminators included, as one
+// span. For a mapped file this is the whole rest of the file, otherwise
+// whatever the last read brought in. The span stays valid until the
+// next call. May follow input_getline(), but not the other way round.
+// return value: 1 if lines were returned, 0 at end of input
+int input_getlines(input_t *in, const char **buf, size_t *len);
+
+// return value: 0 on success, -1 if compressed input turned out to be
+// corrupt or truncated
+int input_close(input_t *in);
+
+// As input_close(), but keeps the read buffer in in for the next
+// input_open_fd(). Free it with input_close() at the end.
+int input_finish(input_t *in);
+
+#endif
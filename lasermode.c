@@ -2,62 +2,124 @@
 #include "geom.h"
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <stdbool.h>
 
-// *block has room for up to three more blocks after it, which may be
-// populated by this function. They should be executed in reverse order.
-// return value: number of blocks to process in *block
-
 void lasermode_init(laser_state_t *state, double a, double max_angle_deg) {
   memset(&state->modal, 0, sizeof(state->modal));
   memset(&state->values, 0, sizeof(state->values));
+  memset(state->v, 0, sizeof(state->v));
   state->a = a;
   state->M = acos(max_angle_deg / 180. * 3.14);
   state->M = state->M * state->M;
+  state->cos_max = cos(max_angle_deg / 180. * M_PI);
+  state->held = 0;
+  state->lookahead = 0;
+  state->moves = NULL;
+  state->size = state->head = state->tail = state->nmoves = 0;
+  state->extensions = 0;
 }
 
+void lasermode_plan(laser_state_t *state, int lookahead, double junction_deviation) {
+  state->lookahead = lookahead;
+  state->junction_deviation = junction_deviation;
+  memset(&state->last, 0, sizeof(state->last));
+  state->last.motion = MOTION_MODE_SEEK;
+  state->end2 = 0; // the machine starts at rest
+}
 
-int lasermode(laser_state_t *state,
-	       parser_block_t *block) {
+void lasermode_free(laser_state_t *state) {
+  free(state->moves);
+  state->moves = NULL;
+  state->size = state->head = state->tail = state->nmoves = 0;
+}
 
-  laser_state_t oldstate = *state;
+
+// Pushes a G1 move to xy with the laser off, carrying over the feed
+// word of block
+static int push_move(block_ring_t *out, const parser_block_t *block, const float xy[2], float f) {
+  parser_block_t *move = block_ring_push(out);
+  if (!move)
+    return -1;
+  *move = *block;
+  move->value_words = bit(WORD_X) | bit(WORD_Y) | bit(WORD_S) | (block->value_words & bit(WORD_F));
+  move->values.s = 0;
+  move->values.f = f;
+  move->modal.motion = MOTION_MODE_LINEAR;
+  move->command_words = bit(MODAL_GROUP_G1);
+  for (int i = 0; i < 2; i++)
+    move->values.xyz[i] = xy[i];
+  return 0;
+}
+
+// Follows block and works out its geometry. The block is modified the
+// way update_state() and normarcs() do, and state->values afterwards
+// hold the position and settings after it.
+static void analyse(laser_state_t *state, parser_block_t *block, laser_move_t *m) {
+  m->x0[0] = state->values.xyz[0];
+  m->x0[1] = state->values.xyz[1];
 
   update_state(&state->modal, &state->values, block);
 
-  float dx = state->values.xyz[0]-oldstate.values.xyz[0];
-  float dy = state->values.xyz[1]-oldstate.values.xyz[1];
+  float dx = state->values.xyz[0]-m->x0[0];
+  float dy = state->values.xyz[1]-m->x0[1];
 
-  float v0[2];
-  
   normarcs(block, state->modal.motion, 
 	   dx, // Delta x between current position and target
 	   dy); // Delta y between current position and target
 
-  calcv(block, state->modal.motion, dx, dy, v0, state->v);
-    
+  calcv(block, state->modal.motion, dx, dy, m->v0, state->v);
 
-    float dv2 = 0;
-    for (int i = 0; i < 2; i++)
-      dv2 += v0[i] * oldstate.v[i];
+  m->v1[0] = state->v[0];
+  m->v1[1] = state->v[1];
+  m->f = state->values.f;
+  m->s = state->values.s;
+  m->spindle = state->modal.spindle;
+  m->motion = state->modal.motion;
 
-    bool extprev = false;
-    bool extnext = false;
+  if (!state->lookahead)
+    return;
 
+  // Path length, along the arc for G2/G3
+  if (block->values.r != 0 && (m->motion == MOTION_MODE_CW_ARC || m->motion == MOTION_MODE_CCW_ARC)) {
+    float sx = -block->values.ijk[0], sy = -block->values.ijk[1]; // center to start
+    float ex = dx + sx, ey = dy + sy;                             // center to end
+    float sweep = atan2f(sx * ey - sy * ex, sx * ex + sy * ey);
+    if (m->motion == MOTION_MODE_CW_ARC)
+      sweep = -sweep;
+    if (sweep <= 0)
+      sweep += 2 * M_PI;
+    m->len = block->values.r * sweep;
+  } else {
+    m->len = sqrtf(dx * dx + dy * dy);
+  }
 
-    if (dv2 < state->M || state->values.f != oldstate.values.f ||
-	((state->values.s == 0) != (oldstate.values.s == 0)) ||
-	state->modal.spindle != oldstate.modal.spindle) {
-      extprev = oldstate.values.s != 0 &&
-	oldstate.modal.spindle != SPINDLE_DISABLE &&
-	oldstate.modal.motion != MOTION_MODE_SEEK;
-      extnext = state->values.s != 0 &&
-	state->modal.spindle != SPINDLE_DISABLE &&
-	state->modal.motion != MOTION_MODE_SEEK;
-    }
+  // Rapids go at the machine's top speed, which we don't know
+  float nominal = m->f / 60.f;
+  m->nominal2 = m->motion == MOTION_MODE_SEEK ? INFINITY : nominal * nominal;
+}
+
+// Pushes block, preceded by extensions of the cut before it (x0 is where
+// that cut ended) and of the cut it starts, where the corner between
+// them slows down the cut before (extprev) or after (extnext).
+// return value: Number of blocks pushed, -1 if out couldn't grow
+static int emit(laser_state_t *state, const laser_move_t *prev, const laser_move_t *m,
+		parser_block_t *block, bool extprev, bool extnext, block_ring_t *out) {
+    const float *x0 = m->x0;
+    const float *vprev = prev->v1;
+    const float *v0 = m->v0;
+    float f0 = prev->f;
+
+    extprev = extprev && prev->s != 0 &&
+      prev->spindle != SPINDLE_DISABLE &&
+      prev->motion != MOTION_MODE_SEEK;
+    extnext = extnext && m->s != 0 &&
+      m->spindle != SPINDLE_DISABLE &&
+      m->motion != MOTION_MODE_SEEK;
 
-    //    printf("extprev = %d extnext = %d @ %g %g\n", extprev, extnext, oldstate.values.xyz[0], oldstate.values.xyz[1]);
+    //    printf("extprev = %d extnext = %d @ %g %g\n", extprev, extnext, x0[0], x0[1]);
 
     int retval = 1;
     if (extprev)
@@ -67,88 +129,289 @@ int lasermode(laser_state_t *state,
     if (extprev && extnext)
       retval --;
     
-    if (retval > 1) {
-      memcpy(block + retval - 1, block, sizeof(block[0]));
-      block[retval-1].value_words |= bit(WORD_S);
-      block[retval-1].values.s = state->values.s;
-      block[retval-1].command_words |= bit(MODAL_GROUP_G1);
-      block[retval-1].modal.motion = state->modal.motion;
-    }
-
     float x1[2]; // extension of end of previous leg
     float x2[2]; // extension of start of next leg
-    float x2b[2]; // extension of start of next leg, close to x2
     
     if (extprev) {
       // extend previous leg
       // v^2 = 2 as
       float d;
-      d = oldstate.values.f / 60.f; // mm / s
+      d = f0 / 60.f; // mm / s
       d = d * d;
-      d = d / 2. / oldstate.a;
+      d = d / 2. / state->a;
       
       for (int i = 0; i < 2; i++)
-	x1[i] = oldstate.values.xyz[i] + d * oldstate.v[i];
+	x1[i] = x0[i] + d * vprev[i];
     }
 
     if (extnext) {
       float d;
-      d = state->values.f / 60.f; // mm / s
+      d = m->f / 60.f; // mm / s
       d = d * d;
       d = d / 2 / state->a;
       
       for (int i = 0; i < 2; i++)
-	x2[i] = oldstate.values.xyz[i] - d * v0[i];
+	x2[i] = x0[i] - d * v0[i];
     }
 
-    float *curpos = oldstate.values.xyz;
-    parser_block_t *curblock = &block[0];
-    
-    if (extprev) { // move to the extension of the previous segment
-      //      curblock->command_words = 0;
-      curblock->value_words = bit(WORD_X) | bit(WORD_Y) | bit(WORD_S) | (curblock->value_words & bit(WORD_F));
-      curblock->values.s = 0;
-      curblock->modal.motion = MOTION_MODE_LINEAR;
-      curblock->command_words = bit(MODAL_GROUP_G1);
-      for (int i = 0; i < 2; i++)
-	curblock->values.xyz[i] = x1[i];
-	
-      curpos = x1;
-      curblock++;
-    }
-
-    if (extnext) { // move to the extension of the next segment
-      //      curblock->command_words = 0;
-      memcpy(curblock, block, sizeof(block[0]));
+    if (extprev) // move to the extension of the previous segment
+      if (push_move(out, block, x1, block->values.f) < 0)
+	return -1;
 
-      curblock->value_words = bit(WORD_X) | bit(WORD_Y) | bit(WORD_S) | (curblock->value_words & bit(WORD_F));
-      curblock->values.s = 0;
-      curblock->values.f = state->values.f;
-      curblock->modal.motion = MOTION_MODE_LINEAR;
-      curblock->command_words = bit(MODAL_GROUP_G1);
-      for (int i = 0; i < 2; i++)
-	curblock->values.xyz[i] = x2[i];
-	
-      curpos = x2;
-      curblock++;
-    }
+    if (extnext) // move to the extension of the next segment
+      if (push_move(out, block, x2, m->f) < 0)
+	return -1;
     
     if (extnext || extprev) { // move to the beginning of the next segment
-      //      curblock->command_words = 0;
-      memcpy(curblock, block + retval - 1, sizeof(block[0]));
-      curblock->value_words = bit(WORD_X) | bit(WORD_Y) | bit(WORD_S) | (curblock->value_words & bit(WORD_F));
-      curblock->values.s = 0;
-      curblock->values.f = state->values.f;
-      curblock->modal.motion = MOTION_MODE_LINEAR;
-      curblock->command_words = bit(MODAL_GROUP_G1);
-      for (int i = 0; i < 2; i++)
-	curblock->values.xyz[i] = oldstate.values.xyz[i];
-	
-      curpos = oldstate.values.xyz;
-      curblock++;
+      if (push_move(out, block, x0, m->f) < 0)
+	return -1;
+
+      // and do the move itself with the laser on
+      block->value_words |= bit(WORD_S);
+      block->values.s = m->s;
+      block->command_words |= bit(MODAL_GROUP_G1);
+      block->modal.motion = m->motion;
     }
 
+    if (block_ring_push_copy(out, block) < 0)
+      return -1;
+
+    state->extensions += retval - 1;
     return retval;
 }
 
+// Square of the highest speed grbl takes a corner with, from the
+// directions before and after it (mm/s)
+static float junction_speed2(const laser_state_t *state, const float vprev[2], const float v0[2]) {
+  if (v0[0] == 0 && v0[1] == 0)
+    return INFINITY; // no move, no corner
+  if (vprev[0] == 0 && vprev[1] == 0)
+    return 0; // first move, from rest
+
+  // grbl's junction deviation: the corner is taken as an arc, a distance
+  // junction_deviation from the corner, at the speed the acceleration
+  // allows along it
+  float cos_theta = -(vprev[0] * v0[0] + vprev[1] * v0[1]);
+  if (cos_theta > 0.999999f)
+    return 0; // reversal
+  if (cos_theta < -0.999999f)
+    return INFINITY; // straight on
+  float sin_theta_d2 = sqrtf(0.5f * (1.f - cos_theta));
+  return state->a * state->junction_deviation * sin_theta_d2 / (1.f - sin_theta_d2);
+}
+
+static laser_move_t *move_at(laser_state_t *state, size_t i) {
+  return &state->moves[i & (state->size - 1)];
+}
+
+// return value: slot for a new move at the end of the ring, or NULL if
+// the ring couldn't grow
+static laser_move_t *add_move(laser_state_t *state) {
+  if (state->tail - state->head == state->size) {
+    size_t n = state->tail - state->head;
+    size_t size = state->size ? 2 * state->size : 16;
+    laser_move_t *moves = malloc(size * sizeof(laser_move_t));
+    if (!moves)
+      return NULL;
+    for (size_t i = 0; i < n; i++)
+      moves[i] = *move_at(state, state->head + i);
+    free(state->moves);
+    state->moves = moves;
+    state->size = size;
+    state->head = 0;
+    state->tail = n;
+  }
+  return move_at(state, state->tail++);
+}
+
+// Plans the corner at the start of the oldest move, and pushes it
+// return value: Number of blocks pushed, -1 if out couldn't grow
+static int plan_oldest(laser_state_t *state, block_ring_t *out) {
+  float a2 = 2 * state->a;
+
+  // Backward pass: the machine must be able to stop at the end of the
+  // last move in the window, and to take each corner before it
+  float v2 = 0; // square of the highest speed at the end of move i
+  for (size_t i = state->tail; i-- > state->head + 1; ) {
+    const laser_move_t *m = move_at(state, i);
+    if (m->text)
+      continue;
+    v2 = fminf(fminf(m->junction2, m->nominal2), v2 + a2 * m->len);
+  }
+  laser_move_t *m = move_at(state, state->head);
+  float back2 = fminf(fminf(m->junction2, m->nominal2), v2 + a2 * m->len);
+
+  // Forward pass: how fast the machine can be at the end of the last
+  // move pushed, after accelerating along it
+  float junction2 = fminf(back2, state->end2);
+
+  // The cut before the corner is extended if it doesn't reach the corner
+  // at its feed rate, and the one after if it doesn't leave it at its
+  // own. 1% slack for rounding.
+  float f0 = state->last.f / 60.f * 0.99f;
+  float f1 = m->f / 60.f * 0.99f;
+  bool extprev = junction2 < f0 * f0;
+  bool extnext = junction2 < f1 * f1;
+
+  int ret = emit(state, &state->last, m, &m->block, extprev, extnext, out);
+
+  // An extended cut starts at its feed rate, after the lead-in
+  float start2 = extnext && m->s != 0 && m->motion != MOTION_MODE_SEEK ? m->nominal2 : junction2;
+  state->end2 = fminf(m->nominal2, start2 + a2 * m->len);
+  state->last = *m;
+  state->head++;
+  state->nmoves--;
+  return ret;
+}
+
+// Pushes moves until no more than keep are left, and the text blocks
+// before them
+static int drain(laser_state_t *state, block_ring_t *out, size_t keep) {
+  int pushed = 0;
+  for (;;) {
+    while (state->head != state->tail && move_at(state, state->head)->text) {
+      if (block_ring_push_copy(out, &move_at(state, state->head)->block) < 0)
+	return -1;
+      state->head++;
+      pushed++;
+    }
+    if (state->nmoves <= keep)
+      return pushed;
+    int n = plan_oldest(state, out);
+    if (n < 0)
+      return -1;
+    pushed += n;
+  }
+}
+
+static bool laser_on(const laser_move_t *m) {
+  return m->s != 0 && m->spindle != SPINDLE_DISABLE && m->motion != MOTION_MODE_SEEK;
+}
+
+// Whether m is a laser-off move the cut prev may carry on through: it
+// goes on along the same line, and takes no longer at prev's feed rate
+// than the two stops and reversals of a lead-out and lead-in, at least
+// 2 (1 + sqrt(2)) v / a
+static bool gap_after(const laser_state_t *state, const laser_move_t *prev,
+		      const laser_move_t *m) {
+  if (!laser_on(prev) || laser_on(m) || m->spindle != prev->spindle ||
+      (m->motion != MOTION_MODE_SEEK && m->motion != MOTION_MODE_LINEAR))
+    return false;
+  if (m->v0[0] * prev->v1[0] + m->v0[1] * prev->v1[1] < state->cos_max)
+    return false;
+  float f = prev->f / 60.f;
+  return m->len > 0 && m->len <= 4 * f * f / state->a;
+}
+
+// Pushes the move held back the way it would have been without holding
+// return value: Number of blocks pushed, -1 if out couldn't grow
+static int release_gap(laser_state_t *state, block_ring_t *out) {
+  if (!state->held)
+    return 0;
+  state->held = 0;
+  return emit(state, &state->gap_prev, &state->gap, &state->gap.block,
+	      state->gap_ext, state->gap_ext, out);
+}
+
+// Pushes the move held back and m, the cut after it, as one pass at the
+// feed rate with the laser toggled, with no extensions between them
+// return value: Number of blocks pushed, -1 if out couldn't grow
+static int coalesce(laser_state_t *state, const laser_move_t *m,
+		    parser_block_t *block, block_ring_t *out) {
+  parser_block_t *gap = &state->gap.block;
+  state->held = 0;
+  gap->command_words |= bit(MODAL_GROUP_G1);
+  gap->modal.motion = MOTION_MODE_LINEAR;
+  gap->value_words |= bit(WORD_S);
+  gap->values.s = 0;
+  if (state->gap.f != m->f) {
+    gap->value_words |= bit(WORD_F);
+    gap->values.f = m->f;
+  }
+  if (block_ring_push_copy(out, gap) < 0)
+    return -1;
 
+  block->command_words |= bit(MODAL_GROUP_G1);
+  block->modal.motion = m->motion;
+  block->value_words |= bit(WORD_S);
+  block->values.s = m->s;
+  if (block_ring_push_copy(out, block) < 0)
+    return -1;
+  return 2;
+}
+
+int lasermode(laser_state_t *state,
+	       parser_block_t *block, block_ring_t *out) {
+
+  if (state->lookahead) {
+    laser_move_t *m = add_move(state);
+    if (!m)
+      return -1;
+    m->block = *block;
+    m->text = block_is_text(block);
+    if (!m->text) {
+      float vprev[2] = { state->v[0], state->v[1] };
+      analyse(state, &m->block, m);
+      m->junction2 = junction_speed2(state, vprev, m->v0);
+      state->nmoves++;
+    }
+    return drain(state, out, state->lookahead);
+  }
+
+  // Only what the corner test and the extensions need from before block
+  laser_move_t prev;
+  prev.v1[0] = state->v[0];
+  prev.v1[1] = state->v[1];
+  prev.f = state->values.f;
+  prev.s = state->values.s;
+  prev.spindle = state->modal.spindle;
+  prev.motion = state->modal.motion;
+
+  if (block_is_text(block)) {
+    int n = release_gap(state, out);
+    if (n < 0 || block_ring_push_copy(out, block) < 0)
+      return -1;
+    return n + 1;
+  }
+
+  laser_move_t m;
+  analyse(state, block, &m);
+  m.len = hypot_f(state->values.xyz[0] - m.x0[0], state->values.xyz[1] - m.x0[1]);
+
+  if (state->held) {
+    const laser_move_t *gap = &state->gap;
+    if (laser_on(&m) && m.spindle == state->gap_prev.spindle &&
+	m.f == state->gap_prev.f &&
+	m.v0[0] * gap->v1[0] + m.v0[1] * gap->v1[1] >= state->cos_max)
+      return coalesce(state, &m, block, out);
+  }
+  int pushed = release_gap(state, out);
+  if (pushed < 0)
+    return -1;
+
+  float dv2 = 0;
+  for (int i = 0; i < 2; i++)
+    dv2 += m.v0[i] * prev.v1[i];
+
+  bool ext = dv2 < state->M || m.f != prev.f ||
+    ((m.s == 0) != (prev.s == 0)) ||
+    m.spindle != prev.spindle;
+
+  if (gap_after(state, &prev, &m)) {
+    state->held = 1;
+    state->gap = m;
+    state->gap.block = *block;
+    state->gap_prev = prev;
+    state->gap_ext = ext;
+    return pushed;
+  }
+
+  int n = emit(state, &prev, &m, block, ext, ext, out);
+  return n < 0 ? -1 : pushed + n;
+}
+
+int lasermode_flush(laser_state_t *state, block_ring_t *out) {
+  if (!state->lookahead)
+    return release_gap(state, out);
+  return drain(state, out, 0);
+}
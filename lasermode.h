@@ -2,6 +2,24 @@
 #define LASERMODE_H
 
 #include "gcode.h"
+#include "pipeline.h"
+
+// A block waiting in the lookahead window, with what the planner needs
+// to know about it
+typedef struct {
+  parser_block_t block;
+  int text;         // Text block, passed on in order only
+  float x0[2];      // Start point
+  float v0[2];      // Direction at the start, 0 if the block doesn't move
+  float v1[2];      // Direction at the end
+  float len;        // Length in the xy plane (mm)
+  float f;          // Feed rate (mm/min)
+  float s;
+  uint8_t spindle;
+  uint8_t motion;
+  float nominal2;   // Square of the highest speed along the block (mm/s)
+  float junction2;  // Square of the highest speed at the corner at its start
+} laser_move_t;
 
 typedef struct {
   gc_modal_t modal;
@@ -9,6 +27,27 @@ typedef struct {
   float a;
   float v[2];
   float M;    // M = acos(maxangle)^2
+  float cos_max; // Cosine of the max angle
+
+  // Laser-off move held back without the planner, in case the cut after
+  // it carries on along the same line
+  int held;
+  laser_move_t gap;      // The move and its block
+  laser_move_t gap_prev; // The cut before it
+  int gap_ext;           // Result of the angle test at its start
+
+  // Lookahead planner, used when lookahead > 0
+  int lookahead;       // Blocks planned ahead of the corner being decided
+  float junction_deviation; // grbl's $11 (mm)
+  laser_move_t *moves; // Ring of blocks not pushed yet
+  size_t size;         // Allocated moves, a power of two
+  size_t head;         // Index of the oldest move, counts up forever
+  size_t tail;         // Index of the next move to add, counts up forever
+  size_t nmoves;       // Moves in the ring that aren't text
+  laser_move_t last;   // Last move pushed
+  float end2;          // Square of the planned speed at the end of last
+
+  unsigned long extensions; // Moves inserted to extend the cuts
 } laser_state_t;
 
 
@@ -18,13 +57,31 @@ typedef struct {
 
 void lasermode_init(laser_state_t *state, double a, double max_angle_deg);
 
+// Replaces the angle test with a simulation of grbl's planner over the
+// next lookahead blocks: a cut is only extended at a corner where the
+// machine would go slower than its feed rate. Blocks are held back, so
+// lasermode_flush() must be called at the end, and text blocks must go
+// through lasermode() as well.
+// junction_deviation: as grbl's $11 (mm)
+void lasermode_plan(laser_state_t *state, int lookahead, double junction_deviation);
+
+// Pushes the blocks held back
+// return value: Number of blocks pushed, -1 if out couldn't grow
+int lasermode_flush(laser_state_t *state, block_ring_t *out);
+
+void lasermode_free(laser_state_t *state);
+
 // state: must be inited with lasermode_init
-// block must called with one block, but must have room for 4 parser_block_t
-// return value: Number of blocks returned
-// adds extra moves so that laser can move at nominal speed when it is on
+// Pushes block to out, preceded by up to three extra moves so that the
+// laser can move at nominal speed when it is on. block is modified.
+// A short laser-off move between two cuts along the same line is held
+// back, and run at the feed rate with S0 instead of having the cuts
+// extended into it, so lasermode_flush() must be called at the end, and
+// text blocks must go through lasermode() as well.
+// return value: Number of blocks pushed, -1 if out couldn't grow
 
 int lasermode(laser_state_t *state,
-	       parser_block_t *block);
+	       parser_block_t *block, block_ring_t *out);
 
 
 #endif
@@ -0,0 +1,194 @@
+#include <stdlib.h>
+#include <string.h>
+#include "filter.h"
+#include "scan.h"
+#include "libgfilter.h"
+
+// Lines parsed per gc_parse_lines() call
+#define GFILTER_BATCH 256
+
+struct gfilter_s {
+  filter_t filter;
+  output_t output;      // Memory output, taken out by gfilter_read()
+  size_t read_pos;      // Start of the output not read yet
+  char *pending;        // Start of a line whose terminator hasn't been fed yet
+  size_t pending_len;
+  size_t pending_size;
+  int finished;
+  gfilter_error_t error;
+  void *error_arg;
+  parser_block_t blocks[GFILTER_BATCH];
+  gc_line_info_t info[GFILTER_BATCH];
+};
+
+void gfilter_options_init(gfilter_options_t *opt) {
+  memset(opt, 0, sizeof(*opt));
+  opt->angle = 2;
+  opt->junction_deviation = 0.01;
+}
+
+static void forward_error(void *arg, unsigned long line, uint8_t status) {
+  gfilter_t *g = arg;
+  g->error(g->error_arg, line, status);
+}
+
+gfilter_t *gfilter_create(const gfilter_options_t *opt) {
+  if (opt->mode != GFILTER_LASER && opt->mode != GFILTER_DRAG)
+    return NULL;
+
+  gfilter_t *g = calloc(1, sizeof(*g));
+  if (!g)
+    return NULL;
+  if (output_init(&g->output, NULL) < 0) {
+    free(g);
+    return NULL;
+  }
+  g->output.shortest = opt->shortest;
+
+  filter_settings_t settings;
+  settings.mode = opt->mode == GFILTER_LASER ? MODE_LASER : MODE_DRAG;
+  settings.acc = opt->acc;
+  settings.offset = opt->offset;
+  settings.angle = opt->angle;
+  settings.lookahead = opt->lookahead;
+  settings.junction_deviation = opt->junction_deviation;
+  settings.reorder = opt->reorder;
+  settings.arc_tolerance = opt->arc_tolerance;
+  settings.simplify = opt->simplify;
+  settings.simplify_tolerance = opt->simplify_tolerance;
+  settings.estimate_acc = 0;
+  filter_init(&g->filter, &settings, &g->output, NULL);
+  if (opt->error) {
+    g->error = opt->error;
+    g->error_arg = opt->error_arg;
+    g->filter.error = forward_error;
+    g->filter.error_arg = g;
+  }
+
+  if (back_end_init(&g->filter, print_blocks, &g->filter) < 0) {
+    gfilter_destroy(g);
+    return NULL;
+  }
+  return g;
+}
+
+static int status(gfilter_t *g) {
+  return g->filter.failed || g->output.failed ? -1 : 0;
+}
+
+// Filters the complete lines at the start of buf
+// return value: number of bytes used
+static size_t parse(gfilter_t *g, const char *buf, size_t len) {
+  size_t used = 0;
+  for (;;) {
+    size_t consumed;
+    size_t n = gc_parse_lines(buf + used, len - used, g->blocks, g->info,
+			      GFILTER_BATCH, &consumed, NULL);
+    if (!consumed)
+      return used;
+    process_lines(&g->filter, buf + used, g->blocks, g->info, n);
+    used += consumed;
+  }
+}
+
+// Keeps len bytes for the next call
+static int keep(gfilter_t *g, const char *data, size_t len) {
+  if (g->pending_size - g->pending_len < len) {
+    size_t size = g->pending_size ? g->pending_size : 256;
+    while (size - g->pending_len < len)
+      size *= 2;
+    char *p = realloc(g->pending, size);
+    if (!p)
+      return -1;
+    g->pending = p;
+    g->pending_size = size;
+  }
+  memcpy(g->pending + g->pending_len, data, len);
+  g->pending_len += len;
+  return 0;
+}
+
+int gfilter_feed(gfilter_t *g, const char *data, size_t len) {
+  if (g->finished)
+    return -1;
+
+  // Complete the line left over from the last call first
+  if (g->pending_len) {
+    const char *eol = scan_eol(data, data + len);
+    if (eol == data + len)
+      return keep(g, data, len) < 0 ? -1 : status(g);
+    size_t n = eol + 1 - data;
+    if (keep(g, data, n) < 0)
+      return -1;
+    parse(g, g->pending, g->pending_len);
+    g->pending_len = 0;
+    data += n;
+    len -= n;
+  }
+
+  size_t used = parse(g, data, len);
+  if (keep(g, data + used, len - used) < 0)
+    return -1;
+  return status(g);
+}
+
+int gfilter_parse_line(const char *line, size_t len, parser_block_t *block) {
+  char buf[LINE_BUFFER_SIZE + LINE_BUFFER_PADDING];
+  if (scan_line(line, len, buf) & LINE_FLAG_OVERFLOW) {
+    memset(block, 0, sizeof(*block));
+    return STATUS_OVERFLOW;
+  }
+  return gc_parse_line(buf, block);
+}
+
+int gfilter_feed_blocks(gfilter_t *g, const parser_block_t *blocks, size_t n) {
+  if (g->finished)
+    return -1;
+
+  for (size_t i = 0; i < n; i++) {
+    parser_block_t b = blocks[i];
+    filter_block(&g->filter, &b);
+  }
+  return status(g);
+}
+
+int gfilter_finish(gfilter_t *g) {
+  if (g->finished)
+    return -1;
+
+  if (g->pending_len) {
+    if (keep(g, "\n", 1) < 0)
+      return -1;
+    parse(g, g->pending, g->pending_len);
+    g->pending_len = 0;
+  }
+  back_end_flush(&g->filter);
+  g->finished = 1;
+  return status(g);
+}
+
+size_t gfilter_read(gfilter_t *g, char *buf, size_t size) {
+  output_t *out = &g->output;
+  if (g->read_pos > out->len) // output dropped when out of memory
+    g->read_pos = out->len;
+
+  size_t n = out->len - g->read_pos;
+  if (n > size)
+    n = size;
+  memcpy(buf, out->buf + g->read_pos, n);
+  g->read_pos += n;
+
+  // Start over at the beginning of the buffer once it's all read
+  if (g->read_pos == out->len)
+    out->len = g->read_pos = 0;
+  return n;
+}
+
+void gfilter_destroy(gfilter_t *g) {
+  if (!g)
+    return;
+  filter_free(&g->filter);
+  output_close(&g->output);
+  free(g->pending);
+  free(g);
+}
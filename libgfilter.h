@@ -0,0 +1,85 @@
+#ifndef LIBGFILTER_H
+#define LIBGFILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "gcode.h"
+
+// gfilter as a library. A context filters one G-code stream: bytes or
+// parsed blocks go in, filtered G-code text comes out. Contexts share
+// nothing, so several can be used at once on different threads, each
+// by one thread at a time.
+//
+//   gfilter_options_t opt;
+//   gfilter_options_init(&opt);
+//   opt.mode = GFILTER_LASER;
+//   opt.acc = 1000;
+//   gfilter_t *g = gfilter_create(&opt);
+//   gfilter_feed(g, data, len);   // as often as needed
+//   gfilter_finish(g);
+//   while ((n = gfilter_read(g, buf, sizeof(buf))))
+//     ...
+//   gfilter_destroy(g);
+
+#define GFILTER_LASER 1
+#define GFILTER_DRAG 2
+
+typedef struct gfilter_s gfilter_t;
+
+// Called for each input line the parser rejected, with the line number,
+// counting from 1, and a grbl STATUS_* code (see report.h)
+typedef void (*gfilter_error_t)(void *arg, unsigned long line, int status);
+
+typedef struct {
+  int mode;             // GFILTER_LASER or GFILTER_DRAG
+  float acc;            // Laser mode acceleration (mm/s2)
+  float offset;         // Drag knife offset (mm)
+  float angle;          // Max deflection angle treated as a continuous curve (degrees)
+  int lookahead;        // Laser mode: blocks planned ahead, 0 for the angle test alone
+  float junction_deviation; // Laser mode planner: grbl's $11 (mm)
+  int reorder;          // Reorder the contours to shorten the travel between them
+  float arc_tolerance;  // Replace G1 runs with arcs this close to them (mm), 0 not to
+  int simplify;         // Merge collinear G1 moves
+  float simplify_tolerance; // and drop vertices this close to the path (mm)
+  int shortest;         // Print numbers with the fewest digits that read back exactly
+  gfilter_error_t error; // May be NULL
+  void *error_arg;
+} gfilter_options_t;
+
+// Fills in the defaults: no mode, 2 degrees, no lookahead, 0.01 mm
+// junction deviation, 6 significant digits, no error callback
+void gfilter_options_init(gfilter_options_t *opt);
+
+// return value: new context, or NULL if out of memory or opt->mode is
+// not set
+gfilter_t *gfilter_create(const gfilter_options_t *opt);
+
+// Filters len bytes of G-code. Lines may be split across calls; a line
+// is only filtered once its terminator has been fed.
+// return value: 0 on success, -1 if out of memory
+int gfilter_feed(gfilter_t *g, const char *data, size_t len);
+
+// Parses one line of len bytes, without its terminator, into block. The
+// line is filtered like gfilter_feed() does into a buffer of its own, so
+// it needn't be NUL terminated or padded. Empty and comment lines give
+// an empty block; '$' commands are rejected.
+// return value: 0, or the grbl STATUS_* code the parser rejected it with
+int gfilter_parse_line(const char *line, size_t len, parser_block_t *block);
+
+// Filters n blocks parsed with gfilter_parse_line(), in the units and
+// distance mode in effect in the stream. The blocks are not modified.
+// return value: 0 on success, -1 if out of memory
+int gfilter_feed_blocks(gfilter_t *g, const parser_block_t *blocks, size_t n);
+
+// Ends the input: filters a last line without a terminator, and pushes
+// out what the stages held back. Nothing may be fed after this.
+// return value: 0 on success, -1 if out of memory
+int gfilter_finish(gfilter_t *g);
+
+// Takes up to size bytes of the filtered output produced so far
+// return value: number of bytes copied to buf, 0 if there is none
+size_t gfilter_read(gfilter_t *g, char *buf, size_t size);
+
+void gfilter_destroy(gfilter_t *g);
+
+#endif
@@ -4,7 +4,7 @@ int to_mm_init(to_mm_state_t *state) {
   state->units = UNITS_MODE_MM;
 }
 
-int to_mm(to_mm_state_t *state, parser_block_t *block) {
+int to_mm_units(to_mm_state_t *state, parser_block_t *block) {
   if (block->command_words & bit(MODAL_GROUP_G6)) {
     if (state->units == block->modal.units) {
       block->command_words &= ~bit(MODAL_GROUP_G6);
@@ -13,8 +13,11 @@ int to_mm(to_mm_state_t *state, parser_block_t *block) {
       block->modal.units = UNITS_MODE_MM;
     }
   }
+  return state->units == UNITS_MODE_INCHES;
+}
 
-  if (state->units == UNITS_MODE_INCHES) {
+int to_mm(to_mm_state_t *state, parser_block_t *block) {
+  if (to_mm_units(state, block)) {
     for (int i = 0; i < 3; i++) {
       block->values.xyz[i] *= 25.4;
       block->values.ijk[i] *= 25.4;
@@ -14,6 +14,10 @@ typedef struct {
 int to_mm_init(to_mm_state_t *state);
 int to_mm(to_mm_state_t *state, parser_block_t *block);
 
+// to_mm() without the conversion, for blocks converted already
+// return value: 1 if block is in inches
+int to_mm_units(to_mm_state_t *state, parser_block_t *block);
+
 // spits out a g21 command at the beginning, unless the first
 // block contains a g20 command
 // for every g21 command received, toggles between g21 and g20
@@ -22,10 +22,38 @@
 //#include "grbl.h"
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 #include <math.h>
+#include "nuts_bolts.h"
 
 #define MAX_INT_DIGITS 8 // Maximum number of digits in int32 (and float)
 
+const double pow10_table[POW10_TABLE_MAX + 1] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+}; // all exactly representable as double
+
+// Negative powers of ten for the decimals. A multiplication is several
+// times quicker than a division, and the extra rounding of 10^-n is lost
+// when the result is narrowed to float.
+static const double pow10_neg_table[POW10_TABLE_MAX + 1] = {
+  1e0, 1e-1, 1e-2, 1e-3, 1e-4, 1e-5, 1e-6, 1e-7, 1e-8, 1e-9, 1e-10, 1e-11,
+  1e-12, 1e-13, 1e-14, 1e-15, 1e-16, 1e-17, 1e-18, 1e-19, 1e-20, 1e-21, 1e-22
+};
+
+// Returns intval * 10^exp rounded to float, with a single double
+// precision operation within the table range.
+static float scale_pow10(uint32_t intval, int exp)
+{
+  double d = intval;
+  if (exp >= 0) {
+    d *= exp <= POW10_TABLE_MAX ? pow10_table[exp] : pow(10, exp);
+  } else {
+    d *= -exp <= POW10_TABLE_MAX ? pow10_neg_table[-exp] : pow(10, exp);
+  }
+  return d;
+}
+
 
 // Extracts a floating point value from a string. The following code is based loosely on
 // the avr-libc strtod() function by Michael Stumpf and Dmitry Xmelkov and many freely
@@ -34,7 +62,7 @@
 // Scientific notation is officially not supported by g-code, and the 'E' character may
 // be a g-code word on some CNC systems. So, 'E' notation will not be recognized.
 // NOTE: Thanks to Radu-Eosif Mihailescu for identifying the issues with using strtod().
-uint8_t read_float(char *line, uint8_t *char_counter, float *float_ptr)
+uint8_t read_float_scalar(char *line, uint16_t *char_counter, float *float_ptr)
 {
   char *ptr = line + *char_counter;
   unsigned char c;
@@ -53,7 +81,7 @@ uint8_t read_float(char *line, uint8_t *char_counter, float *float_ptr)
 
   // Extract number into fast integer. Track decimal in terms of exponent value.
   uint32_t intval = 0;
-  int8_t exp = 0;
+  int exp = 0;
   uint8_t ndigit = 0;
   bool isdecimal = false;
   while(1) {
@@ -77,25 +105,8 @@ uint8_t read_float(char *line, uint8_t *char_counter, float *float_ptr)
   // Return if no digits have been read.
   if (!ndigit) { return(false); };
 
-  // Convert integer into floating point.
-  float fval;
-  fval = (float)intval;
-
-  // Apply decimal. Should perform no more than two floating point multiplications for the
-  // expected range of E0 to E-4.
-  if (fval != 0) {
-    while (exp <= -2) {
-      fval *= 0.01;
-      exp += 2;
-    }
-    if (exp < 0) {
-      fval *= 0.1;
-    } else if (exp > 0) {
-      do {
-        fval *= 10.0;
-      } while (--exp > 0);
-    }
-  }
+  // Convert integer into floating point and apply decimal.
+  float fval = scale_pow10(intval, exp);
 
   // Assign floating point value with correct sign.
   if (isnegative) {
@@ -110,6 +121,100 @@ uint8_t read_float(char *line, uint8_t *char_counter, float *float_ptr)
 }
 
 
+// SWAR helpers for read_float(). Eight characters are loaded into a
+// 64-bit word, first character in the lowest byte.
+
+// Returns a word with the high bit set in every byte that isn't a decimal digit.
+static inline uint64_t swar_nondigits(uint64_t chunk)
+{
+  uint64_t y = chunk ^ 0x3030303030303030ull; // digits become 0-9
+  return (((y & 0x7f7f7f7f7f7f7f7full) + 0x7676767676767676ull) | y) & 0x8080808080808080ull;
+}
+
+// Converts the first n (1-8) characters of the word, all digits, to an integer.
+static inline uint32_t swar_parse_digits(uint64_t chunk, int n)
+{
+  uint64_t val = (chunk ^ 0x3030303030303030ull) << (8 * (8 - n)); // pad with leading zeros
+  val = (val * 10) + (val >> 8);
+  val = (((val & 0x000000ff000000ffull) * (100 + (1000000ull << 32))) +
+         (((val >> 16) & 0x000000ff000000ffull) * (1 + (10000ull << 32)))) >> 32;
+  return (uint32_t) val;
+}
+
+// Mask for the first n (0-7) characters of a word
+static inline uint64_t low_bytes(int n)
+{
+  return (1ull << (8 * n)) - 1;
+}
+
+static inline uint64_t load8(const char *p)
+{
+  uint64_t chunk;
+  memcpy(&chunk, p, sizeof(chunk));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  chunk = __builtin_bswap64(chunk);
+#endif
+  return chunk;
+}
+
+// Fast path for the plain fixed point numbers CAM programs emit, such as
+// 123.4567. When the number fits in eight characters, the decimal point
+// is squeezed out of the word and all digits are converted in one go,
+// otherwise the integer and fraction digits are converted separately.
+// The result is scaled with one table lookup. Anything else, including
+// more than MAX_INT_DIGITS digits, is handed to read_float_scalar(),
+// which gives the same result.
+// NOTE: Reads up to 8 bytes past the end of the number, so line must
+// stay readable for 8 bytes beyond its terminator.
+uint8_t read_float(char *line, uint16_t *char_counter, float *float_ptr)
+{
+  const char *ptr = line + *char_counter;
+  bool isnegative = false;
+  if (*ptr == '-') {
+    isnegative = true;
+    ptr++;
+  } else if (*ptr == '+') {
+    ptr++;
+  }
+
+  uint64_t chunk = load8(ptr);
+  uint64_t nondigit = swar_nondigits(chunk);
+  if (!nondigit) { return read_float_scalar(line, char_counter, float_ptr); } // 8+ integer digits
+  int nint = __builtin_ctzll(nondigit) >> 3;
+  int nfrac = 0;
+  uint32_t intval;
+
+  if (((chunk >> (8 * nint)) & 0xff) != '.') {
+    if (!nint) { return(false); } // No digits
+    intval = swar_parse_digits(chunk, nint);
+    ptr += nint;
+  } else {
+    nondigit &= nondigit - 1; // first non-digit after the point
+    if (nondigit) {
+      // whole number is in the word: drop the point and convert all digits
+      int end = __builtin_ctzll(nondigit) >> 3;
+      uint64_t intmask = low_bytes(nint);
+      chunk = (chunk & intmask) | ((chunk >> 8) & ~intmask);
+      nfrac = end - nint - 1;
+      ptr += end;
+    } else {
+      // fraction continues in the next word
+      uint64_t frac = load8(ptr + nint + 1);
+      nondigit = swar_nondigits(frac);
+      nfrac = nondigit ? __builtin_ctzll(nondigit) >> 3 : 8;
+      if (nfrac == 8 || nint + nfrac > MAX_INT_DIGITS) { return read_float_scalar(line, char_counter, float_ptr); }
+      chunk = (chunk & low_bytes(nint)) | (frac << (8 * nint));
+      ptr += nint + 1 + nfrac;
+    }
+    if (nint + nfrac == 0) { return(false); } // No digits
+    intval = swar_parse_digits(chunk, nint + nfrac);
+  }
+
+  float fval = intval ? (float)((double)intval * pow10_neg_table[nfrac]) : 0;
+  *float_ptr = isnegative ? -fval : fval;
+  *char_counter = ptr - line;
+  return(true);
+}
 
 
 // Simple hypotenuse computation function.
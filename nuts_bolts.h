@@ -66,10 +66,19 @@
 #define bit_istrue(x,mask) ((x & mask) != 0)
 #define bit_isfalse(x,mask) ((x & mask) == 0)
 
+// Powers of ten 10^0 .. 10^POW10_TABLE_MAX, exact as double
+#define POW10_TABLE_MAX 22
+extern const double pow10_table[POW10_TABLE_MAX + 1];
+
 // Read a floating point value from a string. Line points to the input buffer, char_counter
 // is the indexer pointing to the current character of the line, while float_ptr is
 // a pointer to the result variable. Returns true when it succeeds
-uint8_t read_float(char *line, uint8_t *char_counter, float *float_ptr);
+// NOTE: line must stay readable for 8 bytes past its terminator.
+uint8_t read_float(char *line, uint16_t *char_counter, float *float_ptr);
+
+// Same as read_float, one character at a time. Used by read_float for inputs
+// outside its fast path.
+uint8_t read_float_scalar(char *line, uint16_t *char_counter, float *float_ptr);
 
 // Non-blocking delay function used for general operation and suspend features.
 void delay_sec(float seconds, uint8_t mode);
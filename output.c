@@ -0,0 +1,237 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "output.h"
+#include "nuts_bolts.h"
+
+int output_init(output_t *out, FILE *fp) {
+  memset(out, 0, sizeof(*out));
+  out->fp = fp;
+  out->size = OUTPUT_BUFFER_SIZE;
+  out->buf = malloc(out->size);
+  return out->buf ? 0 : -1;
+}
+
+// Doubles the buffer of a memory output until n more bytes fit
+// return value: 0 on success, -1 if out of memory
+static int output_grow(output_t *out, size_t n) {
+  size_t size = out->size;
+  while (size - out->len < n)
+    size *= 2;
+  char *buf = realloc(out->buf, size);
+  if (!buf) {
+    out->failed = 1;
+    return -1;
+  }
+  out->buf = buf;
+  out->size = size;
+  return 0;
+}
+
+void output_flush(output_t *out) {
+  if (!out->fp) {
+    // Memory output keeps everything, and only makes room for more.
+    // What doesn't fit is dropped.
+    if (out->size - out->len < OUTPUT_NUMBER_MAX && output_grow(out, OUTPUT_NUMBER_MAX) < 0)
+      out->len = 0;
+    return;
+  }
+  if (out->len)
+    fwrite(out->buf, 1, out->len, out->fp);
+  out->flushed += out->len;
+  out->len = 0;
+}
+
+void output_close(output_t *out) {
+  output_flush(out);
+  free(out->buf);
+  out->buf = NULL;
+  out->size = 0;
+}
+
+void output_write(output_t *out, const char *s, size_t n) {
+  if (out->len + n > out->size) {
+    if (!out->fp) {
+      if (output_grow(out, n) < 0)
+	return;
+      memcpy(out->buf + out->len, s, n);
+      out->len += n;
+      return;
+    }
+    output_flush(out);
+    if (n > out->size) {
+      fwrite(s, 1, n, out->fp);
+      out->flushed += n;
+      return;
+    }
+  }
+  memcpy(out->buf + out->len, s, n);
+  out->len += n;
+}
+
+void output_str(output_t *out, const char *s) {
+  output_write(out, s, strlen(s));
+}
+
+void output_int(output_t *out, int32_t v) {
+  char tmp[12];
+  char *p = tmp + sizeof(tmp);
+  uint32_t u = v < 0 ? -(uint32_t) v : (uint32_t) v;
+
+  do {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while (u);
+  if (v < 0)
+    *--p = '-';
+  output_write(out, p, tmp + sizeof(tmp) - p);
+}
+
+void output_float(output_t *out, float v) {
+  if (out->len + OUTPUT_NUMBER_MAX > out->size)
+    output_flush(out);
+  if (out->shortest)
+    out->len += fmt_float_shortest(out->buf + out->len, v);
+  else
+    out->len += fmt_float(out->buf + out->len, v);
+}
+
+// Rounds v (positive, finite) to prec significant digits, the way printf
+// does. *digits receives the prec digits as an integer and *exp the
+// decimal exponent of the first digit.
+// return value: 0 if v is out of range or so close to a rounding tie that
+// the result can't be guaranteed to match printf
+
+static int round_digits(float v, int prec, uint32_t *digits, int *exp) {
+  uint32_t bits;
+  memcpy(&bits, &v, sizeof(bits));
+  int bexp = (int) ((bits >> 23) & 0xff) - 127;
+  if (bexp < -60 || bexp > 80) // denormals and values the table can't scale
+    return 0;
+
+  int e = (bexp * 1233) >> 12; // floor(bexp * log10(2)), may be one low
+  double scaled;
+
+  for (int tries = 0; ; tries++) {
+    int k = prec - 1 - e;
+    if (k > POW10_TABLE_MAX || k < -POW10_TABLE_MAX || tries > 2)
+      return 0;
+    // a single correctly rounded operation, so scaled is within half
+    // an ulp of the exact value
+    scaled = k >= 0 ? (double) v * pow10_table[k] : (double) v / pow10_table[-k];
+    if (scaled >= pow10_table[prec])
+      e++;
+    else if (scaled < pow10_table[prec - 1])
+      e--;
+    else
+      break;
+  }
+
+  uint32_t m = (uint32_t) scaled;
+  double frac = scaled - m;
+  if (fabs(frac - 0.5) < 1e-6)
+    return 0;
+  if (frac > 0.5)
+    m++;
+  if (m == (uint32_t) pow10_table[prec]) {
+    m = (uint32_t) pow10_table[prec - 1];
+    e++;
+  }
+
+  *digits = m;
+  *exp = e;
+  return 1;
+}
+
+// Lays out prec significant digits with decimal exponent x the way %g
+// does: fixed notation if prec > x >= -4, exponent notation otherwise,
+// trailing zeros removed.
+
+static size_t layout_g(char *dst, int negative, uint32_t m, int prec, int x) {
+  char digits[10];
+  for (int i = prec - 1; i >= 0; i--) {
+    digits[i] = '0' + m % 10;
+    m /= 10;
+  }
+  int n = prec; // significant digits left after stripping zeros
+  while (n > 1 && digits[n - 1] == '0')
+    n--;
+
+  char *p = dst;
+  if (negative)
+    *p++ = '-';
+
+  if (x < prec && x >= -4) {
+    if (x >= 0) {
+      memcpy(p, digits, x + 1);
+      p += x + 1;
+      if (n > x + 1) {
+	*p++ = '.';
+	memcpy(p, digits + x + 1, n - x - 1);
+	p += n - x - 1;
+      }
+    } else {
+      *p++ = '0';
+      *p++ = '.';
+      for (int i = -1; i > x; i--)
+	*p++ = '0';
+      memcpy(p, digits, n);
+      p += n;
+    }
+  } else {
+    *p++ = digits[0];
+    if (n > 1) {
+      *p++ = '.';
+      memcpy(p, digits + 1, n - 1);
+      p += n - 1;
+    }
+    *p++ = 'e';
+    *p++ = x < 0 ? '-' : '+';
+    int ax = x < 0 ? -x : x;
+    if (ax >= 100)
+      *p++ = '0' + ax / 100;
+    *p++ = '0' + ax / 10 % 10;
+    *p++ = '0' + ax % 10;
+  }
+  return p - dst;
+}
+
+size_t fmt_float(char *dst, float v) {
+  int negative = signbit(v) != 0;
+  float a = negative ? -v : v;
+  uint32_t m;
+  int x;
+
+  if (a == 0) {
+    char *p = dst;
+    if (negative)
+      *p++ = '-';
+    *p++ = '0';
+    return p - dst;
+  }
+  if (isfinite(a) && round_digits(a, 6, &m, &x))
+    return layout_g(dst, negative, m, 6, x);
+  return snprintf(dst, OUTPUT_NUMBER_MAX, "%g", v);
+}
+
+size_t fmt_float_shortest(char *dst, float v) {
+  int negative = signbit(v) != 0;
+  float a = negative ? -v : v;
+
+  if (a == 0 || !isfinite(a))
+    return fmt_float(dst, v);
+
+  for (int prec = 1; prec <= 9; prec++) {
+    uint32_t m;
+    int x;
+    size_t n;
+    if (round_digits(a, prec, &m, &x))
+      n = layout_g(dst, negative, m, prec, x);
+    else
+      n = snprintf(dst, OUTPUT_NUMBER_MAX, "%.*g", prec, v);
+    dst[n] = 0;
+    if (strtof(dst, NULL) == v)
+      return n;
+  }
+  return snprintf(dst, OUTPUT_NUMBER_MAX, "%.9g", v);
+}
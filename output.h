@@ -0,0 +1,63 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define OUTPUT_BUFFER_SIZE (1 << 18)
+
+// Longest text a single number can produce
+#define OUTPUT_NUMBER_MAX 32
+
+typedef struct {
+  FILE *fp;
+  char *buf;
+  size_t len;
+  size_t size;
+  int shortest; // print the shortest round-trip form of floats instead of %g
+  int failed;   // memory output ran out of memory and dropped text
+  uint64_t flushed; // bytes written to fp so far
+} output_t;
+
+// fp: file to write to, or NULL to keep all output in out->buf until the
+// caller takes it out and resets out->len
+// return value: 0 on success, -1 if the buffer could not be allocated
+int output_init(output_t *out, FILE *fp);
+
+// writes everything buffered so far to out->fp, or makes room for more
+// in a memory output
+void output_flush(output_t *out);
+
+// flushes and frees the buffer. Does not close out->fp
+void output_close(output_t *out);
+
+void output_write(output_t *out, const char *s, size_t n);
+void output_str(output_t *out, const char *s);
+void output_int(output_t *out, int32_t v);
+
+// Prints v exactly like printf("%g", v), or the shortest text that
+// reads back as v when out->shortest is set.
+void output_float(output_t *out, float v);
+
+// return value: bytes written to out so far, buffered or not
+static inline uint64_t output_total(const output_t *out) {
+  return out->flushed + out->len;
+}
+
+static inline void output_char(output_t *out, char c) {
+  if (out->len == out->size)
+    output_flush(out);
+  out->buf[out->len++] = c;
+}
+
+// Formats v like printf("%g", v) into dst, which must have room for
+// OUTPUT_NUMBER_MAX characters. No terminator is written.
+// return value: number of characters written
+size_t fmt_float(char *dst, float v);
+
+// As fmt_float, but with the fewest significant digits that read back
+// as the same float.
+size_t fmt_float_shortest(char *dst, float v);
+
+#endif
@@ -0,0 +1,165 @@
+#include <stdlib.h>
+#include <string.h>
+#include "parse_pool.h"
+
+// Lines parsed per gc_parse_lines() call in a worker
+#define PARSE_POOL_BATCH 1024
+
+void parse_chunk(parse_chunk_t *c, stats_t *stats) {
+  const char *p = c->data;
+  size_t left = c->len;
+
+  c->nlines = 0;
+  c->failed = 0;
+  while (left) {
+    if (c->size - c->nlines < PARSE_POOL_BATCH) {
+      size_t size = c->size ? c->size * 2 : 4 * PARSE_POOL_BATCH;
+      parser_block_t *blocks = realloc(c->blocks, size * sizeof(parser_block_t));
+      if (blocks)
+	c->blocks = blocks;
+      gc_line_info_t *info = realloc(c->info, size * sizeof(gc_line_info_t));
+      if (info)
+	c->info = info;
+      if (!blocks || !info) {
+	c->failed = 1;
+	return;
+      }
+      c->size = size;
+    }
+
+    size_t consumed;
+    size_t first = c->nlines;
+    c->nlines += gc_parse_lines(p, left, c->blocks + first, c->info + first,
+				PARSE_POOL_BATCH, &consumed, stats);
+    if (!consumed)
+      break; // unterminated tail, not expected from the caller
+
+    // make the line offsets relative to the start of the chunk
+    for (size_t i = first; i < c->nlines; i++)
+      c->info[i].offset += p - c->data;
+
+    p += consumed;
+    left -= consumed;
+  }
+}
+
+static void *worker(void *arg) {
+  parse_pool_t *pool = arg;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->quit && pool->started == pool->submitted)
+      pthread_cond_wait(&pool->work, &pool->lock);
+    if (pool->quit)
+      break;
+
+    parse_chunk_t *c = &pool->chunks[pool->started++ % pool->nchunks];
+    pthread_mutex_unlock(&pool->lock);
+
+    parse_chunk(c, pool->stats);
+
+    pthread_mutex_lock(&pool->lock);
+    c->done = 1;
+    pthread_cond_broadcast(&pool->finished);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+int parse_pool_init(parse_pool_t *pool, int nthreads, stats_t *stats) {
+  memset(pool, 0, sizeof(*pool));
+  pool->stats = stats;
+
+  // Enough slots to keep every thread busy while the caller works
+  // through the oldest chunk
+  pool->nchunks = 2 * nthreads + 1;
+  pool->chunks = calloc(pool->nchunks, sizeof(parse_chunk_t));
+  pool->threads = calloc(nthreads, sizeof(pthread_t));
+  if (!pool->chunks || !pool->threads) {
+    free(pool->chunks);
+    free(pool->threads);
+    return -1;
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->finished, NULL);
+
+  for (int i = 0; i < nthreads; i++) {
+    if (pthread_create(&pool->threads[i], NULL, worker, pool) != 0) {
+      parse_pool_destroy(pool);
+      return -1;
+    }
+    pool->nthreads++;
+  }
+  return 0;
+}
+
+int parse_pool_full(parse_pool_t *pool) {
+  return pool->submitted - pool->consumed == pool->nchunks;
+}
+
+int parse_pool_submit(parse_pool_t *pool, const char *data, size_t len, int copy) {
+  // Only the caller's thread touches the slots between consumed and
+  // submitted, so the slot can be filled without the lock
+  parse_chunk_t *c = &pool->chunks[pool->submitted % pool->nchunks];
+
+  if (copy) {
+    if (c->copy_size < len) {
+      char *p = realloc(c->copy, len);
+      if (!p)
+	return -1;
+      c->copy = p;
+      c->copy_size = len;
+    }
+    memcpy(c->copy, data, len);
+    data = c->copy;
+  }
+  c->data = data;
+  c->len = len;
+  c->done = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->submitted++;
+  pthread_cond_signal(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+  return 0;
+}
+
+parse_chunk_t *parse_pool_next(parse_pool_t *pool) {
+  if (pool->consumed == pool->submitted)
+    return NULL;
+
+  parse_chunk_t *c = &pool->chunks[pool->consumed % pool->nchunks];
+  pthread_mutex_lock(&pool->lock);
+  while (!c->done)
+    pthread_cond_wait(&pool->finished, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+  return c;
+}
+
+void parse_pool_release(parse_pool_t *pool) {
+  pool->consumed++;
+}
+
+void parse_pool_destroy(parse_pool_t *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = 1;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->nthreads; i++)
+    pthread_join(pool->threads[i], NULL);
+
+  for (size_t i = 0; i < pool->nchunks; i++) {
+    free(pool->chunks[i].copy);
+    free(pool->chunks[i].blocks);
+    free(pool->chunks[i].info);
+  }
+  free(pool->chunks);
+  free(pool->threads);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->finished);
+  memset(pool, 0, sizeof(*pool));
+}
@@ -0,0 +1,74 @@
+#ifndef PARSE_POOL_H
+#define PARSE_POOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include "gcode.h"
+#include "stats.h"
+
+// Parses chunks of input on a pool of threads. Parsing a line doesn't
+// depend on earlier lines, so chunks split at line terminators can be
+// parsed in any order. The caller submits chunks in input order and gets
+// them back, parsed, in the same order, to feed into the stateful stages.
+
+// Aim for chunks of about this many bytes
+#define PARSE_CHUNK_SIZE (256 * 1024)
+
+typedef struct {
+  const char *data;         // Lines to parse, each with its terminator
+  size_t len;
+  char *copy;               // Own copy of data for input that doesn't stay put
+  size_t copy_size;
+
+  parser_block_t *blocks;   // Parse results, one per line
+  gc_line_info_t *info;
+  size_t nlines;
+  size_t size;              // Allocated entries in blocks and info
+
+  int failed;               // Out of memory; nlines are valid
+  int done;
+} parse_chunk_t;
+
+// Parses all lines of c->data into its growable arrays, on the calling
+// thread, counting into stats unless it is NULL. Sets c->failed if out
+// of memory.
+void parse_chunk(parse_chunk_t *c, stats_t *stats);
+
+typedef struct {
+  pthread_t *threads;
+  int nthreads;
+  parse_chunk_t *chunks;    // Ring of chunk slots
+  size_t nchunks;
+  size_t submitted;         // Chunks handed in so far
+  size_t started;           // Chunks picked up by a worker so far
+  size_t consumed;          // Chunks released by the caller so far
+  pthread_mutex_t lock;
+  pthread_cond_t work;      // Signalled when a chunk is submitted
+  pthread_cond_t finished;  // Signalled when a chunk has been parsed
+  int quit;
+  stats_t *stats;           // Parsing counted here unless NULL
+} parse_pool_t;
+
+// return value: 0 on success, -1 on failure
+int parse_pool_init(parse_pool_t *pool, int nthreads, stats_t *stats);
+
+// return value: non-zero if every chunk slot is in use, so the oldest
+// chunk must be consumed before another can be submitted
+int parse_pool_full(parse_pool_t *pool);
+
+// Queues len bytes of complete lines for parsing. With copy set, the
+// data is copied first so the caller may reuse its buffer; otherwise it
+// must stay valid until the chunk has been released.
+// return value: 0 on success, -1 if out of memory
+int parse_pool_submit(parse_pool_t *pool, const char *data, size_t len, int copy);
+
+// Waits for the oldest submitted chunk to be parsed
+// return value: the chunk, or NULL if there are none outstanding
+parse_chunk_t *parse_pool_next(parse_pool_t *pool);
+
+// Hands the chunk returned by parse_pool_next back to the pool
+void parse_pool_release(parse_pool_t *pool);
+
+void parse_pool_destroy(parse_pool_t *pool);
+
+#endif
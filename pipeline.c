@@ -0,0 +1,175 @@
+#include <stdlib.h>
+#include <string.h>
+#include "pipeline.h"
+
+#define BLOCK_RING_MIN_SIZE 8
+
+int block_ring_init(block_ring_t *ring) {
+  ring->blocks = malloc(BLOCK_RING_MIN_SIZE * sizeof(parser_block_t));
+  ring->size = BLOCK_RING_MIN_SIZE;
+  ring->head = ring->tail = 0;
+  return ring->blocks ? 0 : -1;
+}
+
+// Moves the blocks to the start of the new ring
+int block_ring_grow(block_ring_t *ring) {
+  size_t n = ring->tail - ring->head;
+  parser_block_t *blocks = malloc(2 * ring->size * sizeof(parser_block_t));
+  if (!blocks)
+    return -1;
+  for (size_t i = 0; i < n; i++)
+    blocks[i] = ring->blocks[(ring->head + i) & (ring->size - 1)];
+  free(ring->blocks);
+  ring->blocks = blocks;
+  ring->size *= 2;
+  ring->head = 0;
+  ring->tail = n;
+  return 0;
+}
+
+void block_ring_free(block_ring_t *ring) {
+  free(ring->blocks);
+  ring->blocks = NULL;
+  ring->size = ring->head = ring->tail = 0;
+}
+
+// Splits the blocks in ring into runs of consecutive blocks, two if
+// they wrap around the end of the storage
+// return value: number of runs
+static int ring_runs(const block_ring_t *ring, parser_block_t *start[2], size_t len[2]) {
+  size_t n = ring->tail - ring->head;
+  size_t i = ring->head & (ring->size - 1);
+  if (!n)
+    return 0;
+  start[0] = &ring->blocks[i];
+  start[1] = ring->blocks;
+  len[0] = n < ring->size - i ? n : ring->size - i;
+  len[1] = n - len[0];
+  return len[1] ? 2 : 1;
+}
+
+
+void pipeline_init(pipeline_t *p, pipeline_sink_t sink, void *sink_state) {
+  memset(p, 0, sizeof(*p));
+  p->sink = sink;
+  p->sink_state = sink_state;
+}
+
+int pipeline_add(pipeline_t *p, int (*process)(void *, parser_block_t *, block_ring_t *),
+		 int (*flush)(void *, block_ring_t *), void *state) {
+  if (p->nstages == PIPELINE_MAX_STAGES || block_ring_init(&p->rings[p->nstages]) < 0)
+    return -1;
+  stage_t *s = &p->stages[p->nstages++];
+  s->state = state;
+  s->process = process;
+  s->flush = flush;
+  if (flush)
+    p->holding = 1;
+  return 0;
+}
+
+// Hands blocks to the sink
+static void sink(pipeline_t *p, parser_block_t *blocks, size_t n) {
+  p->sink(p->sink_state, blocks, n, p->text);
+
+  if (p->holding) {
+    for (size_t i = 0; i < n; i++)
+      p->text_blocks -= block_is_text(&blocks[i]);
+    // Start over at the beginning of the text buffer once it's all printed
+    if (!p->text_blocks)
+      p->text_len = 0;
+  }
+}
+
+static int run(pipeline_t *p, int i, parser_block_t *block);
+
+// Runs the blocks pushed by stage i through the stages after it
+static int drain(pipeline_t *p, int i) {
+  block_ring_t *ring = &p->rings[i];
+
+  if (i + 1 == p->nstages) {
+    parser_block_t *start[2];
+    size_t len[2];
+    int runs = ring_runs(ring, start, len);
+    for (int r = 0; r < runs; r++)
+      sink(p, start[r], len[r]);
+    ring->head = ring->tail;
+    return 0;
+  }
+
+  while (!block_ring_empty(ring)) {
+    // The block stays in the ring while the later stages work on it.
+    // Only stage i pushes to this ring, so it doesn't move.
+    if (run(p, i + 1, block_ring_front(ring)) < 0)
+      return -1;
+    block_ring_pop(ring);
+  }
+  return 0;
+}
+
+// Runs block through the stages from i on, and into the sink
+static int run(pipeline_t *p, int i, parser_block_t *block) {
+  if (block_is_text(block))
+    while (i < p->nstages && !p->stages[i].flush)
+      i++;
+
+  if (i == p->nstages) {
+    sink(p, block, 1);
+    return 0;
+  }
+
+  stage_t *s = &p->stages[i];
+  if (s->process(s->state, block, &p->rings[i]) < 0)
+    return -1;
+  return drain(p, i);
+}
+
+int pipeline_push(pipeline_t *p, parser_block_t *block) {
+  return run(p, 0, block);
+}
+
+int pipeline_push_text(pipeline_t *p, const char *text) {
+  parser_block_t block;
+  block.value_words = bit(WORD_TEXT);
+
+  // Nothing can overtake the text if no stage holds blocks back
+  if (!p->holding) {
+    block.values.n = 0;
+    p->sink(p->sink_state, &block, 1, text);
+    return 0;
+  }
+
+  size_t n = strlen(text) + 1;
+  if (p->text_size - p->text_len < n) {
+    size_t size = p->text_size ? p->text_size : 256;
+    while (size - p->text_len < n)
+      size *= 2;
+    char *t = realloc(p->text, size);
+    if (!t)
+      return -1;
+    p->text = t;
+    p->text_size = size;
+  }
+
+  block.values.n = p->text_len;
+  memcpy(p->text + p->text_len, text, n);
+  p->text_len += n;
+  p->text_blocks++;
+  return run(p, 0, &block);
+}
+
+int pipeline_flush(pipeline_t *p) {
+  for (int i = 0; i < p->nstages; i++) {
+    stage_t *s = &p->stages[i];
+    if (s->flush && (s->flush(s->state, &p->rings[i]) < 0 || drain(p, i) < 0))
+      return -1;
+  }
+  return 0;
+}
+
+void pipeline_free(pipeline_t *p) {
+  for (int i = 0; i < p->nstages; i++)
+    block_ring_free(&p->rings[i]);
+  free(p->text);
+  memset(p, 0, sizeof(*p));
+}
@@ -0,0 +1,124 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stddef.h>
+#include "gcode.h"
+
+// Growable FIFO of blocks. Stages that turn one block into several push
+// them here instead of writing past the block they were given.
+typedef struct {
+  parser_block_t *blocks;
+  size_t size;  // allocated blocks, a power of two
+  size_t head;  // index of the next block to pop, counts up forever
+  size_t tail;  // index of the next block to push, counts up forever
+} block_ring_t;
+
+// return value: 0 on success, -1 if out of memory
+int block_ring_init(block_ring_t *ring);
+
+// Doubles the size of a full ring
+// return value: 0 on success, -1 if out of memory
+int block_ring_grow(block_ring_t *ring);
+
+// return value: slot for a new block at the end of the ring, uninitialized,
+// or NULL if the ring couldn't grow
+static inline parser_block_t *block_ring_push(block_ring_t *ring) {
+  if (ring->tail - ring->head == ring->size && block_ring_grow(ring) < 0)
+    return NULL;
+  return &ring->blocks[ring->tail++ & (ring->size - 1)];
+}
+
+// Pushes a copy of block
+// return value: 0 on success, -1 if the ring couldn't grow
+static inline int block_ring_push_copy(block_ring_t *ring, const parser_block_t *block) {
+  parser_block_t *b = block_ring_push(ring);
+  if (!b)
+    return -1;
+  *b = *block;
+  return 0;
+}
+
+static inline int block_ring_empty(const block_ring_t *ring) {
+  return ring->head == ring->tail;
+}
+
+// return value: the oldest block, which stays in the ring until popped
+static inline parser_block_t *block_ring_front(block_ring_t *ring) {
+  return &ring->blocks[ring->head & (ring->size - 1)];
+}
+
+static inline void block_ring_pop(block_ring_t *ring) {
+  ring->head++;
+}
+
+void block_ring_free(block_ring_t *ring);
+
+
+// Pseudo value word marking a block that stands for a line of text
+// (empty line, comment or '$' command) to be printed verbatim. The text
+// is kept by the pipeline, at offset values.n of its text buffer.
+#define WORD_TEXT 15
+
+static inline int block_is_text(const parser_block_t *block) {
+  return (block->value_words & bit(WORD_TEXT)) != 0;
+}
+
+// A stage consumes a block and pushes zero or more blocks into out. It
+// may modify the block it is given.
+// Stages that hold blocks back have a flush function that pushes them at
+// the end of the stream. Such stages also get the text blocks, and must
+// pass them on in order. Text blocks bypass the other stages.
+// return value of both: 0 or more on success, -1 on failure
+typedef struct {
+  void *state;
+  int (*process)(void *state, parser_block_t *block, block_ring_t *out);
+  int (*flush)(void *state, block_ring_t *out);
+} stage_t;
+
+// Receives runs of consecutive blocks coming out of the last stage, in
+// order. text is the text buffer; the line of a text block is at text +
+// block->values.n.
+typedef void (*pipeline_sink_t)(void *state, parser_block_t *blocks, size_t n, const char *text);
+
+#define PIPELINE_MAX_STAGES 16
+
+// Chain of stages. A block pushed in goes through all of them, and
+// whatever comes out goes to the sink, before the push returns.
+typedef struct {
+  stage_t stages[PIPELINE_MAX_STAGES];
+  block_ring_t rings[PIPELINE_MAX_STAGES]; // output of each stage
+  int nstages;
+  int holding;       // Some stage has a flush function
+  pipeline_sink_t sink;
+  void *sink_state;
+
+  // Lines of the text blocks in the pipeline, NUL terminated
+  char *text;
+  size_t text_len;
+  size_t text_size;
+  size_t text_blocks; // Number of text blocks in the pipeline
+} pipeline_t;
+
+void pipeline_init(pipeline_t *p, pipeline_sink_t sink, void *sink_state);
+
+// Appends a stage. flush may be NULL.
+// return value: 0 on success, -1 if there are too many stages or out of memory
+int pipeline_add(pipeline_t *p, int (*process)(void *, parser_block_t *, block_ring_t *),
+		 int (*flush)(void *, block_ring_t *), void *state);
+
+// Runs block through all stages. The block may be modified.
+// return value: 0 on success, -1 if a stage failed
+int pipeline_push(pipeline_t *p, parser_block_t *block);
+
+// Sends a line of text through the pipeline, to be printed after the
+// blocks before it
+// return value: 0 on success, -1 if out of memory or a stage failed
+int pipeline_push_text(pipeline_t *p, const char *text);
+
+// Pushes out the blocks held back by the stages, at the end of the stream
+// return value: 0 on success, -1 if a stage failed
+int pipeline_flush(pipeline_t *p);
+
+void pipeline_free(pipeline_t *p);
+
+#endif
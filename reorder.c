@@ -0,0 +1,560 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nuts_bolts.h"
+#include "reorder.h"
+#include "geom.h"
+
+// 2-opt tries reversing runs of up to this many contours
+#define REORDER_WINDOW 32
+// and stops after this many passes over the tour
+#define REORDER_PASSES 8
+// Travel moves measured per geom_lengths() call
+#define REORDER_LENGTHS 64
+
+// Blocks that change what the blocks after them mean
+#define REORDER_BARRIER_GROUPS (bit(MODAL_GROUP_G2) | bit(MODAL_GROUP_G3) | \
+				bit(MODAL_GROUP_G5) | bit(MODAL_GROUP_G6) | \
+				bit(MODAL_GROUP_G8) | bit(MODAL_GROUP_G12) | \
+				bit(MODAL_GROUP_M4))
+
+static void start_blocks(reorder_state_t *state) {
+  state->nblocks = 0;
+  state->nunits = 0;
+  state->in_cut = 0;
+  state->pos0[0] = state->values.xyz[0];
+  state->pos0[1] = state->values.xyz[1];
+}
+
+void reorder_init(reorder_state_t *state, int laser) {
+  memset(state, 0, sizeof(*state));
+  state->laser = laser;
+  start_blocks(state);
+}
+
+void reorder_free(reorder_state_t *state) {
+  free(state->blocks);
+  free(state->units);
+  state->blocks = NULL;
+  state->units = NULL;
+  state->size = state->units_size = 0;
+  state->nblocks = state->nunits = 0;
+}
+
+static int is_arc(uint8_t motion) {
+  return motion == MOTION_MODE_CW_ARC || motion == MOTION_MODE_CCW_ARC;
+}
+
+static int barrier(const parser_block_t *block) {
+  return block->non_modal_command != NON_MODAL_NO_ACTION ||
+    (block->command_words & REORDER_BARRIER_GROUPS) ||
+    ((block->command_words & bit(MODAL_GROUP_G1)) && block->modal.motion > MOTION_MODE_CCW_ARC);
+}
+
+static float dist(const float a[2], const float b[2]) {
+  return hypot_f(a[0] - b[0], a[1] - b[1]);
+}
+
+static const float *entry(const reorder_unit_t *u, int reversed) {
+  return reversed ? u->stop : u->start;
+}
+
+static const float *leave(const reorder_unit_t *u, int reversed) {
+  return reversed ? u->start : u->stop;
+}
+
+// return value: -1 if out of memory
+static int open_unit(reorder_state_t *state, size_t first) {
+  if (state->nunits == state->units_size) {
+    size_t size = state->units_size ? 2 * state->units_size : 64;
+    reorder_unit_t *units = realloc(state->units, size * sizeof(reorder_unit_t));
+    if (!units)
+      return -1;
+    state->units = units;
+    state->units_size = size;
+  }
+  reorder_unit_t *u = &state->units[state->nunits++];
+  u->first = first;
+  u->cut = u->end = SIZE_MAX;
+  u->reversible = 1;
+  u->travels = 0;
+  return 0;
+}
+
+// Follows block, and writes out the modal state and position its moves
+// depend on, so that it means the same wherever it ends up
+static uint8_t follow(reorder_state_t *state, parser_block_t *block, float from[3]) {
+  memcpy(from, state->values.xyz, sizeof(state->values.xyz));
+  parser_block_t b = *block; // update_state() drops words that are in effect already
+  update_state(&state->modal, &state->values, &b);
+
+  const uint16_t axes = bit(WORD_X) | bit(WORD_Y) | bit(WORD_Z);
+  if (!(block->value_words & axes))
+    return REORDER_OTHER;
+
+  uint8_t motion = state->modal.motion;
+  block->command_words |= bit(MODAL_GROUP_G1);
+  block->modal.motion = motion;
+  if (motion != MOTION_MODE_SEEK) {
+    block->value_words |= bit(WORD_F);
+    block->values.f = state->values.f;
+  }
+  if (state->laser) {
+    block->value_words |= bit(WORD_S);
+    block->values.s = state->values.s;
+    block->command_words |= bit(MODAL_GROUP_M7);
+    block->modal.spindle = state->modal.spindle;
+  }
+
+  const float *to = state->values.xyz;
+  if (!(block->value_words & (bit(WORD_X) | bit(WORD_Y))))
+    return REORDER_OTHER;
+  if (to[0] == from[0] && to[1] == from[1] && !is_arc(motion)) {
+    // Would move to where the block was, wherever it ends up
+    block->value_words &= ~(bit(WORD_X) | bit(WORD_Y));
+    return REORDER_OTHER;
+  }
+  block->value_words |= bit(WORD_X) | bit(WORD_Y);
+  block->values.xyz[0] = to[0];
+  block->values.xyz[1] = to[1];
+
+  int cut = state->laser ?
+    motion != MOTION_MODE_SEEK && state->values.s != 0 && state->modal.spindle != SPINDLE_DISABLE :
+    from[2] < 0 && to[2] < 0;
+  return cut ? REORDER_CUT : REORDER_TRAVEL;
+}
+
+// Adds a block to the current unit, or starts a new one
+// return value: -1 if out of memory
+static int add_block(reorder_state_t *state, const parser_block_t *block,
+		     const float from[3], uint8_t kind) {
+  if (state->nblocks == state->size) {
+    size_t size = state->size ? 2 * state->size : 256;
+    reorder_block_t *blocks = realloc(state->blocks, size * sizeof(reorder_block_t));
+    if (!blocks)
+      return -1;
+    state->blocks = blocks;
+    state->size = size;
+  }
+  size_t i = state->nblocks++;
+  reorder_block_t *rb = &state->blocks[i];
+  rb->block = *block;
+  memcpy(rb->from, from, sizeof(rb->from));
+  rb->kind = kind;
+
+  if (!state->nunits && open_unit(state, 0) < 0)
+    return -1;
+  reorder_unit_t *u = &state->units[state->nunits - 1];
+
+  switch (kind) {
+  case REORDER_TRAVEL:
+    if (state->in_cut) {
+      // The contour ended with the last cutting block; what came after
+      // it leads to the next one
+      u->end = state->pending;
+      if (open_unit(state, state->pending) < 0)
+	return -1;
+      u = &state->units[state->nunits - 1];
+      state->in_cut = 0;
+    }
+    u->travels = 1;
+    break;
+  case REORDER_CUT:
+    if (!state->in_cut) {
+      u->cut = i;
+      u->start[0] = from[0];
+      u->start[1] = from[1];
+      state->in_cut = 1;
+    } else if (state->pending != i) {
+      u->reversible = 0; // something between the cuts
+    }
+    if (is_arc(state->modal.motion) && state->modal.plane_select != PLANE_SELECT_XY)
+      u->reversible = 0;
+    u->stop[0] = state->values.xyz[0];
+    u->stop[1] = state->values.xyz[1];
+    state->pending = i + 1;
+    break;
+  }
+  return 0;
+}
+
+// Nearest neighbour search over the ends of the contours not visited
+// yet. Point p is the start of contour p / 2 if p is even, its end if
+// odd.
+typedef struct {
+  float x0, y0;   // Corner of the grid
+  float cell;     // Cell size
+  int nx, ny;
+  size_t *start;  // Items of cell c are items[start[c]] to items[start[c] + count[c] - 1]
+  size_t *count;
+  size_t *items;
+  size_t *pos;    // Index of point p in items, SIZE_MAX for points not in the grid
+} grid_t;
+
+static const float *point(const reorder_unit_t *units, size_t p) {
+  return entry(&units[p / 2], p & 1);
+}
+
+static int cell_of(const grid_t *g, const float xy[2]) {
+  int cx = (xy[0] - g->x0) / g->cell;
+  int cy = (xy[1] - g->y0) / g->cell;
+  cx = cx < 0 ? 0 : cx >= g->nx ? g->nx - 1 : cx;
+  cy = cy < 0 ? 0 : cy >= g->ny ? g->ny - 1 : cy;
+  return cy * g->nx + cx;
+}
+
+static void grid_free(grid_t *g) {
+  free(g->start);
+  free(g->count);
+  free(g->items);
+  free(g->pos);
+}
+
+// return value: -1 if out of memory
+static int grid_init(grid_t *g, const reorder_unit_t *units, size_t n) {
+  float lo[2] = { INFINITY, INFINITY }, hi[2] = { -INFINITY, -INFINITY };
+  size_t npoints = 0;
+  for (size_t u = 0; u < n; u++)
+    for (int r = 0; r < 1 + units[u].reversible; r++) {
+      const float *xy = entry(&units[u], r);
+      for (int i = 0; i < 2; i++) {
+	lo[i] = fminf(lo[i], xy[i]);
+	hi[i] = fmaxf(hi[i], xy[i]);
+      }
+      npoints++;
+    }
+
+  // About two points to a cell
+  float side = fmaxf(hi[0] - lo[0], hi[1] - lo[1]);
+  float cells = ceilf(sqrtf(npoints / 2.f));
+  g->x0 = lo[0];
+  g->y0 = lo[1];
+  g->cell = side > 0 ? side / cells : 1;
+  g->nx = (int)((hi[0] - lo[0]) / g->cell) + 1;
+  g->ny = (int)((hi[1] - lo[1]) / g->cell) + 1;
+
+  size_t ncells = (size_t)g->nx * g->ny;
+  g->start = calloc(ncells, sizeof(size_t));
+  g->count = calloc(ncells, sizeof(size_t));
+  g->items = malloc(npoints * sizeof(size_t));
+  g->pos = malloc(2 * n * sizeof(size_t));
+  if (!g->start || !g->count || !g->items || !g->pos) {
+    grid_free(g);
+    return -1;
+  }
+
+  for (size_t p = 0; p < 2 * n; p++)
+    if (!(p & 1) || units[p / 2].reversible)
+      g->count[cell_of(g, point(units, p))]++;
+  for (size_t c = 1; c < ncells; c++)
+    g->start[c] = g->start[c - 1] + g->count[c - 1];
+  memset(g->count, 0, ncells * sizeof(size_t));
+  for (size_t p = 0; p < 2 * n; p++) {
+    g->pos[p] = SIZE_MAX;
+    if (!(p & 1) || units[p / 2].reversible) {
+      int c = cell_of(g, point(units, p));
+      g->pos[p] = g->start[c] + g->count[c]++;
+      g->items[g->pos[p]] = p;
+    }
+  }
+  return 0;
+}
+
+static void grid_remove(grid_t *g, const reorder_unit_t *units, size_t p) {
+  if (g->pos[p] == SIZE_MAX)
+    return;
+  int c = cell_of(g, point(units, p));
+  size_t last = g->start[c] + --g->count[c];
+  size_t q = g->items[last];
+  g->items[g->pos[p]] = q;
+  g->pos[q] = g->pos[p];
+  g->items[last] = p;
+  g->pos[p] = SIZE_MAX;
+}
+
+// return value: the point nearest to xy, SIZE_MAX if there are none left
+static size_t grid_nearest(const grid_t *g, const reorder_unit_t *units, const float xy[2]) {
+  int c = cell_of(g, xy);
+  int cx = c % g->nx, cy = c / g->nx;
+  size_t best = SIZE_MAX;
+  float best_d = INFINITY;
+
+  int rings = g->nx > g->ny ? g->nx : g->ny;
+  for (int r = 0; r < rings; r++) {
+    for (int y = cy - r; y <= cy + r; y++) {
+      if (y < 0 || y >= g->ny)
+	continue;
+      // Only the edge of the square on rows other than the top and bottom
+      int step = y == cy - r || y == cy + r ? 1 : 2 * r;
+      for (int x = cx - r; x <= cx + r; x += step) {
+	if (x < 0 || x >= g->nx)
+	  continue;
+	size_t cell = (size_t)y * g->nx + x;
+	for (size_t i = 0; i < g->count[cell]; i++) {
+	  size_t p = g->items[g->start[cell] + i];
+	  float d = dist(xy, point(units, p));
+	  if (d < best_d) {
+	    best_d = d;
+	    best = p;
+	  }
+	}
+      }
+    }
+    // Points in the next ring are at least r cells away
+    if (best != SIZE_MAX && best_d <= r * g->cell)
+      break;
+  }
+  return best;
+}
+
+// Straight-line travel from pos0 through n contours in the given order,
+// measured a batch of moves at a time with the vector kernel
+static double travel(const reorder_unit_t *units, const size_t *tour,
+		     const unsigned char *reversed, size_t n, const float pos0[2]) {
+  float dx[REORDER_LENGTHS], dy[REORDER_LENGTHS], len[REORDER_LENGTHS];
+  double d = 0;
+  const float *at = pos0;
+  for (size_t i = 0; i < n; ) {
+    size_t m = 0;
+    for (; m < REORDER_LENGTHS && i < n; m++, i++) {
+      const reorder_unit_t *u = &units[tour[i]];
+      const float *to = entry(u, reversed[i]);
+      dx[m] = at[0] - to[0]; // as dist() has it
+      dy[m] = at[1] - to[1];
+      at = leave(u, reversed[i]);
+    }
+    geom_lengths(m, dx, dy, len);
+    for (size_t k = 0; k < m; k++)
+      d += len[k];
+  }
+  return d;
+}
+
+// Orders contours 0 to n - 1 by nearest neighbour from pos0, then
+// improves the order with 2-opt. The first contour stays first if first
+// is set, and the last one last if last is.
+// return value: -1 if out of memory
+static int plan_tour(const reorder_unit_t *units, size_t n, int first, int last,
+		     const float pos0[2], size_t *tour, unsigned char *reversed) {
+  grid_t g;
+  if (grid_init(&g, units, n) < 0)
+    return -1;
+  if (last) {
+    grid_remove(&g, units, 2 * (n - 1));
+    grid_remove(&g, units, 2 * (n - 1) + 1);
+  }
+
+  const float *at = pos0;
+  for (size_t i = 0; i < n; i++) {
+    size_t p = i == 0 && first ? 0 :
+      i == n - 1 && last ? 2 * (n - 1) : grid_nearest(&g, units, at);
+    tour[i] = p / 2;
+    reversed[i] = p & 1;
+    grid_remove(&g, units, p & ~(size_t)1);
+    grid_remove(&g, units, p | 1);
+    at = leave(&units[tour[i]], reversed[i]);
+  }
+  grid_free(&g);
+
+  // 2-opt: reversing the run of contours i to j only changes the travel
+  // into i and out of j
+  for (int pass = 0; pass < REORDER_PASSES; pass++) {
+    int improved = 0;
+    for (size_t i = first; i < n - last; i++) {
+      const float *before = i ? leave(&units[tour[i - 1]], reversed[i - 1]) : pos0;
+      for (size_t j = i; j < n - last && j < i + REORDER_WINDOW; j++) {
+	if (!units[tour[j]].reversible)
+	  break;
+	const float *a = entry(&units[tour[i]], reversed[i]);
+	const float *b = leave(&units[tour[j]], reversed[j]);
+	const float *after = j + 1 < n ? entry(&units[tour[j + 1]], reversed[j + 1]) : NULL;
+	float old_d = dist(before, a) + (after ? dist(b, after) : 0);
+	float new_d = dist(before, b) + (after ? dist(a, after) : 0);
+	if (new_d < old_d - 1e-4f) {
+	  for (size_t k = i, l = j; k <= l && l != SIZE_MAX; k++, l--) {
+	    size_t t = tour[k];
+	    unsigned char r = reversed[k];
+	    tour[k] = tour[l];
+	    reversed[k] = !reversed[l];
+	    tour[l] = t;
+	    reversed[l] = !r;
+	  }
+	  improved = 1;
+	}
+      }
+    }
+    if (!improved)
+      break;
+  }
+  return 0;
+}
+
+// Pushes rb run backwards, from where it ended to where it started
+static int push_reversed(const reorder_block_t *rb, block_ring_t *out) {
+  parser_block_t *b = block_ring_push(out);
+  if (!b)
+    return -1;
+  *b = rb->block;
+  if (is_arc(b->modal.motion)) {
+    if (!(b->value_words & bit(WORD_R))) {
+      // Same center, seen from the other end
+      for (int i = 0; i < 2; i++)
+	b->values.ijk[i] = rb->from[i] + rb->block.values.ijk[i] - rb->block.values.xyz[i];
+      b->value_words |= bit(WORD_I) | bit(WORD_J);
+    }
+    b->modal.motion = b->modal.motion == MOTION_MODE_CW_ARC ?
+      MOTION_MODE_CCW_ARC : MOTION_MODE_CW_ARC;
+  }
+  b->values.xyz[0] = rb->from[0];
+  b->values.xyz[1] = rb->from[1];
+  if (b->value_words & bit(WORD_Z))
+    b->values.xyz[2] = rb->from[2];
+  return 0;
+}
+
+// Pushes blocks from to the end of unit u, with the travel going to
+// where the contour starts when run forwards or reversed. If the
+// contours were reordered, travel along an arc goes in a straight line
+// instead, as it may start and end elsewhere than its center was for.
+// return value: Number of blocks pushed, -1 if out couldn't grow
+static int push_unit(const reorder_state_t *state, const reorder_unit_t *u, size_t from,
+		     int reversed, int reordered, block_ring_t *out) {
+  const float *start = entry(u, reversed);
+  for (size_t i = from; i < u->cut; i++) {
+    parser_block_t *b = block_ring_push(out);
+    if (!b)
+      return -1;
+    *b = state->blocks[i].block;
+    if (state->blocks[i].kind == REORDER_TRAVEL) {
+      b->values.xyz[0] = start[0];
+      b->values.xyz[1] = start[1];
+      if (reordered && is_arc(b->modal.motion)) {
+	b->modal.motion = MOTION_MODE_LINEAR;
+	b->value_words &= ~(bit(WORD_R) | bit(WORD_I) | bit(WORD_J) | bit(WORD_K));
+      }
+    }
+  }
+  for (size_t i = u->cut; i < u->end; i++) {
+    if (reversed) {
+      if (push_reversed(&state->blocks[u->end - 1 - (i - u->cut)], out) < 0)
+	return -1;
+    } else if (block_ring_push_copy(out, &state->blocks[i].block) < 0) {
+      return -1;
+    }
+  }
+  return u->end - from;
+}
+
+static int push_blocks(const reorder_state_t *state, size_t from, size_t end, block_ring_t *out) {
+  for (size_t i = from; i < end; i++)
+    if (block_ring_push_copy(out, &state->blocks[i].block) < 0)
+      return -1;
+  return end - from;
+}
+
+// Pushes the blocks held back, reordered. Unless this is the end of the
+// file, the blocks after them may start where the last contour ends, so
+// it stays last if there is no travel move after it.
+// return value: Number of blocks pushed, -1 if out couldn't grow
+static int push_all(reorder_state_t *state, block_ring_t *out, int at_end) {
+  // Contours are units[0] to units[n - 1]. What comes after the last one
+  // stays at the end.
+  size_t n = state->nunits;
+  size_t tail = state->pending;
+  int last = !at_end;
+  if (n && state->units[n - 1].cut == SIZE_MAX) {
+    tail = state->units[--n].first;
+    last = last && !state->units[n].travels;
+  } else if (n) {
+    state->units[n - 1].end = state->pending;
+  }
+
+  int pushed;
+  if (!n) {
+    pushed = push_blocks(state, 0, state->nblocks, out);
+    start_blocks(state);
+    return pushed;
+  }
+
+  // Blocks before the first move set the machine up, and stay first.
+  // Without a travel move the first contour can only start where it
+  // does, so it stays first as well.
+  const reorder_unit_t *u0 = &state->units[0];
+  const uint16_t axes = bit(WORD_X) | bit(WORD_Y) | bit(WORD_Z);
+  size_t head = u0->first;
+  while (head < u0->cut && !(state->blocks[head].block.value_words & axes))
+    head++;
+  int first = !u0->travels;
+
+  size_t *tour = malloc(n * sizeof(size_t));
+  size_t *given = malloc(n * sizeof(size_t));
+  unsigned char *reversed = malloc(2 * n);
+  if (!tour || !given || !reversed ||
+      plan_tour(state->units, n, first, last, state->pos0, tour, reversed) < 0) {
+    free(tour);
+    free(given);
+    free(reversed);
+    return -1;
+  }
+
+  // Keep the order given if the tour isn't any shorter
+  unsigned char *forward = reversed + n;
+  for (size_t i = 0; i < n; i++) {
+    given[i] = i;
+    forward[i] = 0;
+  }
+  double d_in = travel(state->units, given, forward, n, state->pos0);
+  double d_out = travel(state->units, tour, reversed, n, state->pos0);
+  int reordered = d_out < d_in;
+  if (!reordered) {
+    memcpy(tour, given, n * sizeof(size_t));
+    memset(reversed, 0, n);
+    d_out = d_in;
+  }
+  state->contours += n;
+  state->travel_in += d_in;
+  state->travel_out += d_out;
+
+  pushed = push_blocks(state, 0, head, out);
+  for (size_t i = 0; i < n && pushed >= 0; i++) {
+    const reorder_unit_t *u = &state->units[tour[i]];
+    int k = push_unit(state, u, u == u0 ? head : u->first, reversed[i], reordered, out);
+    pushed = k < 0 ? -1 : pushed + k;
+  }
+  if (pushed >= 0) {
+    int k = push_blocks(state, tail, state->nblocks, out);
+    pushed = k < 0 ? -1 : pushed + k;
+  }
+
+  free(tour);
+  free(given);
+  free(reversed);
+  start_blocks(state);
+  return pushed;
+}
+
+int reorder_flush(reorder_state_t *state, block_ring_t *out) {
+  return push_all(state, out, 1);
+}
+
+int reorder(reorder_state_t *state, parser_block_t *block, block_ring_t *out) {
+  float from[3];
+  if (block_is_text(block))
+    return add_block(state, block, state->values.xyz, REORDER_OTHER);
+
+  if (barrier(block)) {
+    int pushed = push_all(state, out, 0);
+    if (pushed < 0)
+      return -1;
+    parser_block_t b = *block;
+    follow(state, &b, from);
+    if (block_ring_push_copy(out, block) < 0)
+      return -1;
+    start_blocks(state);
+    return pushed + 1;
+  }
+
+  uint8_t kind = follow(state, block, from);
+  return add_block(state, block, from, kind);
+}
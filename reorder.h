@@ -0,0 +1,78 @@
+#ifndef REORDER_H
+#define REORDER_H
+
+#include "gcode.h"
+#include "pipeline.h"
+
+// Reorders the cut paths of a whole file to shorten the travel between
+// them. The blocks are split into contours at laser-off (laser mode) or
+// knife-up (drag knife mode) moves, and the contours are put in the
+// order a nearest neighbour tour improved by 2-opt finds, reversed where
+// that makes the travel shorter and the contour is nothing but cutting
+// moves. Each contour takes the travel moves leading to it along, with
+// their xy target moved to wherever it now starts.
+//
+// Blocks that change what later blocks mean (G4, G10, G28, G53, G92,
+// plane, units, distance or coordinate system changes, program stops)
+// are left in place, and the contours are only reordered between them.
+// Blocks must be absolute and in mm.
+
+// What a block does, as far as reordering goes
+#define REORDER_OTHER 0  // Doesn't move in xy
+#define REORDER_TRAVEL 1 // Moves in xy without cutting
+#define REORDER_CUT 2    // Moves in xy cutting
+
+typedef struct {
+  parser_block_t block;
+  float from[3];  // Position before the block
+  uint8_t kind;   // REORDER_*
+} reorder_block_t;
+
+// A contour, with the blocks leading to it
+typedef struct {
+  size_t first;   // First block, where the travel to the contour begins
+  size_t cut;     // First cutting block, or SIZE_MAX before there is one
+  size_t end;     // One past the last cutting block
+  float start[2]; // Where the contour starts and ends
+  float stop[2];
+  int reversible; // Nothing but cutting moves
+  int travels;    // Has a travel block to take to the new start
+} reorder_unit_t;
+
+typedef struct {
+  int laser;      // Cutting is laser on, otherwise knife down (z < 0)
+  gc_modal_t modal;
+  gc_values_t values;
+
+  // Blocks since the last block that can't be moved
+  reorder_block_t *blocks;
+  size_t nblocks;
+  size_t size;
+  reorder_unit_t *units;
+  size_t nunits;
+  size_t units_size;
+  int in_cut;     // The last block that moved cut
+  size_t pending; // One past the last cutting block of the last unit
+  float pos0[2];  // Where the blocks start
+
+  unsigned long contours; // Contours reordered
+  double travel_in;       // Straight-line travel between them (mm), as
+  double travel_out;      // given and after reordering
+} reorder_state_t;
+
+// laser: split contours the way laser mode cuts, otherwise the way the
+// drag knife does
+void reorder_init(reorder_state_t *state, int laser);
+
+// Holds block back until the end of the file, or until a block that
+// can't be moved
+// return value: Number of blocks pushed, -1 if out of memory
+int reorder(reorder_state_t *state, parser_block_t *block, block_ring_t *out);
+
+// Pushes the blocks held back, reordered
+// return value: Number of blocks pushed, -1 if out couldn't grow
+int reorder_flush(reorder_state_t *state, block_ring_t *out);
+
+void reorder_free(reorder_state_t *state);
+
+#endif
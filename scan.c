@@ -0,0 +1,331 @@
+#include <string.h>
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+// Runs the filter state machine over [p, end), appending to line from
+// count on. Also used by the vector versions to finish a line once it
+// is about to overflow.
+
+static uint8_t scan_finish(const unsigned char *p, const unsigned char *end,
+			   char *line, size_t count, uint8_t line_flags) {
+  for (; p < end; p++) {
+    unsigned char c = *p;
+
+    if (line_flags) {
+      // Throw away all (except EOL) comment characters and overflow characters.
+      if (c == ')') {
+	// End of '()' comment. Resume line allowed.
+	if (line_flags & LINE_FLAG_COMMENT_PARENTHESES) { line_flags &= ~(LINE_FLAG_COMMENT_PARENTHESES); }
+      }
+    } else {
+      if (c <= ' ') {
+	// Throw away whitepace and control characters
+      } else if (c == '/') {
+	// Block delete NOT SUPPORTED. Ignore character.
+	// NOTE: If supported, would simply need to check the system if block delete is enabled.
+      } else if (c == '(') {
+	// Enable comments flag and ignore all characters until ')' or EOL.
+	// NOTE: This doesn't follow the NIST definition exactly, but is good enough for now.
+	// In the future, we could simply remove the items within the comments, but retain the
+	// comment control characters, so that the g-code parser can error-check it.
+	line_flags |= LINE_FLAG_COMMENT_PARENTHESES;
+      } else if (c == ';') {
+	// NOTE: ';' comment to EOL is a LinuxCNC definition. Not NIST.
+	line_flags |= LINE_FLAG_COMMENT_SEMICOLON;
+	// TODO: Install '%' feature
+	// } else if (c == '%') {
+	// Program start-end percent sign NOT SUPPORTED.
+	// NOTE: This maybe installed to tell Grbl when a program is running vs manual input,
+	// where, during a program, the system auto-cycle start will continue to execute
+	// everything until the next '%' sign. This will help fix resuming issues with certain
+	// functions that empty the planner buffer to execute its task on-time.
+      } else if (count >= (LINE_BUFFER_SIZE-1)) {
+	// Detect line buffer overflow and set flag.
+	line_flags |= LINE_FLAG_OVERFLOW;
+      } else if (c >= 'a' && c <= 'z') { // Upcase lowercase
+	line[count++] = c-'a'+'A';
+      } else {
+	line[count++] = c;
+      }
+    }
+  }
+
+  line[count] = 0; // Set string termination character.
+  return line_flags;
+}
+
+uint8_t scan_line_scalar(const char *src, size_t len, char *line) {
+  const unsigned char *p = (const unsigned char *) src;
+  return scan_finish(p, p + len, line, 0, 0);
+}
+
+static const char *scan_eol_scalar(const char *p, const char *end) {
+  while (p < end && *p != '\n' && *p != '\r')
+    p++;
+  return p;
+}
+
+#ifdef SCAN_X86
+
+// The vector versions handle one chunk of 16 or 32 bytes per step. In
+// the normal state, bytes before the first '(' or ';' of the chunk are
+// filtered and compacted in one go. Inside a '()' comment, the chunk is
+// only searched for ')'. A ';' ends the line. The last partial chunk is
+// copied to a zero padded buffer, so nothing is read past src + len.
+
+static inline __m128i upcase_sse2(__m128i x) {
+  __m128i t = _mm_sub_epi8(x, _mm_set1_epi8('a'));
+  __m128i lower = _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(25)), t);
+  return _mm_sub_epi8(x, _mm_and_si128(lower, _mm_set1_epi8(0x20)));
+}
+
+static inline uint32_t drop_mask_sse2(__m128i x) {
+  __m128i ctl = _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(' ')), x); // x <= ' '
+  __m128i slash = _mm_cmpeq_epi8(x, _mm_set1_epi8('/'));
+  return _mm_movemask_epi8(_mm_or_si128(ctl, slash));
+}
+
+static inline uint32_t stop_mask_sse2(__m128i x) {
+  __m128i open = _mm_cmpeq_epi8(x, _mm_set1_epi8('('));
+  __m128i semi = _mm_cmpeq_epi8(x, _mm_set1_epi8(';'));
+  return _mm_movemask_epi8(_mm_or_si128(open, semi));
+}
+
+static inline uint32_t close_mask_sse2(__m128i x) {
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_set1_epi8(')')));
+}
+
+static uint8_t scan_line_sse2(const char *src, size_t len, char *line) {
+  const unsigned char *p = (const unsigned char *) src;
+  const unsigned char *end = p + len;
+  unsigned char tail[16];
+  size_t count = 0;
+  uint8_t line_flags = 0;
+
+  while (p < end) {
+    const unsigned char *chunk = p;
+    size_t n = end - p;
+    if (n < 16) {
+      memset(tail, 0, sizeof(tail));
+      memcpy(tail, p, n);
+      chunk = tail;
+    } else {
+      n = 16;
+    }
+    uint32_t valid = (n == 16) ? 0xffff : (1u << n) - 1;
+    __m128i x = _mm_loadu_si128((const __m128i *) chunk);
+
+    if (line_flags) { // inside '()'
+      uint32_t close = close_mask_sse2(x) & valid;
+      if (!close) {
+	p += n;
+	continue;
+      }
+      line_flags = 0;
+      p += __builtin_ctz(close) + 1;
+      continue;
+    }
+
+    uint32_t stop = stop_mask_sse2(x) & valid;
+    uint32_t keep = ~drop_mask_sse2(x) & (stop ? (stop & -stop) - 1 : valid);
+    size_t nkeep = __builtin_popcount(keep);
+    if (count + nkeep > LINE_BUFFER_SIZE - 1)
+      return scan_finish(p, end, line, count, line_flags);
+
+    __m128i up = upcase_sse2(x);
+    if (keep == 0xffff) {
+      _mm_storeu_si128((__m128i *) (line + count), up);
+    } else if (keep) {
+      unsigned char tmp[16];
+      _mm_storeu_si128((__m128i *) tmp, up);
+      char *dst = line + count;
+      do {
+	*dst++ = tmp[__builtin_ctz(keep)];
+	keep &= keep - 1;
+      } while (keep);
+    }
+    count += nkeep;
+
+    if (stop) {
+      int i = __builtin_ctz(stop);
+      if (chunk[i] == ';') {
+	line_flags = LINE_FLAG_COMMENT_SEMICOLON; // rest of line is ignored
+	break;
+      }
+      line_flags = LINE_FLAG_COMMENT_PARENTHESES;
+      p += i + 1;
+      continue;
+    }
+    p += n;
+  }
+
+  line[count] = 0;
+  return line_flags;
+}
+
+static const char *scan_eol_sse2(const char *p, const char *end) {
+  const __m128i nl = _mm_set1_epi8('\n');
+  const __m128i cr = _mm_set1_epi8('\r');
+  for (; end - p >= 16; p += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *) p);
+    uint32_t m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, nl), _mm_cmpeq_epi8(x, cr)));
+    if (m)
+      return p + __builtin_ctz(m);
+  }
+  return scan_eol_scalar(p, end);
+}
+
+// pshufb controls that move the bytes selected by an 8 bit mask to the
+// front of an 8 byte group. Unused positions are 0x80.
+static uint64_t compact_table[256];
+
+#define AVX2_TARGET __attribute__((target("avx2,popcnt,bmi")))
+
+AVX2_TARGET
+static inline char *compact16_avx2(char *dst, __m128i x, uint32_t keep) {
+  uint32_t m0 = keep & 0xff;
+  uint32_t m1 = (keep >> 8) & 0xff;
+  __m128i ctl = _mm_set_epi64x(compact_table[m1] + 0x0808080808080808ull, compact_table[m0]);
+  __m128i r = _mm_shuffle_epi8(x, ctl);
+  _mm_storel_epi64((__m128i *) dst, r);
+  dst += __builtin_popcount(m0);
+  _mm_storel_epi64((__m128i *) dst, _mm_srli_si128(r, 8));
+  return dst + __builtin_popcount(m1);
+}
+
+AVX2_TARGET
+static uint8_t scan_line_avx2(const char *src, size_t len, char *line) {
+  const unsigned char *p = (const unsigned char *) src;
+  const unsigned char *end = p + len;
+  unsigned char tail[32];
+  size_t count = 0;
+  uint8_t line_flags = 0;
+
+  const __m256i sp = _mm256_set1_epi8(' ');
+  const __m256i slash = _mm256_set1_epi8('/');
+  const __m256i open = _mm256_set1_epi8('(');
+  const __m256i close = _mm256_set1_epi8(')');
+  const __m256i semi = _mm256_set1_epi8(';');
+  const __m256i a = _mm256_set1_epi8('a');
+  const __m256i z = _mm256_set1_epi8(25);
+  const __m256i caps = _mm256_set1_epi8(0x20);
+
+  while (p < end) {
+    const unsigned char *chunk = p;
+    size_t n = end - p;
+    if (n < 32) {
+      memset(tail, 0, sizeof(tail));
+      memcpy(tail, p, n);
+      chunk = tail;
+    } else {
+      n = 32;
+    }
+    uint32_t valid = (n == 32) ? 0xffffffffu : (1u << n) - 1;
+    __m256i x = _mm256_loadu_si256((const __m256i *) chunk);
+
+    if (line_flags) { // inside '()'
+      uint32_t m = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, close)) & valid;
+      if (!m) {
+	p += n;
+	continue;
+      }
+      line_flags = 0;
+      p += __builtin_ctz(m) + 1;
+      continue;
+    }
+
+    uint32_t stop = (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(x, open),
+								     _mm256_cmpeq_epi8(x, semi))) & valid;
+    __m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(x, sp), x);
+    uint32_t drop = (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(ctl, _mm256_cmpeq_epi8(x, slash)));
+    uint32_t keep = ~drop & (stop ? (stop & -stop) - 1 : valid);
+    size_t nkeep = __builtin_popcount(keep);
+    if (count + nkeep > LINE_BUFFER_SIZE - 1)
+      return scan_finish(p, end, line, count, line_flags);
+
+    __m256i t = _mm256_sub_epi8(x, a);
+    __m256i lower = _mm256_cmpeq_epi8(_mm256_min_epu8(t, z), t);
+    __m256i up = _mm256_sub_epi8(x, _mm256_and_si256(lower, caps));
+
+    if (keep == 0xffffffffu) {
+      _mm256_storeu_si256((__m256i *) (line + count), up);
+    } else if (keep) {
+      char *dst = line + count;
+      dst = compact16_avx2(dst, _mm256_castsi256_si128(up), keep & 0xffff);
+      compact16_avx2(dst, _mm256_extracti128_si256(up, 1), keep >> 16);
+    }
+    count += nkeep;
+
+    if (stop) {
+      int i = __builtin_ctz(stop);
+      if (chunk[i] == ';') {
+	line_flags = LINE_FLAG_COMMENT_SEMICOLON; // rest of line is ignored
+	break;
+      }
+      line_flags = LINE_FLAG_COMMENT_PARENTHESES;
+      p += i + 1;
+      continue;
+    }
+    p += n;
+  }
+
+  line[count] = 0;
+  return line_flags;
+}
+
+AVX2_TARGET
+static const char *scan_eol_avx2(const char *p, const char *end) {
+  const __m256i nl = _mm256_set1_epi8('\n');
+  const __m256i cr = _mm256_set1_epi8('\r');
+  for (; end - p >= 32; p += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *) p);
+    uint32_t m = (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(x, nl),
+								  _mm256_cmpeq_epi8(x, cr)));
+    if (m)
+      return p + __builtin_ctz(m);
+  }
+  return scan_eol_sse2(p, end);
+}
+
+static uint8_t (*scan_line_impl)(const char *, size_t, char *) = scan_line_sse2;
+static const char *(*scan_eol_impl)(const char *, const char *) = scan_eol_sse2;
+
+__attribute__((constructor))
+static void scan_init(void) {
+  for (int m = 0; m < 256; m++) {
+    uint64_t ctl = 0x8080808080808080ull;
+    int n = 0;
+    for (int i = 0; i < 8; i++)
+      if (m & (1 << i)) {
+	ctl &= ~(0xffull << (8 * n));
+	ctl |= (uint64_t) i << (8 * n);
+	n++;
+      }
+    compact_table[m] = ctl;
+  }
+
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    scan_line_impl = scan_line_avx2;
+    scan_eol_impl = scan_eol_avx2;
+  }
+}
+
+#else
+
+static uint8_t (*scan_line_impl)(const char *, size_t, char *) = scan_line_scalar;
+static const char *(*scan_eol_impl)(const char *, const char *) = scan_eol_scalar;
+
+#endif
+
+uint8_t scan_line(const char *src, size_t len, char *line) {
+  return scan_line_impl(src, len, line);
+}
+
+const char *scan_eol(const char *p, const char *end) {
+  return scan_eol_impl(p, end);
+}
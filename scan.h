@@ -0,0 +1,32 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LINE_BUFFER_SIZE 1024
+// Extra bytes after LINE_BUFFER_SIZE that scan_line may scribble on
+#define LINE_BUFFER_PADDING 32
+
+#define LINE_FLAG_OVERFLOW 1
+#define LINE_FLAG_COMMENT_PARENTHESES 2
+#define LINE_FLAG_COMMENT_SEMICOLON 4
+
+// Finds the first '\n' or '\r' in [p, end)
+// return value: pointer to it, or end if there is none
+const char *scan_eol(const char *p, const char *end);
+
+// Performs the initial filtering of one input line: removes spaces,
+// control characters, block delete and comments, and capitalizes all
+// letters. src holds len bytes without the line terminator. The result
+// is written to line, NUL terminated, which must have room for
+// LINE_BUFFER_SIZE + LINE_BUFFER_PADDING bytes.
+// Uses SSE2 or AVX2, whichever the CPU supports.
+// return value: line flags at the end of the line. LINE_FLAG_OVERFLOW
+// means the filtered line didn't fit and its contents are undefined.
+uint8_t scan_line(const char *src, size_t len, char *line);
+
+// Reference implementation of scan_line, one character at a time
+uint8_t scan_line_scalar(const char *src, size_t len, char *line);
+
+#endif
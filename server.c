@@ -0,0 +1,85 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "server.h"
+
+// Connections waiting to be accepted
+#define SERVER_BACKLOG 64
+
+typedef struct {
+  int fd;
+  server_handler_t handler;
+  void *arg;
+} server_t;
+
+static void *worker(void *arg) {
+  server_t *s = arg;
+  void *slot = NULL;
+
+  // accept() on a shared socket hands each connection to one worker
+  for (;;) {
+    int fd = accept(s->fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EINTR && errno != ECONNABORTED)
+	perror("accept");
+      continue;
+    }
+    s->handler(s->arg, &slot, fd);
+    close(fd);
+  }
+  return NULL;
+}
+
+int serve(const char *path, int workers, server_handler_t handler, void *arg) {
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  // Only a socket left over from an earlier run is replaced
+  struct stat st;
+  if (lstat(path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      errno = EEXIST;
+      return -1;
+    }
+    unlink(path);
+  }
+
+  static server_t s;
+  s.handler = handler;
+  s.arg = arg;
+  s.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s.fd < 0)
+    return -1;
+  if (bind(s.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(s.fd, SERVER_BACKLOG) < 0) {
+    int e = errno;
+    close(s.fd);
+    errno = e;
+    return -1;
+  }
+
+  // A client that goes away mid-response must not take the server down
+  signal(SIGPIPE, SIG_IGN);
+
+  for (int i = 1; i < workers; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, worker, &s) != 0)
+      break;
+    pthread_detach(thread);
+  }
+  worker(&s);
+  return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+// Serves connections on a Unix domain socket with a fixed set of worker
+// threads. Each worker takes one connection at a time and keeps a slot
+// of its own from one connection to the next, for buffers and state
+// that are expensive to set up.
+
+// Handles one connection. *slot is NULL on the first call on a worker,
+// and keeps whatever the handler leaves in it. fd is closed by the
+// server when the handler returns.
+typedef void (*server_handler_t)(void *arg, void **slot, int fd);
+
+// Listens on path, replacing any socket file already there (anything
+// else there fails with EEXIST), and serves
+// connections on the given number of threads until the process ends.
+// return value: -1 with errno set if the socket couldn't be set up
+int serve(const char *path, int workers, server_handler_t handler, void *arg);
+
+#endif
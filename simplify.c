@@ -0,0 +1,183 @@
+#include <math.h>
+#include <string.h>
+#include "simplify.h"
+
+void simplify_init(simplify_state_t *state, float tol) {
+  memset(state, 0, sizeof(*state));
+  state->tol = tol;
+}
+
+// Whether b lies on the line from a to c, between them. The cross product
+// of float differences is exact in double, so this loses nothing.
+static int collinear(const float a[3], const float b[3], const float c[3]) {
+  double u[3], v[3];
+  for (int k = 0; k < 3; k++) {
+    u[k] = (double)b[k] - a[k];
+    v[k] = (double)c[k] - b[k];
+  }
+  return u[1] * v[2] == u[2] * v[1] && u[2] * v[0] == u[0] * v[2] &&
+    u[0] * v[1] == u[1] * v[0] && u[0] * v[0] + u[1] * v[1] + u[2] * v[2] > 0;
+}
+
+// Distance from p to the segment from a to b
+static float segment_distance(const float p[3], const float a[3], const float b[3]) {
+  float d[3], w[3];
+  float dd = 0, t = 0;
+  for (int k = 0; k < 3; k++) {
+    d[k] = b[k] - a[k];
+    w[k] = p[k] - a[k];
+    dd += d[k] * d[k];
+    t += d[k] * w[k];
+  }
+  t = dd > 0 ? fminf(fmaxf(t / dd, 0), 1) : 0;
+  float s = 0;
+  for (int k = 0; k < 3; k++) {
+    float e = w[k] - t * d[k];
+    s += e * e;
+  }
+  return sqrtf(s);
+}
+
+// Douglas-Peucker over the vertices idx[0..m], clearing keep[] for those
+// dropped
+static void douglas_peucker(const simplify_state_t *state, const size_t *idx, size_t m,
+			    uint8_t *keep) {
+  const float (*p)[3] = state->pts;
+  size_t stack[SIMPLIFY_MAX_MOVES][2];
+  size_t top = 0;
+  stack[top][0] = 0;
+  stack[top][1] = m;
+  top++;
+  while (top) {
+    top--;
+    size_t a = stack[top][0], b = stack[top][1];
+    if (b - a < 2)
+      continue;
+    size_t worst = 0;
+    float dmax = -1;
+    for (size_t k = a + 1; k < b; k++) {
+      float d = segment_distance(p[idx[k]], p[idx[a]], p[idx[b]]);
+      if (d > dmax) {
+	dmax = d;
+	worst = k;
+      }
+    }
+    if (dmax <= state->tol) {
+      for (size_t k = a + 1; k < b; k++)
+	keep[idx[k]] = 0;
+      continue;
+    }
+    stack[top][0] = a;
+    stack[top][1] = worst;
+    top++;
+    stack[top][0] = worst;
+    stack[top][1] = b;
+    top++;
+  }
+}
+
+// Pushes the run held back, with the vertices dropped that can go
+// return value: Number of blocks pushed, -1 if out couldn't grow
+static int simplify_run(simplify_state_t *state, block_ring_t *out) {
+  const float (*p)[3] = state->pts;
+  size_t n = state->n;
+  uint8_t keep[SIMPLIFY_MAX_MOVES + 1];
+  size_t idx[SIMPLIFY_MAX_MOVES + 1];
+  size_t m = 0;
+
+  // Moves carrying on in the same direction first
+  keep[0] = 1;
+  idx[0] = 0;
+  for (size_t k = 1; k <= n; k++) {
+    keep[k] = (k == n) || !collinear(p[idx[m]], p[k], p[k + 1]);
+    if (keep[k])
+      idx[++m] = k;
+  }
+  if (state->tol > 0)
+    douglas_peucker(state, idx, m, keep);
+
+  int pushed = 0;
+  size_t from = 0;
+  for (size_t k = 1; k <= n; k++) {
+    if (!keep[k])
+      continue;
+    // The first move carries the feed and power words of the run
+    parser_block_t *block = &state->moves[from ? k - 1 : 0];
+    for (int a = 0; a < 3; a++) {
+      block->values.xyz[a] = p[k][a];
+      if (p[k][a] != p[from][a])
+	block->value_words |= bit((WORD_X + a));
+    }
+    if (block_ring_push_copy(out, block) < 0)
+      return -1;
+    state->blocks_out++;
+    pushed++;
+    from = k;
+  }
+
+  memcpy(state->pts[0], state->pts[n], sizeof(state->pts[0]));
+  state->n = 0;
+  return pushed;
+}
+
+int simplify_flush(simplify_state_t *state, block_ring_t *out) {
+  return simplify_run(state, out);
+}
+
+int simplify(simplify_state_t *state, parser_block_t *block, block_ring_t *out) {
+  if (block_is_text(block)) {
+    int pushed = simplify_run(state, out);
+    if (pushed < 0 || block_ring_push_copy(out, block) < 0)
+      return -1;
+    return pushed + 1;
+  }
+
+  float from[3];
+  memcpy(from, state->values.xyz, sizeof(from));
+  parser_block_t b = *block; // update_state() drops words that are in effect already
+  update_state(&state->modal, &state->values, &b);
+  state->blocks_in++;
+
+  const float *to = state->values.xyz;
+  const uint16_t words = bit(WORD_X) | bit(WORD_Y) | bit(WORD_Z) | bit(WORD_F) | bit(WORD_S);
+  // Under G93, F is the time of each move, which merging would change
+  int vertex = state->modal.motion == MOTION_MODE_LINEAR &&
+    state->modal.feed_rate != FEED_RATE_MODE_INVERSE_TIME &&
+    block->non_modal_command == NON_MODAL_NO_ACTION &&
+    !(block->command_words & ~bit(MODAL_GROUP_G1)) &&
+    (block->value_words & (bit(WORD_X) | bit(WORD_Y) | bit(WORD_Z))) &&
+    !(block->value_words & ~words) &&
+    (to[0] != from[0] || to[1] != from[1] || to[2] != from[2]);
+
+  int pushed = 0;
+  if (state->n && (!vertex || state->values.f != state->f ||
+		   state->values.s != state->s || state->modal.spindle != state->spindle))
+    pushed = simplify_run(state, out);
+  if (pushed < 0)
+    return -1;
+
+  if (!vertex) {
+    if (block_ring_push_copy(out, block) < 0)
+      return -1;
+    state->blocks_out++;
+    return pushed + 1;
+  }
+
+  if (!state->n) {
+    memcpy(state->pts[0], from, sizeof(state->pts[0]));
+    state->f = state->values.f;
+    state->s = state->values.s;
+    state->spindle = state->modal.spindle;
+  }
+  state->moves[state->n] = *block;
+  state->n++;
+  memcpy(state->pts[state->n], to, sizeof(state->pts[0]));
+
+  if (state->n == SIMPLIFY_MAX_MOVES) {
+    int n = simplify_run(state, out);
+    if (n < 0)
+      return -1;
+    pushed += n;
+  }
+  return pushed;
+}
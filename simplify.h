@@ -0,0 +1,44 @@
+#ifndef SIMPLIFY_H
+#define SIMPLIFY_H
+
+#include "gcode.h"
+#include "pipeline.h"
+
+// Merges runs of G1 moves into fewer moves. A run is consecutive G1
+// moves with the same feed, power and spindle state. Moves that carry on
+// in exactly the same direction are always merged, which loses nothing.
+// With a tolerance, the vertices the Douglas-Peucker algorithm finds
+// within it of the path that is left are dropped as well.
+// Blocks must be absolute and in mm.
+
+// Vertices held back at most. A longer run is simplified in pieces.
+#define SIMPLIFY_MAX_MOVES 256
+
+typedef struct {
+  float tol;      // Max distance of the vertices dropped from the path (mm)
+  gc_modal_t modal;
+  gc_values_t values;
+
+  // Run of moves held back, from pts[0] through pts[1..n]
+  parser_block_t moves[SIMPLIFY_MAX_MOVES];
+  float pts[SIMPLIFY_MAX_MOVES + 1][3];
+  size_t n;
+  float f, s;     // Feed, power and spindle state of the run
+  uint8_t spindle;
+
+  unsigned long blocks_in; // Blocks in and out, but for text
+  unsigned long blocks_out;
+} simplify_state_t;
+
+// tol: max distance of the vertices dropped from the path (mm), 0 to
+// merge exactly collinear moves only
+void simplify_init(simplify_state_t *state, float tol);
+
+// return value: Number of blocks pushed, -1 if out couldn't grow
+int simplify(simplify_state_t *state, parser_block_t *block, block_ring_t *out);
+
+// Pushes the run held back
+// return value: Number of blocks pushed, -1 if out couldn't grow
+int simplify_flush(simplify_state_t *state, block_ring_t *out);
+
+#endif
@@ -0,0 +1,80 @@
+#include <sched.h>
+#include <stdlib.h>
+#include "spsc_queue.h"
+
+// Checks of the other side's index before going to sleep
+#define SPSC_SPINS 200
+
+int spsc_queue_init(spsc_queue_t *q, size_t size) {
+  q->size = 1;
+  while (q->size < size)
+    q->size *= 2;
+  q->slots = malloc(q->size * sizeof(void *));
+  if (!q->slots)
+    return -1;
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+  atomic_init(&q->sleepers, 0);
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->wake, NULL);
+  return 0;
+}
+
+static int is_full(spsc_queue_t *q) {
+  return atomic_load(&q->tail) - atomic_load(&q->head) == q->size;
+}
+
+static int is_empty(spsc_queue_t *q) {
+  return atomic_load(&q->tail) == atomic_load(&q->head);
+}
+
+// Waits until blocked(q) is false. A sleeper registers before checking
+// again under the lock; the other side updates its index before looking
+// for sleepers. Both are sequentially consistent, so either the sleeper
+// sees the update or the other side sees the sleeper and wakes it.
+static void wait_while(spsc_queue_t *q, int (*blocked)(spsc_queue_t *)) {
+  for (int i = 0; i < SPSC_SPINS; i++) {
+    if (!blocked(q))
+      return;
+    sched_yield();
+  }
+
+  pthread_mutex_lock(&q->lock);
+  atomic_fetch_add(&q->sleepers, 1);
+  while (blocked(q))
+    pthread_cond_wait(&q->wake, &q->lock);
+  atomic_fetch_sub(&q->sleepers, 1);
+  pthread_mutex_unlock(&q->lock);
+}
+
+static void wake(spsc_queue_t *q) {
+  if (atomic_load(&q->sleepers)) {
+    pthread_mutex_lock(&q->lock);
+    pthread_cond_broadcast(&q->wake);
+    pthread_mutex_unlock(&q->lock);
+  }
+}
+
+void spsc_queue_push(spsc_queue_t *q, void *item) {
+  wait_while(q, is_full);
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  q->slots[tail & (q->size - 1)] = item;
+  atomic_store(&q->tail, tail + 1); // publishes the slot
+  wake(q);
+}
+
+void *spsc_queue_pop(spsc_queue_t *q) {
+  wait_while(q, is_empty);
+  size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  void *item = q->slots[head & (q->size - 1)];
+  atomic_store(&q->head, head + 1); // hands the slot back
+  wake(q);
+  return item;
+}
+
+void spsc_queue_destroy(spsc_queue_t *q) {
+  free(q->slots);
+  q->slots = NULL;
+  pthread_mutex_destroy(&q->lock);
+  pthread_cond_destroy(&q->wake);
+}
@@ -0,0 +1,38 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// Bounded queue of pointers between one producer thread and one consumer
+// thread. Pushing and popping are lock free. A side that finds the queue
+// full or empty yields the CPU a few times, then sleeps until the other
+// side makes progress.
+
+#define SPSC_CACHE_LINE 64
+
+typedef struct {
+  void **slots;
+  size_t size;                                  // a power of two
+  _Alignas(SPSC_CACHE_LINE) atomic_size_t head; // next slot to pop, counts up forever
+  _Alignas(SPSC_CACHE_LINE) atomic_size_t tail; // next slot to push, counts up forever
+  _Alignas(SPSC_CACHE_LINE) atomic_int sleepers;
+  pthread_mutex_t lock;                         // only taken to sleep and to wake
+  pthread_cond_t wake;
+} spsc_queue_t;
+
+// size: number of slots, rounded up to a power of two
+// return value: 0 on success, -1 if out of memory
+int spsc_queue_init(spsc_queue_t *q, size_t size);
+
+// Appends item, waiting while the queue is full. Producer only.
+void spsc_queue_push(spsc_queue_t *q, void *item);
+
+// Waits for an item, and removes it. Consumer only.
+// return value: the oldest item
+void *spsc_queue_pop(spsc_queue_t *q);
+
+void spsc_queue_destroy(spsc_queue_t *q);
+
+#endif
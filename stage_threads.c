@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pipeline.h"
+#include "scan.h"
+#include "stage_threads.h"
+
+int stage_threads_init(stage_threads_t *t,
+		       void (*transform)(void *, parse_chunk_t *),
+		       void (*finish)(void *),
+		       void (*write)(void *, parser_block_t *, size_t, const char *),
+		       void *state, stats_t *stats) {
+  memset(t, 0, sizeof(*t));
+  t->transform = transform;
+  t->finish = finish;
+  t->write = write;
+  t->state = state;
+  t->stats = stats;
+
+  // Room for every chunk and batch plus the end marker in each queue,
+  // so a push never has to wait for more than the other side's progress
+  if (spsc_queue_init(&t->to_parse, STAGE_THREADS_CHUNKS + 1) < 0 ||
+      spsc_queue_init(&t->parsed, STAGE_THREADS_CHUNKS + 1) < 0 ||
+      spsc_queue_init(&t->free_chunks, STAGE_THREADS_CHUNKS) < 0 ||
+      spsc_queue_init(&t->to_write, STAGE_THREADS_BATCHES + 1) < 0 ||
+      spsc_queue_init(&t->free_batches, STAGE_THREADS_BATCHES) < 0) {
+    stage_threads_destroy(t);
+    return -1;
+  }
+
+  for (int i = 0; i < STAGE_THREADS_CHUNKS; i++)
+    spsc_queue_push(&t->free_chunks, &t->chunks[i]);
+  for (int i = 1; i < STAGE_THREADS_BATCHES; i++)
+    spsc_queue_push(&t->free_batches, &t->batches[i]);
+  t->batch = &t->batches[0];
+  return 0;
+}
+
+// Makes room for n more blocks and len more bytes of text in batch
+static int batch_reserve(block_batch_t *batch, size_t n, size_t len) {
+  if (batch->blocks_size - batch->nblocks < n) {
+    size_t size = batch->blocks_size ? batch->blocks_size : STAGE_THREADS_BATCH_BLOCKS;
+    while (size - batch->nblocks < n)
+      size *= 2;
+    parser_block_t *blocks = realloc(batch->blocks, size * sizeof(parser_block_t));
+    if (!blocks)
+      return -1;
+    batch->blocks = blocks;
+    batch->blocks_size = size;
+  }
+  if (batch->text_size - batch->text_len < len) {
+    size_t size = batch->text_size ? batch->text_size : 256;
+    while (size - batch->text_len < len)
+      size *= 2;
+    char *text = realloc(batch->text, size);
+    if (!text)
+      return -1;
+    batch->text = text;
+    batch->text_size = size;
+  }
+  return 0;
+}
+
+void stage_threads_sink(void *state, parser_block_t *blocks, size_t n, const char *text) {
+  stage_threads_t *t = state;
+  block_batch_t *batch = t->batch;
+
+  if (batch_reserve(batch, n, 0) < 0) {
+    fprintf(stderr, "Could not allocate output batch\n");
+    exit(3);
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    parser_block_t *b = &batch->blocks[batch->nblocks++];
+    *b = blocks[i];
+    if (block_is_text(b)) {
+      // The pipeline reuses its text buffer once the line is printed
+      const char *line = text + b->values.n;
+      size_t len = strlen(line) + 1;
+      if (batch_reserve(batch, 0, len) < 0) {
+	fprintf(stderr, "Could not allocate output batch\n");
+	exit(3);
+      }
+      b->values.n = batch->text_len;
+      memcpy(batch->text + batch->text_len, line, len);
+      batch->text_len += len;
+    }
+  }
+
+  if (batch->nblocks >= STAGE_THREADS_BATCH_BLOCKS) {
+    spsc_queue_push(&t->to_write, batch);
+    t->batch = spsc_queue_pop(&t->free_batches);
+  }
+}
+
+static void *parser(void *arg) {
+  stage_threads_t *t = arg;
+  parse_chunk_t *c;
+
+  while ((c = spsc_queue_pop(&t->to_parse))) {
+    parse_chunk(c, t->stats);
+    spsc_queue_push(&t->parsed, c);
+  }
+  spsc_queue_push(&t->parsed, NULL);
+  return NULL;
+}
+
+static void *transformer(void *arg) {
+  stage_threads_t *t = arg;
+  parse_chunk_t *c;
+
+  while ((c = spsc_queue_pop(&t->parsed))) {
+    t->transform(t->state, c);
+    spsc_queue_push(&t->free_chunks, c);
+  }
+  t->finish(t->state);
+
+  if (t->batch->nblocks)
+    spsc_queue_push(&t->to_write, t->batch);
+  spsc_queue_push(&t->to_write, NULL);
+  return NULL;
+}
+
+static void *writer(void *arg) {
+  stage_threads_t *t = arg;
+  block_batch_t *batch;
+
+  while ((batch = spsc_queue_pop(&t->to_write))) {
+    t->write(t->state, batch->blocks, batch->nblocks, batch->text);
+    batch->nblocks = 0;
+    batch->text_len = 0;
+    spsc_queue_push(&t->free_batches, batch);
+  }
+  return NULL;
+}
+
+// Fills a free chunk with len bytes of complete lines, copied if the
+// input buffer is going to be reused, and queues it for parsing
+static void submit(stage_threads_t *t, const char *data, size_t len, int copy) {
+  parse_chunk_t *c = spsc_queue_pop(&t->free_chunks);
+
+  if (copy) {
+    if (c->copy_size < len) {
+      char *p = realloc(c->copy, len);
+      if (!p) {
+	perror("Could not queue input for parsing");
+	exit(3);
+      }
+      c->copy = p;
+      c->copy_size = len;
+    }
+    memcpy(c->copy, data, len);
+    data = c->copy;
+  }
+  c->data = data;
+  c->len = len;
+  spsc_queue_push(&t->to_parse, c);
+}
+
+int stage_threads_run(stage_threads_t *t, input_t *in) {
+  pthread_t threads[3];
+  void *(*const bodies[3])(void *) = { parser, transformer, writer };
+
+  for (int i = 0; i < 3; i++) {
+    if (pthread_create(&threads[i], NULL, bodies[i], t) != 0) {
+      // Nothing has been queued yet, so the end marker stops the started ones
+      spsc_queue_push(&t->to_parse, NULL);
+      for (int j = 0; j < i; j++)
+	pthread_join(threads[j], NULL);
+      return -1;
+    }
+  }
+
+  const char *chunk;
+  size_t chunk_len;
+  while (input_getlines(in, &chunk, &chunk_len)) {
+    // Split at line terminators into chunks of about PARSE_CHUNK_SIZE
+    while (chunk_len) {
+      size_t n = chunk_len;
+      if (n > PARSE_CHUNK_SIZE)
+	n = scan_eol(chunk + PARSE_CHUNK_SIZE, chunk + chunk_len) + 1 - chunk;
+      // read buffers are reused by the next input_getlines(), mappings stay put
+      submit(t, chunk, n, !in->mapped);
+      chunk += n;
+      chunk_len -= n;
+    }
+  }
+  spsc_queue_push(&t->to_parse, NULL);
+
+  for (int i = 0; i < 3; i++)
+    pthread_join(threads[i], NULL);
+  return 0;
+}
+
+void stage_threads_destroy(stage_threads_t *t) {
+  for (int i = 0; i < STAGE_THREADS_CHUNKS; i++) {
+    free(t->chunks[i].copy);
+    free(t->chunks[i].blocks);
+    free(t->chunks[i].info);
+  }
+  for (int i = 0; i < STAGE_THREADS_BATCHES; i++) {
+    free(t->batches[i].blocks);
+    free(t->batches[i].text);
+  }
+  spsc_queue_destroy(&t->to_parse);
+  spsc_queue_destroy(&t->parsed);
+  spsc_queue_destroy(&t->free_chunks);
+  spsc_queue_destroy(&t->to_write);
+  spsc_queue_destroy(&t->free_batches);
+  memset(t, 0, sizeof(*t));
+}
@@ -0,0 +1,80 @@
+#ifndef STAGE_THREADS_H
+#define STAGE_THREADS_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include "gcode.h"
+#include "input.h"
+#include "parse_pool.h"
+#include "spsc_queue.h"
+
+// Runs reading, parsing, the stateful stages and writing on a thread
+// each. Chunks of input lines and batches of output blocks are passed
+// between them through lock-free queues, and handed back through
+// queues of free ones for reuse, so the stages overlap and nothing is
+// allocated per chunk once the run is under way.
+//
+//   reader (caller's thread) -> parser -> transform -> writer
+
+// Chunks of input in flight between the reader and the transform stage
+#define STAGE_THREADS_CHUNKS 4
+
+// Batches of output in flight between the transform stage and the writer
+#define STAGE_THREADS_BATCHES 4
+
+// Blocks collected before a batch is passed on to the writer
+#define STAGE_THREADS_BATCH_BLOCKS 4096
+
+// Blocks coming out of the back end, with the lines of their text
+// blocks, on their way to the writer
+typedef struct {
+  parser_block_t *blocks;
+  size_t nblocks;
+  size_t blocks_size;
+  char *text;      // NUL terminated lines, at values.n of text blocks
+  size_t text_len;
+  size_t text_size;
+} block_batch_t;
+
+typedef struct {
+  // Runs the parsed lines of a chunk through the stages. Called on the
+  // transform thread, in input order.
+  void (*transform)(void *state, parse_chunk_t *chunk);
+  // Pushes out whatever the stages hold back, at the end of the input.
+  // Called on the transform thread.
+  void (*finish)(void *state);
+  // Writes blocks out. Called on the writer thread, in order.
+  void (*write)(void *state, parser_block_t *blocks, size_t n, const char *text);
+  void *state;
+  stats_t *stats;          // Parsing counted here unless NULL
+
+  parse_chunk_t chunks[STAGE_THREADS_CHUNKS];
+  block_batch_t batches[STAGE_THREADS_BATCHES];
+  block_batch_t *batch;    // Batch being filled by the transform thread
+
+  spsc_queue_t to_parse;   // reader -> parser
+  spsc_queue_t parsed;     // parser -> transform
+  spsc_queue_t free_chunks; // transform -> reader
+  spsc_queue_t to_write;   // transform -> writer
+  spsc_queue_t free_batches; // writer -> transform
+} stage_threads_t;
+
+// return value: 0 on success, -1 if out of memory
+int stage_threads_init(stage_threads_t *t,
+		       void (*transform)(void *, parse_chunk_t *),
+		       void (*finish)(void *),
+		       void (*write)(void *, parser_block_t *, size_t, const char *),
+		       void *state, stats_t *stats);
+
+// Sink for the pipeline of stages run by transform. Collects the blocks
+// into batches for the writer thread. state is the stage_threads_t.
+void stage_threads_sink(void *state, parser_block_t *blocks, size_t n, const char *text);
+
+// Reads all of in on the calling thread, and returns once everything
+// has been written
+// return value: 0 on success, -1 if the threads couldn't be started
+int stage_threads_run(stage_threads_t *t, input_t *in);
+
+void stage_threads_destroy(stage_threads_t *t);
+
+#endif
@@ -0,0 +1,78 @@
+#include "stats.h"
+
+static const char *stage_names[STATS_STAGES] = {
+  "scan", "parse", "to_mm", "toabs", "arcfit", "simplify", "reorder", "mode",
+  "fromabs", "from_mm", "cleanup", "print"
+};
+
+void stats_add(stats_t *stats, int stage, const stats_stage_t *s) {
+  stats_stage_t *t = &stats->stage[stage];
+  stats_count(&t->ns, s->ns);
+  stats_count(&t->blocks_in, s->blocks_in);
+  stats_count(&t->blocks_out, s->blocks_out);
+  if (s->bytes_in)
+    stats_count(&t->bytes_in, s->bytes_in);
+  if (s->bytes_out)
+    stats_count(&t->bytes_out, s->bytes_out);
+}
+
+void stats_merge(stats_t *to, const stats_t *from) {
+  for (int i = 0; i < STATS_STAGES; i++)
+    stats_add(to, i, &from->stage[i]);
+  for (int i = 0; i < 256; i++)
+    if (from->errors[i])
+      stats_count(&to->errors[i], from->errors[i]);
+  stats_count(&to->extensions, from->extensions);
+  stats_count(&to->swivels, from->swivels);
+}
+
+void stats_print(FILE *fp, const stats_t *stats, int json) {
+  if (json) {
+    fprintf(fp, "{\"stages\": {");
+    const char *sep = "";
+    for (int i = 0; i < STATS_STAGES; i++) {
+      const stats_stage_t *s = &stats->stage[i];
+      if (!s->blocks_in && !s->blocks_out)
+	continue;
+      fprintf(fp, "%s\"%s\": {\"ns\": %llu, \"blocks_in\": %llu, \"blocks_out\": %llu, "
+	      "\"bytes_in\": %llu, \"bytes_out\": %llu}", sep, stage_names[i],
+	      (unsigned long long) s->ns, (unsigned long long) s->blocks_in,
+	      (unsigned long long) s->blocks_out, (unsigned long long) s->bytes_in,
+	      (unsigned long long) s->bytes_out);
+      sep = ", ";
+    }
+    fprintf(fp, "}, \"errors\": {");
+    sep = "";
+    for (int i = 0; i < 256; i++)
+      if (stats->errors[i]) {
+	fprintf(fp, "%s\"%d\": %llu", sep, i, (unsigned long long) stats->errors[i]);
+	sep = ", ";
+      }
+    fprintf(fp, "}, \"extensions\": %llu, \"swivels\": %llu}\n",
+	    (unsigned long long) stats->extensions, (unsigned long long) stats->swivels);
+    return;
+  }
+
+  uint64_t total = 0;
+  for (int i = 0; i < STATS_STAGES; i++)
+    total += stats->stage[i].ns;
+  fprintf(fp, "%-9s %10s %6s %8s %11s %11s %12s %12s\n", "stage", "ms", "%", "ns/in",
+	  "blocks in", "blocks out", "bytes in", "bytes out");
+  for (int i = 0; i < STATS_STAGES; i++) {
+    const stats_stage_t *s = &stats->stage[i];
+    if (!s->blocks_in && !s->blocks_out)
+      continue;
+    fprintf(fp, "%-9s %10.1f %6.1f %8.1f %11llu %11llu %12llu %12llu\n", stage_names[i],
+	    s->ns / 1e6, total ? 100. * s->ns / total : 0.,
+	    s->blocks_in ? (double) s->ns / s->blocks_in : 0.,
+	    (unsigned long long) s->blocks_in, (unsigned long long) s->blocks_out,
+	    (unsigned long long) s->bytes_in, (unsigned long long) s->bytes_out);
+  }
+  for (int i = 0; i < 256; i++)
+    if (stats->errors[i])
+      fprintf(fp, "error %d: %llu lines\n", i, (unsigned long long) stats->errors[i]);
+  if (stats->extensions)
+    fprintf(fp, "extensions: %llu moves\n", (unsigned long long) stats->extensions);
+  if (stats->swivels)
+    fprintf(fp, "swivels: %llu arcs\n", (unsigned long long) stats->swivels);
+}
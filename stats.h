@@ -0,0 +1,92 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+// Time spent in each stage and what went through it, for --stats. Each
+// filter counts into the stats_t it is given, so there is no global
+// state; the stages count only when built with GFILTER_STATS defined and
+// the stats_t pointer isn't NULL. Without GFILTER_STATS, STATS_ON() is 0
+// and the compiler drops the counting altogether. Any thread may count.
+
+enum {
+  STATS_SCAN,     // scan_eol() and scan_line()
+  STATS_PARSE,    // gc_parse_line()
+  STATS_TO_MM,
+  STATS_TOABS,    // or abs_follow() for input in mm and absolute already
+  STATS_ARCFIT,
+  STATS_SIMPLIFY,
+  STATS_REORDER,
+  STATS_MODE,     // lasermode() or dragmode()
+  STATS_FROMABS,  // or abs_follow() for output in mm and absolute
+  STATS_FROM_MM,
+  STATS_CLEANUP,
+  STATS_PRINT,    // gc_print_line(), and the lines printed as they are
+  STATS_STAGES
+};
+
+typedef struct {
+  uint64_t ns;         // Time spent in the stage
+  uint64_t blocks_in;  // Lines or blocks in and out
+  uint64_t blocks_out;
+  uint64_t bytes_in;   // Text in and out, for the stages that read or write text
+  uint64_t bytes_out;
+} stats_stage_t;
+
+typedef struct {
+  stats_stage_t stage[STATS_STAGES];
+  uint64_t errors[256]; // Lines rejected, by status code
+  uint64_t extensions;  // Moves inserted by laser mode
+  uint64_t swivels;     // Swivel arcs inserted by the drag knife
+} stats_t;
+
+#ifdef GFILTER_STATS
+#define STATS_ON(s) ((s) != NULL)
+#else
+#define STATS_ON(s) 0
+#endif
+
+static inline uint64_t stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// return value: the time a stage starts at, 0 when not counting
+static inline uint64_t stats_start(const stats_t *s) {
+  return STATS_ON(s) ? stats_now() : 0;
+}
+
+static inline void stats_count(uint64_t *counter, uint64_t n) {
+  __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+// Adds what a stage counted on its own to stats->stage[stage]
+void stats_add(stats_t *stats, int stage, const stats_stage_t *s);
+
+// Adds the time since t0 and the blocks and bytes to stats->stage[stage]
+// return value: the time now, for the next stage to start at
+static inline uint64_t stats_lap(stats_t *stats, int stage, uint64_t t0, uint64_t blocks_in,
+				 uint64_t blocks_out, uint64_t bytes_in, uint64_t bytes_out) {
+  uint64_t t = stats_now();
+  stats_stage_t s = { t - t0, blocks_in, blocks_out, bytes_in, bytes_out };
+  stats_add(stats, stage, &s);
+  return t;
+}
+
+// Adds the time since *t to s, and sets *t to now
+static inline void stats_time(stats_stage_t *s, uint64_t *t) {
+  uint64_t now = stats_now();
+  s->ns += now - *t;
+  *t = now;
+}
+
+// Adds all counts of from to to
+void stats_merge(stats_t *to, const stats_t *from);
+
+// Prints stats to fp as a table, or as one line of JSON
+void stats_print(FILE *fp, const stats_t *stats, int json);
+
+#endif